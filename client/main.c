@@ -159,6 +159,23 @@ scas_parse_arg_mount(void *context, const struct scas_arg_t *arg, const char *va
     mount_snapshot_id = scas_strdup(value);
 }
 
+static void
+scas_parse_arg_hash(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    enum scas_hash_algorithm_t algorithm;
+
+    UNUSED(context);
+    UNUSED(arg);
+
+    if (scas_hash_algorithm_from_name(value, &algorithm) != 0)
+    {
+        fprintf(stderr, "Unknown hash algorithm %s.\n", value);
+        exit(EXIT_FAILURE);
+    }
+
+    scas_hash_set_algorithm(algorithm);
+}
+
 static void
 scas_parse_arg_create(void *context, const struct scas_arg_t *arg, const char *value)
 {
@@ -213,6 +230,7 @@ scas_parse_args(int argc, char **argv)
         { "-r", "--reset",  ARG_TYPE_SWITCH,    scas_parse_arg_reset },
         { "-m", "--mount",  ARG_TYPE_PARAMETER, scas_parse_arg_mount },
         { "-c", "--create", ARG_TYPE_PARAMETER, scas_parse_arg_create },
+        { "-H", "--hash",   ARG_TYPE_PARAMETER, scas_parse_arg_hash },
     };
     struct scas_arg_context_t context = 
     {
@@ -4,6 +4,8 @@
  * See LICENSE for details.
  ***********************************************************************/
 
+#include <unistd.h>
+
 #include "scas_base.h"
 #include "scas_net.h"
 #include "scas_mount.h"
@@ -22,6 +24,12 @@ scas_mount_snapshot(const char *server_name, const char *snapshot_name)
         return -ENOCONN;
     }
 
+    if (scas_handshake(sockfd) != 0)
+    {
+        close(sockfd);
+        return -EMISMATCH;
+    }
+
     return 1;
 }
 
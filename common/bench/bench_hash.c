@@ -0,0 +1,347 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+/*
+ * Hash throughput benchmark. For each object size from 0 bytes up to
+ * --max-size (1 GB by default), times the ways objects get hashed:
+ *
+ *   single     scas_hash_buffer over one object
+ *   batch      scas_hash_buffers over a batch of same-sized objects
+ *   streaming  scas_hash_init/update/final, fed STREAM_UPDATE_SIZE at a time
+ *   tree       scas_hash_buffer_tree over one object
+ *
+ * Results go to stdout as CSV, one row per variant and size:
+ *
+ *   algorithm,kernel,variant,size_bytes,ops,ns_per_op,mb_per_s
+ *
+ * Each measurement repeats until at least --min-time seconds have passed,
+ * so small sizes get many iterations and large ones just a few. --kernel and
+ * --mb-kernel force a particular SHA-1 kernel instead of the one the CPU
+ * would get.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scas_arg_parse.h"
+#include "scas_base.h"
+#include "scas_sha1.h"
+
+#define DEFAULT_MAX_SIZE ((size_t)1 << 30)
+#define DEFAULT_MIN_TIME 0.25
+#define MAX_BATCH_SIZE 64
+#define STREAM_UPDATE_SIZE ((size_t)64 * 1024)
+
+enum bench_variant_t
+{
+    VARIANT_SINGLE,
+    VARIANT_BATCH,
+    VARIANT_STREAMING,
+    VARIANT_TREE,
+    NUM_VARIANTS
+};
+
+static const char *const variant_names[NUM_VARIANTS] =
+{
+    "single",
+    "batch",
+    "streaming",
+    "tree"
+};
+
+struct bench_options_t
+{
+    size_t max_size;
+    double min_time;
+    const char *algorithm;
+    const char *kernel;
+    const char *mb_kernel;
+};
+
+/*
+ * Results are folded into this so the compiler can't discard the hashing.
+ */
+static volatile uint32_t sink;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void
+consume(struct scas_hash_t hash)
+{
+    sink ^= hash.hash[0];
+}
+
+/*
+ * Runs one iteration of a variant, returning the number of objects hashed.
+ */
+static size_t
+run_variant(enum bench_variant_t variant, const unsigned char *buffer, size_t buffer_size, size_t size)
+{
+    switch (variant)
+    {
+        case VARIANT_SINGLE:
+            consume(scas_hash_buffer(buffer, size));
+            return 1;
+
+        case VARIANT_BATCH:
+            {
+                const void *ptrs[MAX_BATCH_SIZE];
+                size_t sizes[MAX_BATCH_SIZE] = { 0 };
+                struct scas_hash_t out[MAX_BATCH_SIZE];
+                size_t num_objects;
+                size_t i;
+
+                /*
+                 * Objects are consecutive slices of the buffer, so large
+                 * sizes get smaller batches.
+                 */
+                num_objects = size == 0 ? MAX_BATCH_SIZE : buffer_size / size;
+                num_objects = num_objects < MAX_BATCH_SIZE ? num_objects : MAX_BATCH_SIZE;
+
+                for (i = 0; i < num_objects; ++i)
+                {
+                    ptrs[i] = buffer + i * size;
+                    sizes[i] = size;
+                }
+
+                scas_hash_buffers(ptrs, sizes, num_objects, out);
+
+                for (i = 0; i < num_objects; ++i)
+                {
+                    consume(out[i]);
+                }
+
+                return num_objects;
+            }
+
+        case VARIANT_STREAMING:
+            {
+                struct scas_hash_ctx_t ctx;
+                size_t offset;
+
+                scas_hash_init(&ctx);
+
+                for (offset = 0; offset < size; offset += STREAM_UPDATE_SIZE)
+                {
+                    size_t remaining;
+
+                    remaining = size - offset;
+                    scas_hash_update(&ctx, buffer + offset, remaining < STREAM_UPDATE_SIZE ? remaining : STREAM_UPDATE_SIZE);
+                }
+
+                consume(scas_hash_final(&ctx));
+                return 1;
+            }
+
+        case VARIANT_TREE:
+            consume(scas_hash_buffer_tree(buffer, size));
+            return 1;
+
+        default:
+            BREAK();
+            return 0;
+    }
+}
+
+static void
+bench(const struct bench_options_t *options, enum bench_variant_t variant, const unsigned char *buffer, size_t size)
+{
+    const char *kernel;
+    size_t ops;
+    double start;
+    double elapsed;
+    double ns_per_op;
+    double mb_per_s;
+
+    /*
+     * One untimed pass to fault in the buffer and warm the caches.
+     */
+    run_variant(variant, buffer, options->max_size, size);
+
+    ops = 0;
+    start = now();
+
+    do
+    {
+        ops += run_variant(variant, buffer, options->max_size, size);
+        elapsed = now() - start;
+    }
+    while (elapsed < options->min_time);
+
+    ns_per_op = elapsed * 1e9 / (double)ops;
+    mb_per_s = (double)size * (double)ops / elapsed / 1e6;
+
+    kernel = scas_hash_get_algorithm() != HASH_ALGORITHM_BLAKE3
+        ? (variant == VARIANT_BATCH ? scas_sha1_mb_kernel_name() : scas_sha1_kernel_name())
+        : "default";
+
+    printf("%s,%s,%s,%lu,%lu,%.1f,%.1f\n",
+        scas_hash_algorithm_name(scas_hash_get_algorithm()),
+        kernel,
+        variant_names[variant],
+        (unsigned long)size,
+        (unsigned long)ops,
+        ns_per_op,
+        mb_per_s);
+    fflush(stdout);
+}
+
+static void
+parse_arg_max_size(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    struct bench_options_t *options;
+
+    UNUSED(arg);
+
+    options = context;
+    options->max_size = (size_t)strtoull(value, NULL, 0);
+}
+
+static void
+parse_arg_min_time(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    struct bench_options_t *options;
+
+    UNUSED(arg);
+
+    options = context;
+    options->min_time = strtod(value, NULL);
+}
+
+static void
+parse_arg_algorithm(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    struct bench_options_t *options;
+
+    UNUSED(arg);
+
+    options = context;
+    options->algorithm = value;
+}
+
+static void
+parse_arg_kernel(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    struct bench_options_t *options;
+
+    UNUSED(arg);
+
+    options = context;
+    options->kernel = value;
+}
+
+static void
+parse_arg_mb_kernel(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    struct bench_options_t *options;
+
+    UNUSED(arg);
+
+    options = context;
+    options->mb_kernel = value;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct scas_arg_t args[] =
+    {
+        { "-s", "--max-size",  ARG_TYPE_PARAMETER, parse_arg_max_size },
+        { "-t", "--min-time",  ARG_TYPE_PARAMETER, parse_arg_min_time },
+        { "-a", "--algorithm", ARG_TYPE_PARAMETER, parse_arg_algorithm },
+        { "-k", "--kernel",    ARG_TYPE_PARAMETER, parse_arg_kernel },
+        { "-m", "--mb-kernel", ARG_TYPE_PARAMETER, parse_arg_mb_kernel },
+    };
+    struct bench_options_t options =
+    {
+        DEFAULT_MAX_SIZE,
+        DEFAULT_MIN_TIME,
+        NULL,
+        NULL,
+        NULL
+    };
+    struct scas_arg_context_t context =
+    {
+        argc,
+        argv,
+        &options,
+        sizeof args / sizeof args[0],
+        args,
+        NULL
+    };
+    unsigned char *buffer;
+    size_t size;
+    size_t i;
+
+    scas_arg_parse(&context);
+
+    if (options.algorithm != NULL)
+    {
+        enum scas_hash_algorithm_t algorithm;
+
+        if (scas_hash_algorithm_from_name(options.algorithm, &algorithm) != 0)
+        {
+            fprintf(stderr, "Unknown hash algorithm %s.\n", options.algorithm);
+            return EXIT_FAILURE;
+        }
+
+        scas_hash_set_algorithm(algorithm);
+    }
+
+    if (options.kernel != NULL && scas_sha1_select_kernel(options.kernel) != 0)
+    {
+        fprintf(stderr, "SHA-1 kernel %s is unknown or unsupported.\n", options.kernel);
+        return EXIT_FAILURE;
+    }
+
+    if (options.mb_kernel != NULL && scas_sha1_select_mb_kernel(options.mb_kernel) != 0)
+    {
+        fprintf(stderr, "SHA-1 multi-buffer kernel %s is unknown or unsupported.\n", options.mb_kernel);
+        return EXIT_FAILURE;
+    }
+
+    buffer = malloc(options.max_size + 1);
+
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Unable to allocate %lu bytes.\n", (unsigned long)options.max_size);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < options.max_size; ++i)
+    {
+        buffer[i] = (unsigned char)(i * 2654435761u >> 24);
+    }
+
+    printf("algorithm,kernel,variant,size_bytes,ops,ns_per_op,mb_per_s\n");
+
+    /*
+     * 0 bytes, then every power of four from 64 bytes up to the maximum.
+     */
+    for (size = 0; size <= options.max_size; size = size == 0 ? 64 : size * 4)
+    {
+        int variant;
+
+        for (variant = 0; variant < NUM_VARIANTS; ++variant)
+        {
+            bench(&options, (enum bench_variant_t)variant, buffer, size);
+        }
+    }
+
+    free(buffer);
+
+    return EXIT_SUCCESS;
+}
@@ -41,7 +41,11 @@ find_short_arg(const char *arg_string, size_t num_args, const struct scas_arg_t
 
         if (strstr(arg_string, short_form) == arg_string)
         {
-            if (args[i].type == ARG_TYPE_PARAMETER)
+            /*
+             * The value is either attached, as in "-t4", or the next
+             * argument.
+             */
+            if (args[i].type == ARG_TYPE_PARAMETER && arg_string[short_form_length] != 0)
             {
                 *value = arg_string + short_form_length;
             }
@@ -135,6 +139,14 @@ scas_arg_parse(struct scas_arg_context_t *context)
 
             positional_callback(callback_context, &positional_arg, argv[i]);
         } 
+        else if (arg == NULL)
+        {
+            /*
+             * Without a positional callback unrecognized arguments are left
+             * for someone else to consume, as the client does for FUSE.
+             */
+            continue;
+        }
         else if (arg->type == ARG_TYPE_PARAMETER)
         {
             if (value == NULL)
@@ -6,14 +6,17 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "scas_base.h"
+#include "scas_sha1.h"
 
 static FILE *log;
 
@@ -70,7 +73,7 @@ scas_mkdir(const char *dir)
 {
     int result;
 
-    result = mkdir(dir, S_IRUSR | S_IWUSR);
+    result = mkdir(dir, S_IRWXU);
 
     if (result != 0)
     {
@@ -99,21 +102,23 @@ scas_mkdir(const char *dir)
     }
 }
 
+void
+scas_fsync_directory(const char *dir)
+{
+    int fd;
+
+    fd = open(dir, O_RDONLY);
+    VERIFY(fd >= 0);
+    VERIFY(fsync(fd) == 0);
+    close(fd);
+}
+
 union uint64_to_bytes_t
 {
     uint64_t u8;
     char bytes[8];
 };
 
-static inline uint32_t
-u32_to_big_endian(uint32_t p)
-{
-    return ((p & 0x000000FF) << 24)
-        | ((p & 0x0000FF00) << 8)
-        | ((p & 0x00FF0000) >> 8)
-        | ((p & 0xFF000000) >> 24);
-}
-
 static inline void
 write_length(unsigned char *ptr, uint64_t length)
 {
@@ -129,174 +134,228 @@ write_length(unsigned char *ptr, uint64_t length)
     }
 }
 
-static inline uint32_t
-left_rotate_1(uint32_t val)
-{
-    return (val << 1) | (val >> 31);
-}
-
-static inline uint32_t
-left_rotate_5(uint32_t val)
-{
-    return (val << 5) | (val >> 27);
-}
-
-static inline uint32_t
-left_rotate_30(uint32_t val)
-{
-    return (val << 30) | (val >> 2);
-}
-
+/*
+ * Builds the final one or two padded blocks of a message of the given total
+ * length, where tail points at its last (length & 63) bytes. last_chunk must
+ * be zeroed. Returns the number of blocks written.
+ *
+ * HASH_ALGORITHM_SHA1 has always given a message whose length is 55 mod 64
+ * a second block, which standard SHA-1 doesn't do. Every object in its
+ * stores is named by it, so it is kept; HASH_ALGORITHM_SHA1_FIPS pads as the
+ * standard does.
+ */
 static inline size_t
-initialize_last_chunk(unsigned char last_chunk[128], const void *data, size_t length)
+pad_last_chunk(unsigned char last_chunk[128], const void *tail, uint64_t length,
+    enum scas_hash_algorithm_t algorithm)
 {
     size_t remainder;
-    const unsigned char *ptr;
+    size_t limit;
 
-    ptr = data;
-    remainder = length & 63;
-    memmove(last_chunk, ptr + (length & (~63)), remainder);
+    remainder = (size_t)(length & 63);
+    limit = algorithm == HASH_ALGORITHM_SHA1_FIPS ? 56 : 55;
+    memmove(last_chunk, tail, remainder);
     last_chunk[remainder] = 0x80;
 
-    if (remainder >= 55)
+    if (remainder >= limit)
     {
         write_length(last_chunk + 120, length);
-        ptr = last_chunk;
         return 2;
     }
 
     write_length(last_chunk + 56, length);
-    ptr = last_chunk;
     return 1;
 }
 
+static inline size_t
+initialize_last_chunk(unsigned char last_chunk[128], const void *data, size_t length,
+    enum scas_hash_algorithm_t algorithm)
+{
+    const unsigned char *ptr;
+
+    ptr = data;
+
+    return pad_last_chunk(last_chunk, ptr + (length & (~63)), length, algorithm);
+}
+
 static inline struct scas_hash_t
-hash_chunk(struct scas_hash_t h, const void *mem)
+initial_hash(void)
 {
-    uint32_t buf[80];
-    int i;
-    uint32_t a;
-    uint32_t b;
-    uint32_t c;
-    uint32_t d;
-    uint32_t e;
-    uint32_t f;
-    uint32_t k;
-    uint32_t temp;
-    const uint32_t *ptr;
-
-    ptr = mem;
-
-    buf[0] = u32_to_big_endian(ptr[0]);
-    buf[1] = u32_to_big_endian(ptr[1]);
-    buf[2] = u32_to_big_endian(ptr[2]);
-    buf[3] = u32_to_big_endian(ptr[3]);
-    buf[4] = u32_to_big_endian(ptr[4]);
-    buf[5] = u32_to_big_endian(ptr[5]);
-    buf[6] = u32_to_big_endian(ptr[6]);
-    buf[7] = u32_to_big_endian(ptr[7]);
-    buf[8] = u32_to_big_endian(ptr[8]);
-    buf[9] = u32_to_big_endian(ptr[9]);
-    buf[10] = u32_to_big_endian(ptr[10]);
-    buf[11] = u32_to_big_endian(ptr[11]);
-    buf[12] = u32_to_big_endian(ptr[12]);
-    buf[13] = u32_to_big_endian(ptr[13]);
-    buf[14] = u32_to_big_endian(ptr[14]);
-    buf[15] = u32_to_big_endian(ptr[15]);
-
-    for (i = 16; i < 80; ++i)
-    {
-        buf[i] = left_rotate_1((buf[i - 3] ^ buf[i - 8] ^ buf[i - 14] ^ buf[i - 16]));
-    }
+    struct scas_hash_t rv;
 
-    a = h.hash[0];
-    b = h.hash[1];
-    c = h.hash[2];
-    d = h.hash[3];
-    e = h.hash[4];
-
-    #define ITERATE() { \
-        temp = left_rotate_5(a) + f + e + k + buf[i]; \
-        e = d; \
-        d = c; \
-        c = left_rotate_30(b); \
-        b = a; \
-        a = temp; \
-    }
+    memset(&rv, 0, sizeof rv);
+    rv.hash[0] = 0x67452301;
+    rv.hash[1] = 0xefcdab89;
+    rv.hash[2] = 0x98badcfe;
+    rv.hash[3] = 0x10325476;
+    rv.hash[4] = 0xc3d2e1f0;
 
-    k = 0x5a827999;
-    for (i = 0; i < 20; ++i)
-    {
-        f = (b & c) | ((~b) & d);
-        ITERATE();
-    }
+    return rv;
+}
 
-    k = 0x6ed9eba1;
-    for (; i < 40; ++i)
-    {
-        f = b ^ c ^ d;
-        ITERATE();
-    }
+static enum scas_hash_algorithm_t hash_algorithm = HASH_ALGORITHM_SHA1;
+
+static const char *const hash_algorithm_names[NUM_HASH_ALGORITHMS] =
+{
+    "sha1",
+    "blake3",
+    "sha1-fips"
+};
+
+static const size_t hash_digest_sizes[NUM_HASH_ALGORITHMS] =
+{
+    20,
+    32,
+    20
+};
+
+void
+scas_hash_set_algorithm(enum scas_hash_algorithm_t algorithm)
+{
+    assert(algorithm < NUM_HASH_ALGORITHMS);
+    hash_algorithm = algorithm;
+}
+
+enum scas_hash_algorithm_t
+scas_hash_get_algorithm(void)
+{
+    return hash_algorithm;
+}
 
-    k = 0x8f1bbcdc;
-    for (; i < 60; ++i)
+const char *
+scas_hash_algorithm_name(enum scas_hash_algorithm_t algorithm)
+{
+    if (algorithm >= NUM_HASH_ALGORITHMS)
     {
-        f = (b & c) | (b & d) | (c & d);
-        ITERATE();
+        return "unknown";
     }
 
-    k = 0xca62c1d6;
-    for (; i < 80; ++i)
+    return hash_algorithm_names[algorithm];
+}
+
+int
+scas_hash_algorithm_from_name(const char *name, enum scas_hash_algorithm_t *algorithm)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_HASH_ALGORITHMS; ++i)
     {
-        f = b ^ c ^ d;
-        ITERATE();
+        if (strcmp(name, hash_algorithm_names[i]) == 0)
+        {
+            *algorithm = (enum scas_hash_algorithm_t)i;
+            return 0;
+        }
     }
 
-    h.hash[0] = h.hash[0] + a;
-    h.hash[1] = h.hash[1] + b;
-    h.hash[2] = h.hash[2] + c;
-    h.hash[3] = h.hash[3] + d;
-    h.hash[4] = h.hash[4] + e;
+    return -1;
+}
 
-    return h;
+size_t
+scas_hash_digest_size(void)
+{
+    return hash_digest_sizes[hash_algorithm];
 }
 
-struct scas_hash_t
-scas_hash_buffer(const void *data, size_t length)
+static struct scas_hash_t
+sha1_hash_buffer(const void *data, size_t length)
 {
     unsigned char last_chunk[128];
-    const unsigned char *string;
-    size_t i;
     struct scas_hash_t rv;
-    size_t num_chunks;
     size_t num_extra_chunks;
 
-    string = data;
-
-    rv.hash[0] = 0x67452301;
-    rv.hash[1] = 0xefcdab89;
-    rv.hash[2] = 0x98badcfe;
-    rv.hash[3] = 0x10325476;
-    rv.hash[4] = 0xc3d2e1f0;
+    rv = initial_hash();
 
-    num_chunks = length / 64;
     memset(last_chunk, 0, sizeof last_chunk);
-    num_extra_chunks = initialize_last_chunk(last_chunk, string, length);
-    
-    for (i = 0; i < num_chunks; ++i)
+    num_extra_chunks = initialize_last_chunk(last_chunk, data, length, hash_algorithm);
+
+    scas_sha1_compress(&rv, data, length / 64);
+    scas_sha1_compress(&rv, last_chunk, num_extra_chunks);
+
+    return rv;
+}
+
+static struct scas_hash_t
+blake3_hash_buffer(const void *data, size_t length)
+{
+    struct scas_blake3_t hasher;
+    struct scas_hash_t rv;
+
+    scas_blake3_init(&hasher);
+    scas_blake3_update(&hasher, data, length);
+    scas_blake3_final(&hasher, rv.hash);
+
+    return rv;
+}
+
+struct scas_hash_t
+scas_hash_buffer(const void *data, size_t length)
+{
+    switch (hash_algorithm)
     {
-        rv = hash_chunk(rv, string);
-        string += 64;
+        case HASH_ALGORITHM_BLAKE3:
+            return blake3_hash_buffer(data, length);
+        default:
+            return sha1_hash_buffer(data, length);
     }
+}
 
-    string = last_chunk;
-    for (i = 0; i < num_extra_chunks; ++i)
+/*
+ * Jobs are built and handed to the multi-buffer kernels in batches of this
+ * size so the padded tails can live on the stack.
+ */
+#define HASH_BATCH_SIZE 64
+
+void
+scas_hash_buffers(const void **ptrs, const size_t *sizes, size_t n, struct scas_hash_t *out)
+{
+    struct scas_sha1_job_t jobs[HASH_BATCH_SIZE];
+    unsigned char tails[HASH_BATCH_SIZE][128];
+
+    /*
+     * BLAKE3 already spreads each input over SIMD lanes a chunk at a time,
+     * so only SHA-1 benefits from interleaving separate inputs.
+     */
+    if (hash_algorithm == HASH_ALGORITHM_BLAKE3)
     {
-        rv = hash_chunk(rv, string);
-        string += 64;
+        size_t i;
+
+        for (i = 0; i < n; ++i)
+        {
+            out[i] = scas_hash_buffer(ptrs[i], sizes[i]);
+        }
+
+        return;
     }
 
-    return rv;
+    while (n > 0)
+    {
+        size_t batch_size;
+        size_t i;
+
+        batch_size = n < HASH_BATCH_SIZE ? n : HASH_BATCH_SIZE;
+        memset(tails, 0, batch_size * sizeof tails[0]);
+
+        for (i = 0; i < batch_size; ++i)
+        {
+            jobs[i].data = ptrs[i];
+            jobs[i].num_blocks = sizes[i] / 64;
+            jobs[i].tail = tails[i];
+            jobs[i].num_tail_blocks = initialize_last_chunk(tails[i], ptrs[i], sizes[i],
+                hash_algorithm);
+            jobs[i].hash = initial_hash();
+        }
+
+        scas_sha1_compress_jobs(jobs, batch_size);
+
+        for (i = 0; i < batch_size; ++i)
+        {
+            out[i] = jobs[i].hash;
+        }
+
+        ptrs += batch_size;
+        sizes += batch_size;
+        out += batch_size;
+        n -= batch_size;
+    }
 }
 
 struct scas_hash_t
@@ -305,3 +364,119 @@ scas_hash_string(const char *string)
     return scas_hash_buffer(string, strlen(string));
 }
 
+void
+scas_hash_init(struct scas_hash_ctx_t *ctx)
+{
+    ctx->algorithm = hash_algorithm;
+
+    switch (ctx->algorithm)
+    {
+        case HASH_ALGORITHM_BLAKE3:
+            scas_blake3_init(&ctx->state.blake3);
+            break;
+        default:
+            ctx->state.sha1.hash = initial_hash();
+            ctx->state.sha1.length = 0;
+            break;
+    }
+}
+
+void
+scas_hash_init_salted(struct scas_hash_ctx_t *ctx, const char *salt)
+{
+    struct scas_hash_t key;
+
+    /*
+     * SHA-1 starts from the hash of the salt rather than its standard
+     * initial state; BLAKE3 uses the hash of the salt as a key.
+     */
+    key = scas_hash_string(salt);
+    scas_hash_init(ctx);
+
+    switch (ctx->algorithm)
+    {
+        case HASH_ALGORITHM_BLAKE3:
+            scas_blake3_init_keyed(&ctx->state.blake3, key.hash);
+            break;
+        default:
+            ctx->state.sha1.hash = key;
+            break;
+    }
+}
+
+static void
+sha1_update(struct scas_sha1_ctx_t *ctx, const void *data, size_t length)
+{
+    const unsigned char *ptr;
+    size_t buffered;
+
+    ptr = data;
+    buffered = (size_t)(ctx->length & 63);
+    ctx->length += length;
+
+    /*
+     * Top up a partially filled block from a previous update first.
+     */
+    if (buffered != 0)
+    {
+        size_t needed;
+
+        needed = 64 - buffered;
+
+        if (length < needed)
+        {
+            memcpy(ctx->buffer + buffered, ptr, length);
+            return;
+        }
+
+        memcpy(ctx->buffer + buffered, ptr, needed);
+        scas_sha1_compress(&ctx->hash, ctx->buffer, 1);
+        ptr += needed;
+        length -= needed;
+    }
+
+    scas_sha1_compress(&ctx->hash, ptr, length / 64);
+    memcpy(ctx->buffer, ptr + (length & (~63)), length & 63);
+}
+
+void
+scas_hash_update(struct scas_hash_ctx_t *ctx, const void *data, size_t length)
+{
+    switch (ctx->algorithm)
+    {
+        case HASH_ALGORITHM_BLAKE3:
+            scas_blake3_update(&ctx->state.blake3, data, length);
+            break;
+        default:
+            sha1_update(&ctx->state.sha1, data, length);
+            break;
+    }
+}
+
+static struct scas_hash_t
+sha1_final(struct scas_sha1_ctx_t *ctx, enum scas_hash_algorithm_t algorithm)
+{
+    unsigned char last_chunk[128];
+    size_t num_extra_chunks;
+
+    memset(last_chunk, 0, sizeof last_chunk);
+    num_extra_chunks = pad_last_chunk(last_chunk, ctx->buffer, ctx->length, algorithm);
+    scas_sha1_compress(&ctx->hash, last_chunk, num_extra_chunks);
+
+    return ctx->hash;
+}
+
+struct scas_hash_t
+scas_hash_final(struct scas_hash_ctx_t *ctx)
+{
+    struct scas_hash_t rv;
+
+    switch (ctx->algorithm)
+    {
+        case HASH_ALGORITHM_BLAKE3:
+            scas_blake3_final(&ctx->state.blake3, rv.hash);
+            return rv;
+        default:
+            return sha1_final(&ctx->state.sha1, ctx->algorithm);
+    }
+}
@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include <signal.h>
 
+#include "scas_blake3.h"
+
 #ifndef NDEBUG
 #include <stdio.h>
 #    define BREAK() do { fprintf(stderr, "%s:%d: Breakpoint raised\n", __FILE__, __LINE__); raise(SIGTRAP); } while (0)
@@ -24,11 +26,58 @@
 
 #define ENOTIMPL 1
 #define ENOCONN 2
+#define EMISMATCH 3
+
+/*
+ * Content hash algorithms. The algorithm is a property of a store; every
+ * hash in a process is computed with the one set by scas_hash_set_algorithm
+ * (SHA-1 by default). The values are sent over the wire and must not
+ * change.
+ *
+ * HASH_ALGORITHM_SHA1 pads messages whose length is 55 mod 64 with an extra
+ * block, so its digests differ from standard SHA-1 for those lengths; it is
+ * kept as is because existing stores are named by it.
+ * HASH_ALGORITHM_SHA1_FIPS is standard SHA-1. A store can't be converted in
+ * place: create a new one with --hash sha1-fips and push snapshots into it.
+ */
+enum scas_hash_algorithm_t
+{
+    HASH_ALGORITHM_SHA1 = 0,
+    HASH_ALGORITHM_BLAKE3 = 1,
+    HASH_ALGORITHM_SHA1_FIPS = 2,
+    NUM_HASH_ALGORITHMS
+};
 
-
+/*
+ * Wide enough for the largest digest. Shorter digests occupy the leading
+ * words and the remainder is zero, so hashes can always be compared as a
+ * whole.
+ */
 struct scas_hash_t
 {
-    uint32_t hash[5];
+    uint32_t hash[8];
+};
+
+/*
+ * Incremental hashing state for data that arrives in pieces. Feeding a
+ * buffer through scas_hash_update in any number of pieces gives the same
+ * result as scas_hash_buffer over the whole thing.
+ */
+struct scas_sha1_ctx_t
+{
+    struct scas_hash_t hash;
+    uint64_t length;
+    unsigned char buffer[64];
+};
+
+struct scas_hash_ctx_t
+{
+    enum scas_hash_algorithm_t algorithm;
+    union
+    {
+        struct scas_sha1_ctx_t sha1;
+        struct scas_blake3_t blake3;
+    } state;
 };
 
 void
@@ -46,11 +95,106 @@ scas_log_system_error(const char *str);
 void
 scas_mkdir(const char *dir);
 
+/*
+ * Makes the directory's entries, such as a file just created in it or
+ * renamed into it, durable by fsyncing the directory itself.
+ */
+void
+scas_fsync_directory(const char *dir);
+
+void
+scas_hash_set_algorithm(enum scas_hash_algorithm_t algorithm);
+
+enum scas_hash_algorithm_t
+scas_hash_get_algorithm(void);
+
+const char *
+scas_hash_algorithm_name(enum scas_hash_algorithm_t algorithm);
+
+/*
+ * Looks up an algorithm by the name returned from scas_hash_algorithm_name.
+ * Returns 0 on success, non-zero if the name is unknown.
+ */
+int
+scas_hash_algorithm_from_name(const char *name, enum scas_hash_algorithm_t *algorithm);
+
+/*
+ * Number of significant bytes at the start of a struct scas_hash_t for the
+ * current algorithm.
+ */
+size_t
+scas_hash_digest_size(void);
+
 struct scas_hash_t
 scas_hash_string(const char *string);
 
+/*
+ * Tree hashing splits an object into SCAS_TREE_HASH_LEAF_SIZE leaves that are
+ * hashed in parallel on all cores; the object's identity is then a hash
+ * over the leaf hashes. The root is hashed in a salted domain (see
+ * scas_hash_init_salted), so a tree hash can never be forged by storing the
+ * leaf list as a plain object. Whether an object was tree hashed is recorded
+ * in its metadata flags (see scas_meta.h).
+ */
+#define SCAS_TREE_HASH_LEAF_SIZE ((size_t)1 << 20)
+
+/*
+ * Objects smaller than this aren't worth spreading across threads.
+ */
+#define SCAS_TREE_HASH_THRESHOLD (64 * SCAS_TREE_HASH_LEAF_SIZE)
+
+struct scas_hash_t
+scas_hash_buffer_tree(const void *ptr, size_t size);
+
+/*
+ * Computes the same hash as scas_hash_buffer_tree for data that arrives in
+ * pieces, hashing each leaf as soon as it is complete. The total length must
+ * be known up front since it is the first thing fed to the root.
+ */
+struct scas_tree_hash_ctx_t
+{
+    struct scas_hash_ctx_t root;
+    struct scas_hash_ctx_t leaf;
+    uint64_t remaining;
+    size_t leaf_bytes;
+};
+
+void
+scas_tree_hash_init(struct scas_tree_hash_ctx_t *ctx, uint64_t length);
+
+void
+scas_tree_hash_update(struct scas_tree_hash_ctx_t *ctx, const void *ptr, size_t size);
+
+struct scas_hash_t
+scas_tree_hash_final(struct scas_tree_hash_ctx_t *ctx);
+
+void
+scas_hash_init(struct scas_hash_ctx_t *ctx);
+
+/*
+ * Starts a hash in a separate domain named by salt: no input hashed this way
+ * gives the same result as any input hashed with scas_hash_init.
+ */
+void
+scas_hash_init_salted(struct scas_hash_ctx_t *ctx, const char *salt);
+
+void
+scas_hash_update(struct scas_hash_ctx_t *ctx, const void *ptr, size_t size);
+
+struct scas_hash_t
+scas_hash_final(struct scas_hash_ctx_t *ctx);
+
 struct scas_hash_t
 scas_hash_buffer(const void *ptr, size_t size);
 
+/*
+ * Hashes n independent buffers, writing the hash of ptrs[i] to out[i].
+ * Equivalent to calling scas_hash_buffer on each but considerably faster
+ * for large batches of small buffers, as several messages are hashed at
+ * once in separate SIMD lanes.
+ */
+void
+scas_hash_buffers(const void **ptrs, const size_t *sizes, size_t n, struct scas_hash_t *out);
+
 #endif
 
@@ -0,0 +1,654 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#include <string.h>
+
+#include "scas_blake3.h"
+#include "scas_cpu.h"
+
+#ifdef SCAS_CPU_X86
+#    include <immintrin.h>
+#endif
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+#define KEYED_HASH (1 << 4)
+
+static const uint32_t blake3_iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/*
+ * Message word order for each of the seven rounds, i.e. the message
+ * permutation applied zero to six times.
+ */
+static const uint8_t blake3_schedule[7][16] =
+{
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+struct scas_blake3_output_t
+{
+    uint32_t input_cv[8];
+    uint8_t block[SCAS_BLAKE3_BLOCK_LEN];
+    uint64_t counter;
+    uint8_t block_len;
+    uint8_t flags;
+};
+
+static inline uint32_t
+rotate_right(uint32_t val, int count)
+{
+    return (val >> count) | (val << (32 - count));
+}
+
+static inline uint32_t
+load_little_endian(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void
+store_little_endian(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t)val;
+    p[1] = (uint8_t)(val >> 8);
+    p[2] = (uint8_t)(val >> 16);
+    p[3] = (uint8_t)(val >> 24);
+}
+
+static inline void
+blake3_g(uint32_t *s, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+    s[a] = s[a] + s[b] + x;
+    s[d] = rotate_right(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotate_right(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + y;
+    s[d] = rotate_right(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotate_right(s[b] ^ s[c], 7);
+}
+
+static void
+blake3_compress(uint32_t cv[8], const uint8_t block[SCAS_BLAKE3_BLOCK_LEN], uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+    uint32_t m[16];
+    uint32_t s[16];
+    int i;
+
+    for (i = 0; i < 16; ++i)
+    {
+        m[i] = load_little_endian(block + i * 4);
+    }
+
+    memcpy(s, cv, 8 * sizeof(uint32_t));
+    s[8] = blake3_iv[0];
+    s[9] = blake3_iv[1];
+    s[10] = blake3_iv[2];
+    s[11] = blake3_iv[3];
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    /*
+     * Unrolled so the schedule lookups and state indices are constants and
+     * the state can live in registers.
+     */
+    #define ROUND(r) \
+        blake3_g(s, 0, 4, 8, 12, m[blake3_schedule[r][0]], m[blake3_schedule[r][1]]); \
+        blake3_g(s, 1, 5, 9, 13, m[blake3_schedule[r][2]], m[blake3_schedule[r][3]]); \
+        blake3_g(s, 2, 6, 10, 14, m[blake3_schedule[r][4]], m[blake3_schedule[r][5]]); \
+        blake3_g(s, 3, 7, 11, 15, m[blake3_schedule[r][6]], m[blake3_schedule[r][7]]); \
+        blake3_g(s, 0, 5, 10, 15, m[blake3_schedule[r][8]], m[blake3_schedule[r][9]]); \
+        blake3_g(s, 1, 6, 11, 12, m[blake3_schedule[r][10]], m[blake3_schedule[r][11]]); \
+        blake3_g(s, 2, 7, 8, 13, m[blake3_schedule[r][12]], m[blake3_schedule[r][13]]); \
+        blake3_g(s, 3, 4, 9, 14, m[blake3_schedule[r][14]], m[blake3_schedule[r][15]])
+
+    ROUND(0);
+    ROUND(1);
+    ROUND(2);
+    ROUND(3);
+    ROUND(4);
+    ROUND(5);
+    ROUND(6);
+
+    #undef ROUND
+
+    for (i = 0; i < 8; ++i)
+    {
+        cv[i] = s[i] ^ s[i + 8];
+    }
+}
+
+static void
+blake3_chunk_state_init(struct scas_blake3_chunk_state_t *chunk, const uint32_t key[8], uint64_t chunk_counter, uint8_t flags)
+{
+    memcpy(chunk->cv, key, sizeof chunk->cv);
+    memset(chunk->buf, 0, sizeof chunk->buf);
+    chunk->chunk_counter = chunk_counter;
+    chunk->buf_len = 0;
+    chunk->blocks_compressed = 0;
+    chunk->flags = flags;
+}
+
+static inline size_t
+blake3_chunk_state_len(const struct scas_blake3_chunk_state_t *chunk)
+{
+    return (size_t)chunk->blocks_compressed * SCAS_BLAKE3_BLOCK_LEN + chunk->buf_len;
+}
+
+static inline uint8_t
+blake3_chunk_start_flag(const struct scas_blake3_chunk_state_t *chunk)
+{
+    return chunk->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void
+blake3_chunk_state_update(struct scas_blake3_chunk_state_t *chunk, const uint8_t *input, size_t length)
+{
+    while (length > 0)
+    {
+        size_t take;
+
+        /*
+         * A full buffer is only compressed once more input turns up, as the
+         * last block of the chunk needs the CHUNK_END flag.
+         */
+        if (chunk->buf_len == SCAS_BLAKE3_BLOCK_LEN)
+        {
+            blake3_compress(chunk->cv, chunk->buf, SCAS_BLAKE3_BLOCK_LEN, chunk->chunk_counter,
+                (uint8_t)(chunk->flags | blake3_chunk_start_flag(chunk)));
+            ++chunk->blocks_compressed;
+            chunk->buf_len = 0;
+            memset(chunk->buf, 0, sizeof chunk->buf);
+        }
+
+        take = SCAS_BLAKE3_BLOCK_LEN - chunk->buf_len;
+        take = take < length ? take : length;
+
+        memcpy(chunk->buf + chunk->buf_len, input, take);
+        chunk->buf_len = (uint8_t)(chunk->buf_len + take);
+        input += take;
+        length -= take;
+    }
+}
+
+static void
+blake3_chunk_state_output(const struct scas_blake3_chunk_state_t *chunk, struct scas_blake3_output_t *output)
+{
+    memcpy(output->input_cv, chunk->cv, sizeof output->input_cv);
+    memcpy(output->block, chunk->buf, sizeof output->block);
+    output->block_len = chunk->buf_len;
+    output->counter = chunk->chunk_counter;
+    output->flags = (uint8_t)(chunk->flags | blake3_chunk_start_flag(chunk) | CHUNK_END);
+}
+
+static void
+blake3_parent_output(const uint32_t left[8], const uint32_t right[8], const uint32_t key[8], uint8_t flags, struct scas_blake3_output_t *output)
+{
+    int i;
+
+    for (i = 0; i < 8; ++i)
+    {
+        store_little_endian(output->block + i * 4, left[i]);
+        store_little_endian(output->block + 32 + i * 4, right[i]);
+    }
+
+    memcpy(output->input_cv, key, sizeof output->input_cv);
+    output->block_len = SCAS_BLAKE3_BLOCK_LEN;
+    output->counter = 0;
+    output->flags = (uint8_t)(flags | PARENT);
+}
+
+static void
+blake3_output_chaining_value(const struct scas_blake3_output_t *output, uint32_t cv[8])
+{
+    memcpy(cv, output->input_cv, 8 * sizeof(uint32_t));
+    blake3_compress(cv, output->block, output->block_len, output->counter, output->flags);
+}
+
+/*
+ * Hashes whole chunks laid out back to back, writing one chaining value
+ * per chunk. None of these chunks may be the root.
+ */
+static void
+blake3_hash_chunks_portable(const uint8_t *input, size_t num_chunks, const uint32_t key[8], uint64_t counter, uint8_t flags, uint32_t (*cvs)[8])
+{
+    size_t i;
+    size_t b;
+
+    for (i = 0; i < num_chunks; ++i)
+    {
+        memcpy(cvs[i], key, 8 * sizeof(uint32_t));
+
+        for (b = 0; b < SCAS_BLAKE3_CHUNK_LEN / SCAS_BLAKE3_BLOCK_LEN; ++b)
+        {
+            uint8_t block_flags;
+
+            block_flags = flags;
+
+            if (b == 0)
+                block_flags |= CHUNK_START;
+
+            if (b == SCAS_BLAKE3_CHUNK_LEN / SCAS_BLAKE3_BLOCK_LEN - 1)
+                block_flags |= CHUNK_END;
+
+            blake3_compress(cvs[i], input + b * SCAS_BLAKE3_BLOCK_LEN, SCAS_BLAKE3_BLOCK_LEN, counter + i, block_flags);
+        }
+
+        input += SCAS_BLAKE3_CHUNK_LEN;
+    }
+}
+
+#ifdef SCAS_CPU_X86
+
+/*
+ * Multi-lane chunk kernels: LANES chunks are hashed side by side, one per
+ * SIMD lane, so each G function operates on whole vectors. As with the
+ * SHA-1 multi-buffer kernels the body is shared and the B3_* operation
+ * macros are defined before each instantiation.
+ */
+#define BLAKE3_G_LANES(a, b, c, d, x, y)                                    \
+    do {                                                                    \
+        v[a] = B3_ADD(B3_ADD(v[a], v[b]), x);                               \
+        v[d] = B3_ROTR16(B3_XOR(v[d], v[a]));                               \
+        v[c] = B3_ADD(v[c], v[d]);                                          \
+        v[b] = B3_ROTR12(B3_XOR(v[b], v[c]));                               \
+        v[a] = B3_ADD(B3_ADD(v[a], v[b]), y);                               \
+        v[d] = B3_ROTR8(B3_XOR(v[d], v[a]));                                \
+        v[c] = B3_ADD(v[c], v[d]);                                          \
+        v[b] = B3_ROTR7(B3_XOR(v[b], v[c]));                                \
+    } while (0)
+
+#define BLAKE3_ROUND_LANES(r)                                               \
+    do {                                                                    \
+        BLAKE3_G_LANES(0, 4, 8, 12, m[blake3_schedule[r][0]], m[blake3_schedule[r][1]]); \
+        BLAKE3_G_LANES(1, 5, 9, 13, m[blake3_schedule[r][2]], m[blake3_schedule[r][3]]); \
+        BLAKE3_G_LANES(2, 6, 10, 14, m[blake3_schedule[r][4]], m[blake3_schedule[r][5]]); \
+        BLAKE3_G_LANES(3, 7, 11, 15, m[blake3_schedule[r][6]], m[blake3_schedule[r][7]]); \
+        BLAKE3_G_LANES(0, 5, 10, 15, m[blake3_schedule[r][8]], m[blake3_schedule[r][9]]); \
+        BLAKE3_G_LANES(1, 6, 11, 12, m[blake3_schedule[r][10]], m[blake3_schedule[r][11]]); \
+        BLAKE3_G_LANES(2, 7, 8, 13, m[blake3_schedule[r][12]], m[blake3_schedule[r][13]]); \
+        BLAKE3_G_LANES(3, 4, 9, 14, m[blake3_schedule[r][14]], m[blake3_schedule[r][15]]); \
+    } while (0)
+
+/*
+ * Message words are gathered straight from the input, chunk n's word
+ * landing in lane n; x86 is little endian so no byte swapping is needed.
+ */
+#define BLAKE3_DEFINE_HASH_CHUNKS(NAME, TARGET, LANES, VEC)                 \
+    __attribute__((target(TARGET)))                                        \
+    static void                                                             \
+    NAME(const uint8_t *input, const uint32_t key[8], uint64_t counter, uint8_t flags, uint32_t (*cvs)[8]) \
+    {                                                                       \
+        uint32_t counter_lo[LANES];                                         \
+        uint32_t counter_hi[LANES];                                         \
+        uint32_t out[8 * (LANES)];                                          \
+        VEC cv[8];                                                          \
+        VEC m[16];                                                          \
+        VEC v[16];                                                          \
+        int lane;                                                           \
+        int b;                                                              \
+        int i;                                                              \
+                                                                            \
+        for (lane = 0; lane < (LANES); ++lane)                              \
+        {                                                                   \
+            counter_lo[lane] = (uint32_t)(counter + lane);                  \
+            counter_hi[lane] = (uint32_t)((counter + lane) >> 32);          \
+        }                                                                   \
+                                                                            \
+        for (i = 0; i < 8; ++i)                                             \
+        {                                                                   \
+            cv[i] = B3_SET1(key[i]);                                        \
+        }                                                                   \
+                                                                            \
+        for (b = 0; b < SCAS_BLAKE3_CHUNK_LEN / SCAS_BLAKE3_BLOCK_LEN; ++b) \
+        {                                                                   \
+            uint8_t block_flags;                                            \
+                                                                            \
+            for (i = 0; i < 16; ++i)                                        \
+            {                                                               \
+                m[i] = B3_GATHER(input + b * SCAS_BLAKE3_BLOCK_LEN + i * 4); \
+            }                                                               \
+                                                                            \
+            block_flags = flags;                                            \
+            if (b == 0)                                                     \
+                block_flags |= CHUNK_START;                                 \
+            if (b == SCAS_BLAKE3_CHUNK_LEN / SCAS_BLAKE3_BLOCK_LEN - 1)     \
+                block_flags |= CHUNK_END;                                   \
+                                                                            \
+            for (i = 0; i < 8; ++i)                                         \
+            {                                                               \
+                v[i] = cv[i];                                               \
+            }                                                               \
+                                                                            \
+            v[8] = B3_SET1(blake3_iv[0]);                                   \
+            v[9] = B3_SET1(blake3_iv[1]);                                   \
+            v[10] = B3_SET1(blake3_iv[2]);                                  \
+            v[11] = B3_SET1(blake3_iv[3]);                                  \
+            v[12] = B3_LOAD(counter_lo);                                    \
+            v[13] = B3_LOAD(counter_hi);                                    \
+            v[14] = B3_SET1(SCAS_BLAKE3_BLOCK_LEN);                         \
+            v[15] = B3_SET1(block_flags);                                   \
+                                                                            \
+            BLAKE3_ROUND_LANES(0);                                          \
+            BLAKE3_ROUND_LANES(1);                                          \
+            BLAKE3_ROUND_LANES(2);                                          \
+            BLAKE3_ROUND_LANES(3);                                          \
+            BLAKE3_ROUND_LANES(4);                                          \
+            BLAKE3_ROUND_LANES(5);                                          \
+            BLAKE3_ROUND_LANES(6);                                          \
+                                                                            \
+            for (i = 0; i < 8; ++i)                                         \
+            {                                                               \
+                cv[i] = B3_XOR(v[i], v[i + 8]);                             \
+            }                                                               \
+        }                                                                   \
+                                                                            \
+        for (i = 0; i < 8; ++i)                                             \
+        {                                                                   \
+            B3_STORE(&out[i * (LANES)], cv[i]);                             \
+        }                                                                   \
+                                                                            \
+        for (lane = 0; lane < (LANES); ++lane)                              \
+        {                                                                   \
+            for (i = 0; i < 8; ++i)                                         \
+            {                                                               \
+                cvs[lane][i] = out[i * (LANES) + lane];                     \
+            }                                                               \
+        }                                                                   \
+    }
+
+#define B3_LOAD(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define B3_GATHER(p) _mm256_i32gather_epi32((const int *)(const void *)(p), \
+    _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792), 4)
+#define B3_STORE(p, x) _mm256_storeu_si256((__m256i *)(void *)(p), x)
+#define B3_SET1(x) _mm256_set1_epi32((int)(x))
+#define B3_ADD _mm256_add_epi32
+#define B3_XOR _mm256_xor_si256
+#define B3_ROTR16(x) _mm256_shuffle_epi8(x, _mm256_set_epi8( \
+    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, \
+    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2))
+#define B3_ROTR12(x) _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(x, 20))
+#define B3_ROTR8(x) _mm256_shuffle_epi8(x, _mm256_set_epi8( \
+    12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1, \
+    12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1))
+#define B3_ROTR7(x) _mm256_or_si256(_mm256_srli_epi32(x, 7), _mm256_slli_epi32(x, 25))
+
+BLAKE3_DEFINE_HASH_CHUNKS(blake3_hash_chunks_avx2, "avx2", 8, __m256i)
+
+#undef B3_LOAD
+#undef B3_GATHER
+#undef B3_STORE
+#undef B3_SET1
+#undef B3_ADD
+#undef B3_XOR
+#undef B3_ROTR16
+#undef B3_ROTR12
+#undef B3_ROTR8
+#undef B3_ROTR7
+
+#define B3_LOAD(p) _mm512_loadu_si512((const void *)(p))
+#define B3_GATHER(p) _mm512_i32gather_epi32(_mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792, \
+    2048, 2304, 2560, 2816, 3072, 3328, 3584, 3840), (const void *)(p), 4)
+#define B3_STORE(p, x) _mm512_storeu_si512((void *)(p), x)
+#define B3_SET1(x) _mm512_set1_epi32((int)(x))
+#define B3_ADD _mm512_add_epi32
+#define B3_XOR _mm512_xor_si512
+#define B3_ROTR16(x) _mm512_ror_epi32(x, 16)
+#define B3_ROTR12(x) _mm512_ror_epi32(x, 12)
+#define B3_ROTR8(x) _mm512_ror_epi32(x, 8)
+#define B3_ROTR7(x) _mm512_ror_epi32(x, 7)
+
+BLAKE3_DEFINE_HASH_CHUNKS(blake3_hash_chunks_avx512, "avx512f", 16, __m512i)
+
+#undef B3_LOAD
+#undef B3_GATHER
+#undef B3_STORE
+#undef B3_SET1
+#undef B3_ADD
+#undef B3_XOR
+#undef B3_ROTR16
+#undef B3_ROTR12
+#undef B3_ROTR8
+#undef B3_ROTR7
+
+#endif
+
+/*
+ * Chunks hashed per call to blake3_hash_chunks: the widest kernel's lane
+ * count.
+ */
+#define CHUNK_BATCH_SIZE 16
+
+typedef void (*scas_blake3_hash_chunks_fn_t)(const uint8_t *, const uint32_t *, uint64_t, uint8_t, uint32_t (*)[8]);
+
+struct blake3_kernel_t
+{
+    size_t lanes;
+    scas_blake3_hash_chunks_fn_t hash_chunks;
+};
+
+static const struct blake3_kernel_t blake3_kernel_portable = { 1, NULL };
+#ifdef SCAS_CPU_X86
+static const struct blake3_kernel_t blake3_kernel_avx2 = { 8, blake3_hash_chunks_avx2 };
+static const struct blake3_kernel_t blake3_kernel_avx512 = { 16, blake3_hash_chunks_avx512 };
+#endif
+
+/*
+ * Chosen on first use, by whichever thread hashes first. Threads that race
+ * to choose all pick the same kernel, and it's published with a single
+ * atomic store, so a thread sees either no kernel or a complete one.
+ */
+static const struct blake3_kernel_t *blake3_kernel;
+
+static const struct blake3_kernel_t *
+blake3_select_kernel(void)
+{
+    const struct blake3_kernel_t *kernel;
+
+    kernel = __atomic_load_n(&blake3_kernel, __ATOMIC_ACQUIRE);
+
+    if (kernel != NULL)
+    {
+        return kernel;
+    }
+
+    kernel = &blake3_kernel_portable;
+
+#ifdef SCAS_CPU_X86
+    if (scas_cpu_supports(CPU_AVX512F))
+    {
+        kernel = &blake3_kernel_avx512;
+    }
+    else if (scas_cpu_supports(CPU_AVX2))
+    {
+        kernel = &blake3_kernel_avx2;
+    }
+#endif
+
+    __atomic_store_n(&blake3_kernel, kernel, __ATOMIC_RELEASE);
+
+    return kernel;
+}
+
+static void
+blake3_hash_chunks(const uint8_t *input, size_t num_chunks, const uint32_t key[8], uint64_t counter, uint8_t flags, uint32_t (*cvs)[8])
+{
+    const struct blake3_kernel_t *kernel;
+
+    kernel = blake3_select_kernel();
+
+    if (kernel->hash_chunks != NULL)
+    {
+        while (num_chunks >= kernel->lanes)
+        {
+            kernel->hash_chunks(input, key, counter, flags, cvs);
+            input += kernel->lanes * SCAS_BLAKE3_CHUNK_LEN;
+            counter += kernel->lanes;
+            cvs += kernel->lanes;
+            num_chunks -= kernel->lanes;
+        }
+
+        /*
+         * A partial batch is still cheaper through the SIMD kernel, with the
+         * spare lanes hashing whatever is left in the staging buffer, unless
+         * most of the lanes would be idle.
+         */
+        if (num_chunks * 4 > kernel->lanes)
+        {
+            uint8_t staging[CHUNK_BATCH_SIZE * SCAS_BLAKE3_CHUNK_LEN];
+            uint32_t staging_cvs[CHUNK_BATCH_SIZE][8];
+
+            memcpy(staging, input, num_chunks * SCAS_BLAKE3_CHUNK_LEN);
+            kernel->hash_chunks(staging, key, counter, flags, staging_cvs);
+            memcpy(cvs, staging_cvs, num_chunks * sizeof staging_cvs[0]);
+            return;
+        }
+    }
+
+    blake3_hash_chunks_portable(input, num_chunks, key, counter, flags, cvs);
+}
+
+static void
+blake3_add_chunk_chaining_value(struct scas_blake3_t *hasher, uint32_t cv[8], uint64_t total_chunks)
+{
+    /*
+     * Each trailing zero bit in the chunk count marks a completed subtree
+     * whose two halves can be merged. More input is known to follow, so
+     * none of these parents can be the root.
+     */
+    while ((total_chunks & 1) == 0)
+    {
+        struct scas_blake3_output_t parent;
+
+        --hasher->cv_stack_len;
+        blake3_parent_output(hasher->cv_stack[hasher->cv_stack_len], cv, hasher->key, hasher->chunk.flags, &parent);
+        blake3_output_chaining_value(&parent, cv);
+        total_chunks >>= 1;
+    }
+
+    memcpy(hasher->cv_stack[hasher->cv_stack_len], cv, 8 * sizeof(uint32_t));
+    ++hasher->cv_stack_len;
+}
+
+static void
+blake3_init_internal(struct scas_blake3_t *hasher, const uint32_t key[8], uint8_t flags)
+{
+    memcpy(hasher->key, key, sizeof hasher->key);
+    blake3_chunk_state_init(&hasher->chunk, key, 0, flags);
+    hasher->cv_stack_len = 0;
+}
+
+void
+scas_blake3_init(struct scas_blake3_t *hasher)
+{
+    blake3_init_internal(hasher, blake3_iv, 0);
+}
+
+void
+scas_blake3_init_keyed(struct scas_blake3_t *hasher, const uint32_t key[8])
+{
+    blake3_init_internal(hasher, key, KEYED_HASH);
+}
+
+void
+scas_blake3_update(struct scas_blake3_t *hasher, const void *data, size_t length)
+{
+    const uint8_t *input;
+
+    input = data;
+
+    while (length > 0)
+    {
+        size_t take;
+
+        if (blake3_chunk_state_len(&hasher->chunk) == SCAS_BLAKE3_CHUNK_LEN)
+        {
+            struct scas_blake3_output_t output;
+            uint32_t cv[8];
+            uint64_t total_chunks;
+
+            blake3_chunk_state_output(&hasher->chunk, &output);
+            blake3_output_chaining_value(&output, cv);
+            total_chunks = hasher->chunk.chunk_counter + 1;
+            blake3_add_chunk_chaining_value(hasher, cv, total_chunks);
+            blake3_chunk_state_init(&hasher->chunk, hasher->key, total_chunks, hasher->chunk.flags);
+        }
+
+        /*
+         * On a chunk boundary, whole chunks can be hashed straight from the
+         * input. At least one byte is held back so the final chunk always
+         * goes through the chunk state and can be flagged as the root.
+         */
+        if (blake3_chunk_state_len(&hasher->chunk) == 0 && length > SCAS_BLAKE3_CHUNK_LEN)
+        {
+            uint32_t cvs[CHUNK_BATCH_SIZE][8];
+            size_t num_chunks;
+            size_t i;
+            uint64_t counter;
+
+            num_chunks = (length - 1) / SCAS_BLAKE3_CHUNK_LEN;
+            num_chunks = num_chunks < CHUNK_BATCH_SIZE ? num_chunks : CHUNK_BATCH_SIZE;
+            counter = hasher->chunk.chunk_counter;
+
+            blake3_hash_chunks(input, num_chunks, hasher->key, counter, hasher->chunk.flags, cvs);
+
+            for (i = 0; i < num_chunks; ++i)
+            {
+                blake3_add_chunk_chaining_value(hasher, cvs[i], counter + i + 1);
+            }
+
+            blake3_chunk_state_init(&hasher->chunk, hasher->key, counter + num_chunks, hasher->chunk.flags);
+            input += num_chunks * SCAS_BLAKE3_CHUNK_LEN;
+            length -= num_chunks * SCAS_BLAKE3_CHUNK_LEN;
+            continue;
+        }
+
+        take = SCAS_BLAKE3_CHUNK_LEN - blake3_chunk_state_len(&hasher->chunk);
+        take = take < length ? take : length;
+
+        blake3_chunk_state_update(&hasher->chunk, input, take);
+        input += take;
+        length -= take;
+    }
+}
+
+void
+scas_blake3_final(const struct scas_blake3_t *hasher, uint32_t out[8])
+{
+    struct scas_blake3_output_t output;
+    size_t remaining;
+
+    blake3_chunk_state_output(&hasher->chunk, &output);
+
+    for (remaining = hasher->cv_stack_len; remaining > 0; --remaining)
+    {
+        uint32_t cv[8];
+
+        blake3_output_chaining_value(&output, cv);
+        blake3_parent_output(hasher->cv_stack[remaining - 1], cv, hasher->key, hasher->chunk.flags, &output);
+    }
+
+    /*
+     * The first 32 bytes of root output are the chaining value computed with
+     * the ROOT flag and a block counter of zero.
+     */
+    memcpy(out, output.input_cv, 8 * sizeof(uint32_t));
+    blake3_compress(out, output.block, output.block_len, 0, (uint8_t)(output.flags | ROOT));
+}
@@ -0,0 +1,60 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_BLAKE3_H
+#define SCAS_BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAS_BLAKE3_BLOCK_LEN 64
+#define SCAS_BLAKE3_CHUNK_LEN 1024
+
+/*
+ * Enough chaining values for 2^54 chunks, the most a 64 bit input length
+ * can describe.
+ */
+#define SCAS_BLAKE3_MAX_DEPTH 54
+
+struct scas_blake3_chunk_state_t
+{
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t buf[SCAS_BLAKE3_BLOCK_LEN];
+    uint8_t buf_len;
+    uint8_t blocks_compressed;
+    uint8_t flags;
+};
+
+struct scas_blake3_t
+{
+    uint32_t key[8];
+    struct scas_blake3_chunk_state_t chunk;
+    uint8_t cv_stack_len;
+    uint32_t cv_stack[SCAS_BLAKE3_MAX_DEPTH][8];
+};
+
+void
+scas_blake3_init(struct scas_blake3_t *hasher);
+
+/*
+ * BLAKE3's keyed mode, which gives a hash function independent from the
+ * unkeyed one for each distinct key.
+ */
+void
+scas_blake3_init_keyed(struct scas_blake3_t *hasher, const uint32_t key[8]);
+
+void
+scas_blake3_update(struct scas_blake3_t *hasher, const void *data, size_t length);
+
+/*
+ * Writes the 256 bit digest as eight little endian words, so on little
+ * endian hosts out has the same byte layout as the standard digest.
+ */
+void
+scas_blake3_final(const struct scas_blake3_t *hasher, uint32_t out[8]);
+
+#endif
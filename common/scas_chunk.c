@@ -0,0 +1,209 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "scas_base.h"
+#include "scas_chunk.h"
+
+/*
+ * Normalized chunking: up to the average size a boundary needs two more
+ * matching bits than the average calls for, and past it two fewer, which
+ * pulls chunk sizes in towards the average. The masks select the top bits of
+ * the gear hash, which depend on the most preceding bytes.
+ */
+#define MASK_SMALL (~UINT64_C(0) << (64 - 18))
+#define MASK_LARGE (~UINT64_C(0) << (64 - 14))
+
+/*
+ * Random values for the gear hash, generated with splitmix64. Changing them
+ * moves every chunk boundary.
+ */
+static const uint64_t gear[256] =
+{
+    0xd46f4960b444342fULL, 0xd257489a1bf66eb2ULL, 0x5d12ed5a67f119d2ULL,
+    0x42fb4f07cd0cecd3ULL, 0xd8750f817848526fULL, 0x992b721bc9075e2cULL,
+    0xa57284b24232cab4ULL, 0x6631c9772487c70dULL, 0xe9406340715bcc8eULL,
+    0x435de4d6eb4386f6ULL, 0x26a8bd1898058d9bULL, 0x19e1498351ff9e9fULL,
+    0x9b199b92fd1fa78eULL, 0x14db99d7e38cdeecULL, 0x8eed02e9ae2b3d19ULL,
+    0x9f655cb6394890adULL, 0xe72e2073016387c4ULL, 0x2bf1cc12a165270dULL,
+    0x1430383a882c8a84ULL, 0xeb067c1c70cfcfddULL, 0xd408589046fa8e25ULL,
+    0xc9cef8583d81e5b3ULL, 0x3b8891db1586abf0ULL, 0x068adaf08ad65c14ULL,
+    0x5a9ecd4e3c053b05ULL, 0xdd501a865025ded6ULL, 0xefec3de4c0bf520aULL,
+    0x95904fd3c6718b06ULL, 0x09e5b6b42b042501ULL, 0x68138de74b759662ULL,
+    0x32f6218735cbca23ULL, 0x0bda71f2cb48d037ULL, 0x9c8c2585a6158c60ULL,
+    0xe676164b7b15970eULL, 0x31d9cd67f197da0fULL, 0xe09b71ccbc17746bULL,
+    0x6f5536824f428c38ULL, 0x83567fad10e6561dULL, 0x51b19392bf383c3cULL,
+    0x919a367e12ecd832ULL, 0x8e956d93c25defa2ULL, 0x7f9a5b869f8c421eULL,
+    0x13fb03ca3992763eULL, 0xf5273aa5524af350ULL, 0xf23f69fdbb6099f6ULL,
+    0xb21fd93aa9620ae6ULL, 0x22803a5583ca4dc1ULL, 0x958893a497814686ULL,
+    0x63335688fdeb350cULL, 0x0917dda310a8f3b0ULL, 0x917ce2c54d206512ULL,
+    0x0fe00351712eb023ULL, 0xee6b2054064ad27eULL, 0xeaacc865839c94bfULL,
+    0xb8929c599b07da3bULL, 0x93bdd41f62048029ULL, 0xe4bcdce054fe26edULL,
+    0xd127434a251fd6d4ULL, 0x9c37ccdf74bf9291ULL, 0x058e21e2bf3e3f69ULL,
+    0x9b1d45b7c5331f1bULL, 0x8650158331de0f73ULL, 0x386f1a4704db9aa3ULL,
+    0x18aa6459b2d47513ULL, 0x4b5ad5d5c8996688ULL, 0x06c7f6730924cad9ULL,
+    0xfe9abb6296d5d7e4ULL, 0xd2a0648ac7134aebULL, 0x6ea96409f459b65aULL,
+    0x37371508fbac6e5fULL, 0x488cad397ff07030ULL, 0x83caf1b3bd4d8452ULL,
+    0x38c39fcde356a3c1ULL, 0x46bca968572f5800ULL, 0xccbc7a0b3d1eeb16ULL,
+    0xeb263fc89de6d233ULL, 0x4fe2f24bb770da84ULL, 0x845e9bf380f94c46ULL,
+    0xb22e51d73441c27eULL, 0x8cb3ccaf2468c410ULL, 0x26528214a8a2cd41ULL,
+    0x072b6b78b3babc6fULL, 0xdc2153f7f790b6ccULL, 0xcc6c435e5ec5becaULL,
+    0x459477bc3777fbd2ULL, 0x925d3163156f769cULL, 0x07d713896f6e68f3ULL,
+    0xf897e98281191d0eULL, 0x38628bc064d41e2eULL, 0xe0b170a1422357c3ULL,
+    0xa0dd77a1234b2d95ULL, 0x51b868f464ba1bbdULL, 0x3398ae555b0b7999ULL,
+    0xd2d52f452c4642e9ULL, 0xb2210b5a0836856bULL, 0xd73f32423d566683ULL,
+    0xeddca5101438e89cULL, 0xa8b4ef1a17b24154ULL, 0x5adf4f7e0be17014ULL,
+    0x88a6424420ee9231ULL, 0xd4c0e599ef282363ULL, 0x1d1bd73856f67675ULL,
+    0x8b18fd38f59b2c50ULL, 0x1a3438ecbdf10a9dULL, 0x70a33d9d6a3837d8ULL,
+    0x2c1cb6a76d9d6233ULL, 0x9b90d156e7f2043bULL, 0x29dda4e46513aebdULL,
+    0x0e41df80d8ee4ef2ULL, 0xf965200f2f110a92ULL, 0xddc05230273ed6dcULL,
+    0x330a84d7033c3d53ULL, 0x9844d5af002f721eULL, 0xf88bce2f290fdde3ULL,
+    0x62b73ebd058ca03dULL, 0x0992198143ae4ce2ULL, 0x4bad9b146c422021ULL,
+    0x40d2ed01545bb028ULL, 0x8608c45528291f92ULL, 0xfcbd3fc8ef1400e7ULL,
+    0x94cc3883d93e85a0ULL, 0x2561bc21d8202b3bULL, 0xb4b9262faea6730dULL,
+    0xe081f806a100f0beULL, 0xdd03a9d6e6902cd6ULL, 0xdc538787298e6632ULL,
+    0xa2e1cd57fe99d704ULL, 0xd3c995b91f19a975ULL, 0x07f9746d90b44ac4ULL,
+    0x8348f21985e914c8ULL, 0x071c11a3e375608bULL, 0x8e1d903024b58b26ULL,
+    0x7265211c1c0297cdULL, 0x72c49d940135d8e3ULL, 0x480006601f31d321ULL,
+    0xf671aa47c9996435ULL, 0xc001cd26da10073dULL, 0x50534fb683b5c2d7ULL,
+    0x7a85d7edd26e29c9ULL, 0x44e82bc43b9b90ccULL, 0xaf0b67e9d427d158ULL,
+    0x23b1763f6144242dULL, 0x11db390df46bc3d1ULL, 0xcacc0ca712217b5fULL,
+    0x26518f8e12c7d69aULL, 0x25556eb55a47c9afULL, 0xeed51b7242174d76ULL,
+    0x7ed527a49fb84076ULL, 0x525a4ede005a2277ULL, 0xb11f9196292845deULL,
+    0xa58f00953d13f2c2ULL, 0x5f9bfbb739244707ULL, 0x4e896a0aa075f7bdULL,
+    0x24c3a243474b82d8ULL, 0xf75cc5fa72c79314ULL, 0x5afbaeb428df4f39ULL,
+    0xef94a3e12174eafbULL, 0x30b1aa89561546c2ULL, 0x4e45d38b21b04b55ULL,
+    0x854023811bf608bfULL, 0x0e4b5685c8c8fc23ULL, 0x22172d5b9fd87f88ULL,
+    0x951624fd21e8a4b1ULL, 0x8965a24d5bc73380ULL, 0xd1e06e1a61b11a09ULL,
+    0x3a3d2bc52cf0b0e4ULL, 0x8a8fbb171309689eULL, 0xfc777e50730fc9a2ULL,
+    0x7c93a101324e3237ULL, 0xe5538bc27d1524dbULL, 0x387cfc4538464c4aULL,
+    0x75564edf67668834ULL, 0x87e9face264b2de5ULL, 0x43fd44f3086320ecULL,
+    0xf513154dcfc0037fULL, 0x46f220b5e4de19faULL, 0x9d1f0323beda9067ULL,
+    0x1431beeb9f1b366fULL, 0x2bacc550dd24b239ULL, 0xe951b0753f21d07aULL,
+    0xcf57b7e515a2ea1bULL, 0x486166475b913785ULL, 0x5cf96a18ca4aa026ULL,
+    0x23112a43e58ad43bULL, 0x7de471c34e66a50dULL, 0xb1412a752aed1a07ULL,
+    0x2c229c0e20133a0dULL, 0x8f68a02d043ffcd1ULL, 0xa794d9777c5da986ULL,
+    0x4dfd40a64d041c7cULL, 0x7a6541a09104b83eULL, 0xba590d77c3a48df1ULL,
+    0x383bcd77d26d5cc7ULL, 0x1fc24850323e1607ULL, 0xb9b23884ebd5499dULL,
+    0xf80c24e04d7ed307ULL, 0x3241c0004f1ba7afULL, 0x773c2d3920d8e2b0ULL,
+    0x11abc71d64c0c34cULL, 0xf8470472811e8db1ULL, 0xc02ad50547f0852aULL,
+    0xe713f93c9fdbbfb7ULL, 0x2a6cbb225a5104daULL, 0xd4bff378fda23bfdULL,
+    0x797dc1d609b72a3bULL, 0x973f44d33147fad9ULL, 0x1e52747b82b15efeULL,
+    0xf176b71e68a94c71ULL, 0xf0a8e5803e82b428ULL, 0xe17052bc53aba645ULL,
+    0xeca8cd5db8020b2dULL, 0xdefc22fddfe1bfc2ULL, 0xbc43282d1e380e90ULL,
+    0x3112fce200fba1eaULL, 0xab234618c2a36f7cULL, 0x40711551626c6856ULL,
+    0xc6bd32b0fbb473d2ULL, 0x1bc431872ec7458fULL, 0x6691c5205f0d9c50ULL,
+    0x45cd4bed1b0c4f86ULL, 0x1b03713077ffc12dULL, 0x7f28742ddbc27c0eULL,
+    0xe015020b8b756535ULL, 0xf2653aaf6e879cc5ULL, 0x262db688f44e7deeULL,
+    0x26c4e421b5bf2350ULL, 0x297df6966dc959e0ULL, 0xb23d4b59220132a7ULL,
+    0xe905c93d60dfba66ULL, 0x9d5c5f6a5fadd798ULL, 0xa8f2167dab30a580ULL,
+    0x22c9eb8441ceb979ULL, 0xe498bc6eee99d5cfULL, 0xc36d078032d7125eULL,
+    0x999e5d4775e2b426ULL, 0xb6821922350b4b75ULL, 0xfee381f08a80dfa7ULL,
+    0x9fd4d0af40615315ULL, 0xcbe9359dd0725b7dULL, 0xd353ac993555f55dULL,
+    0x7aaf861352e10502ULL, 0xd71a29470968a7e6ULL, 0x8d1b29406455a63eULL,
+    0x6a26eadf88c685c1ULL, 0xb1fcc221c9b2aa70ULL, 0x9863fcd5a736ca45ULL,
+    0x7adb6243311095d7ULL, 0x9181f70171d05c98ULL, 0xca3b56bb9087a455ULL,
+    0xcec0d8ebe8946b79ULL, 0x6dced4ad3f8e6bd9ULL, 0x4691290f821d4c23ULL,
+    0x413798c8c2b6ee8dULL, 0x97415c833a43f1c4ULL, 0x3c9b2c8553e0d16dULL,
+    0x1650aaa71957533dULL
+};
+
+size_t
+scas_chunk_next(const void *data, size_t size)
+{
+    const unsigned char *bytes;
+    uint64_t fingerprint;
+    size_t normal_size;
+    size_t i;
+
+    if (size <= SCAS_CHUNK_MIN_SIZE)
+        return size;
+
+    if (size > SCAS_CHUNK_MAX_SIZE)
+        size = SCAS_CHUNK_MAX_SIZE;
+
+    normal_size = size < SCAS_CHUNK_AVERAGE_SIZE ? size : SCAS_CHUNK_AVERAGE_SIZE;
+    bytes = data;
+    fingerprint = 0;
+
+    for (i = SCAS_CHUNK_MIN_SIZE; i < normal_size; ++i)
+    {
+        fingerprint = (fingerprint << 1) + gear[bytes[i]];
+
+        if ((fingerprint & MASK_SMALL) == 0)
+            return i + 1;
+    }
+
+    for (; i < size; ++i)
+    {
+        fingerprint = (fingerprint << 1) + gear[bytes[i]];
+
+        if ((fingerprint & MASK_LARGE) == 0)
+            return i + 1;
+    }
+
+    return size;
+}
+
+struct scas_chunk_list_t *
+scas_chunk_list_create(const void *data, size_t size, size_t *list_size)
+{
+    const unsigned char *bytes;
+    struct scas_chunk_list_t *list;
+    struct scas_chunk_t *chunks;
+    const void **ptrs;
+    size_t *sizes;
+    struct scas_hash_t *hashes;
+    size_t max_chunks;
+    size_t num_chunks;
+    size_t offset;
+    size_t i;
+
+    /*
+     * Every chunk but the last is at least the minimum size.
+     */
+    max_chunks = size / SCAS_CHUNK_MIN_SIZE + 1;
+    bytes = data;
+
+    ptrs = malloc(max_chunks * sizeof(const void *));
+    sizes = malloc(max_chunks * sizeof(size_t));
+    hashes = malloc(max_chunks * sizeof(struct scas_hash_t));
+    VERIFY(ptrs != NULL && sizes != NULL && hashes != NULL);
+
+    for (num_chunks = 0, offset = 0; offset < size; ++num_chunks)
+    {
+        ptrs[num_chunks] = bytes + offset;
+        sizes[num_chunks] = scas_chunk_next(bytes + offset, size - offset);
+        offset += sizes[num_chunks];
+    }
+
+    /*
+     * The chunks are hashed as one batch to make use of the multi-buffer
+     * kernels.
+     */
+    scas_hash_buffers(ptrs, sizes, num_chunks, hashes);
+
+    *list_size = sizeof(struct scas_chunk_list_t) + num_chunks * sizeof(struct scas_chunk_t);
+    list = calloc(1, *list_size);
+    VERIFY(list != NULL);
+
+    list->num_chunks = (uint32_t)num_chunks;
+    chunks = scas_get_chunk_base(list);
+
+    for (i = 0; i < num_chunks; ++i)
+    {
+        chunks[i].size = sizes[i];
+        chunks[i].content = hashes[i];
+    }
+
+    free(ptrs);
+    free(sizes);
+    free(hashes);
+
+    return list;
+}
@@ -0,0 +1,44 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_CHUNK_H
+#define SCAS_CHUNK_H
+
+#include <stddef.h>
+
+#include "scas_meta.h"
+
+/*
+ * Content-defined chunking with FastCDC. Chunk boundaries are placed where a
+ * rolling gear hash of the preceding bytes matches a mask, so they depend
+ * only on nearby content: an edit to a large file changes the chunks around
+ * it and leaves the rest, and their hashes, as they were.
+ *
+ * Chunks are between SCAS_CHUNK_MIN_SIZE and SCAS_CHUNK_MAX_SIZE bytes and
+ * usually close to SCAS_CHUNK_AVERAGE_SIZE. Files smaller than
+ * SCAS_CHUNK_THRESHOLD aren't worth chunking.
+ */
+#define SCAS_CHUNK_MIN_SIZE (16 * 1024)
+#define SCAS_CHUNK_AVERAGE_SIZE (64 * 1024)
+#define SCAS_CHUNK_MAX_SIZE (256 * 1024)
+#define SCAS_CHUNK_THRESHOLD (1024 * 1024)
+
+/*
+ * Returns the length of the chunk at the start of the buffer.
+ */
+size_t
+scas_chunk_next(const void *data, size_t size);
+
+/*
+ * Splits a buffer into chunks and returns the chunk list object describing
+ * them, allocated with malloc, with its size in list_size. Chunks are
+ * hashed with scas_hash_buffer and the list's own hash is the content hash
+ * of a file stored with flag_chunked.
+ */
+struct scas_chunk_list_t *
+scas_chunk_list_create(const void *data, size_t size, size_t *list_size);
+
+#endif
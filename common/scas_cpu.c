@@ -0,0 +1,90 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#include "scas_base.h"
+#include "scas_cpu.h"
+
+#ifdef SCAS_CPU_X86
+
+#include <cpuid.h>
+
+/*
+ * XCR0 bits for SSE/AVX register state, and the additional opmask and
+ * upper ZMM state needed for AVX-512.
+ */
+#define XSTATE_AVX 0x06
+#define XSTATE_AVX512 0xe6
+
+static int
+scas_cpu_os_supports_xstate(unsigned int mask)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int xcr0_lo;
+    unsigned int xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    if ((ecx & bit_OSXSAVE) == 0)
+        return 0;
+
+    /*
+     * XGETBV with ecx = 0 reads XCR0, which says which register state the
+     * OS saves across context switches.
+     */
+    __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    UNUSED(xcr0_hi);
+
+    return (xcr0_lo & mask) == mask;
+}
+
+int
+scas_cpu_supports(enum scas_cpu_feature_t feature)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int ebx7, ecx7, edx7;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx7, &ecx7, &edx7))
+    {
+        ebx7 = 0;
+    }
+
+    UNUSED(ecx7);
+    UNUSED(edx7);
+
+    switch (feature)
+    {
+        case CPU_SSE2:
+            return (edx & bit_SSE2) != 0;
+        case CPU_SSSE3:
+            return (ecx & bit_SSSE3) != 0;
+        case CPU_SSE41:
+            return (ecx & bit_SSE4_1) != 0;
+        case CPU_SHA:
+            return (ebx7 & bit_SHA) != 0;
+        case CPU_AVX2:
+            return (ebx7 & bit_AVX2) != 0 && scas_cpu_os_supports_xstate(XSTATE_AVX);
+        case CPU_AVX512F:
+            return (ebx7 & bit_AVX512F) != 0 && scas_cpu_os_supports_xstate(XSTATE_AVX512);
+    }
+
+    return 0;
+}
+
+#else
+
+int
+scas_cpu_supports(enum scas_cpu_feature_t feature)
+{
+    UNUSED(feature);
+
+    return 0;
+}
+
+#endif
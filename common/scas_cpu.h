@@ -0,0 +1,31 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_CPU_H
+#define SCAS_CPU_H
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#    define SCAS_CPU_X86 1
+#endif
+
+enum scas_cpu_feature_t
+{
+    CPU_SSE2,
+    CPU_SSSE3,
+    CPU_SSE41,
+    CPU_AVX2,
+    CPU_AVX512F,
+    CPU_SHA
+};
+
+/*
+ * Returns non-zero if both the CPU and the OS support the given instruction
+ * set extension. Always zero on non-x86 targets.
+ */
+int
+scas_cpu_supports(enum scas_cpu_feature_t feature);
+
+#endif
@@ -0,0 +1,290 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "scas_lz4.h"
+
+/*
+ * A block is a series of sequences, each a token byte, a run of literals and
+ * a back reference (a 2 byte offset and a length of at least MIN_MATCH). The
+ * token holds the literal and match lengths in its high and low nibbles;
+ * either one at 15 is continued by bytes that are added on until one isn't
+ * 255. The last sequence is literals only.
+ *
+ * The format requires the last LAST_LITERALS bytes to be literals and no
+ * match to start in the last MATCH_FIND_LIMIT bytes.
+ */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define RUN_MASK 15
+
+/*
+ * After this many consecutive positions without a match the compressor
+ * starts skipping ahead, so incompressible data is given up on quickly.
+ */
+#define SKIP_TRIGGER 6
+
+static uint32_t
+scas_lz4_read32(const unsigned char *ptr)
+{
+    uint32_t value;
+
+    memcpy(&value, ptr, sizeof value);
+
+    return value;
+}
+
+static uint32_t
+scas_lz4_hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * Writes a length continuation: as many 255s as needed, then the rest.
+ * Returns NULL if it doesn't fit.
+ */
+static unsigned char *
+scas_lz4_write_length(unsigned char *op, const unsigned char *oend, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (op >= oend)
+            return NULL;
+
+        *op++ = 255;
+    }
+
+    if (op >= oend)
+        return NULL;
+
+    *op++ = (unsigned char)length;
+
+    return op;
+}
+
+/*
+ * Writes a sequence of literals followed, if match_length is non-zero, by a
+ * back reference. Returns the new output position, or NULL if it doesn't
+ * fit.
+ */
+static unsigned char *
+scas_lz4_write_sequence(unsigned char *op, const unsigned char *oend, const unsigned char *literals, size_t literal_length, size_t offset, size_t match_length)
+{
+    unsigned char *token;
+    size_t match_code;
+
+    if (op >= oend)
+        return NULL;
+
+    token = op++;
+    *token = (unsigned char)((literal_length < RUN_MASK ? literal_length : RUN_MASK) << 4);
+
+    if (literal_length >= RUN_MASK && (op = scas_lz4_write_length(op, oend, literal_length - RUN_MASK)) == NULL)
+        return NULL;
+
+    if ((size_t)(oend - op) < literal_length)
+        return NULL;
+
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+
+    match_code = match_length - MIN_MATCH;
+    *token |= (unsigned char)(match_code < RUN_MASK ? match_code : RUN_MASK);
+
+    if (match_code >= RUN_MASK && (op = scas_lz4_write_length(op, oend, match_code - RUN_MASK)) == NULL)
+        return NULL;
+
+    return op;
+}
+
+size_t
+scas_lz4_compress(const void *src, size_t src_size, void *dst, size_t dst_capacity)
+{
+    uint32_t table[1 << HASH_BITS];
+    const unsigned char *base;
+    unsigned char *op;
+    const unsigned char *oend;
+    size_t ip;
+    size_t anchor;
+    size_t misses;
+
+    base = src;
+    op = dst;
+    oend = op + dst_capacity;
+    anchor = 0;
+
+    if (src_size > MATCH_FIND_LIMIT)
+    {
+        memset(table, 0, sizeof table);
+        ip = 0;
+        misses = 0;
+
+        while (ip < src_size - MATCH_FIND_LIMIT)
+        {
+            uint32_t hash;
+            size_t candidate;
+            size_t length;
+
+            hash = scas_lz4_hash(scas_lz4_read32(base + ip));
+            candidate = table[hash];
+            table[hash] = (uint32_t)ip;
+
+            if (candidate >= ip
+                || ip - candidate > MAX_OFFSET
+                || scas_lz4_read32(base + candidate) != scas_lz4_read32(base + ip))
+            {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+
+            misses = 0;
+
+            /*
+             * Extend the match backwards over literals that also match,
+             * then forwards as far as the format allows.
+             */
+            while (ip > anchor && candidate > 0 && base[ip - 1] == base[candidate - 1])
+            {
+                --ip;
+                --candidate;
+            }
+
+            length = MIN_MATCH;
+
+            while (ip + length < src_size - LAST_LITERALS && base[ip + length] == base[candidate + length])
+                ++length;
+
+            op = scas_lz4_write_sequence(op, oend, base + anchor, ip - anchor, ip - candidate, length);
+
+            if (op == NULL)
+                return 0;
+
+            ip += length;
+            anchor = ip;
+
+            if (ip < src_size - MATCH_FIND_LIMIT)
+                table[scas_lz4_hash(scas_lz4_read32(base + ip - 2))] = (uint32_t)(ip - 2);
+        }
+    }
+
+    op = scas_lz4_write_sequence(op, oend, base + anchor, src_size - anchor, 0, 0);
+
+    return op == NULL ? 0 : (size_t)(op - (unsigned char *)dst);
+}
+
+/*
+ * Reads a length continuation. Returns non-zero if it runs off the end of
+ * the input.
+ */
+static int
+scas_lz4_read_length(const unsigned char **ip, const unsigned char *iend, size_t *length)
+{
+    unsigned char byte;
+
+    do
+    {
+        if (*ip >= iend)
+            return 1;
+
+        byte = *(*ip)++;
+        *length += byte;
+    }
+    while (byte == 255);
+
+    return 0;
+}
+
+int
+scas_lz4_decompress(const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+    const unsigned char *ip;
+    const unsigned char *iend;
+    unsigned char *op;
+    unsigned char *oend;
+
+    ip = src;
+    iend = ip + src_size;
+    op = dst;
+    oend = op + dst_size;
+
+    while (ip < iend)
+    {
+        unsigned char token;
+        size_t literal_length;
+        size_t match_length;
+        size_t offset;
+
+        token = *ip++;
+        literal_length = token >> 4;
+
+        if (literal_length == RUN_MASK && scas_lz4_read_length(&ip, iend, &literal_length) != 0)
+            return -1;
+
+        if ((size_t)(iend - ip) < literal_length || (size_t)(oend - op) < literal_length)
+            return -1;
+
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        /*
+         * The last sequence has no match.
+         */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst))
+            return -1;
+
+        match_length = token & RUN_MASK;
+
+        if (match_length == RUN_MASK && scas_lz4_read_length(&ip, iend, &match_length) != 0)
+            return -1;
+
+        match_length += MIN_MATCH;
+
+        if ((size_t)(oend - op) < match_length)
+            return -1;
+
+        /*
+         * A match may overlap the bytes it produces, repeating a short
+         * pattern, in which case it has to be copied a byte at a time.
+         */
+        if (offset >= match_length)
+        {
+            memcpy(op, op - offset, match_length);
+            op += match_length;
+        }
+        else
+        {
+            for (; match_length > 0; --match_length, ++op)
+                *op = op[-(ptrdiff_t)offset];
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
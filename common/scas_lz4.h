@@ -0,0 +1,34 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_LZ4_H
+#define SCAS_LZ4_H
+
+#include <stddef.h>
+
+/*
+ * Compression in the LZ4 block format, without the frame format around it:
+ * the caller keeps track of the compressed and decompressed sizes. Blocks
+ * are interchangeable with those of the reference implementation.
+ */
+
+/*
+ * Compresses src into dst. Returns the compressed size, or 0 if it doesn't
+ * fit in dst_capacity bytes, which also serves as an early way out for data
+ * that doesn't compress well enough to be worth it.
+ */
+size_t
+scas_lz4_compress(const void *src, size_t src_size, void *dst, size_t dst_capacity);
+
+/*
+ * Decompresses src into dst, which must be exactly the size of the original
+ * data. Returns 0 on success and non-zero if src is malformed; dst is never
+ * written past dst_size and src never read past src_size.
+ */
+int
+scas_lz4_decompress(const void *src, size_t src_size, void *dst, size_t dst_size);
+
+#endif
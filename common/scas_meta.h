@@ -11,7 +11,19 @@
 
 enum scas_file_flags_t
 {
-    flag_is_directory = 1 << 0
+    flag_is_directory = 1 << 0,
+
+    /*
+     * The content hash was computed with scas_hash_buffer_tree rather than
+     * scas_hash_buffer.
+     */
+    flag_tree_hash = 1 << 1,
+
+    /*
+     * The content hash is that of a chunk list naming the chunks the file
+     * is made of; see scas_chunk.h. Chunked files aren't tree hashed.
+     */
+    flag_chunked = 1 << 2
 };
 
 struct scas_file_meta_t
@@ -22,6 +34,19 @@ struct scas_file_meta_t
     struct scas_hash_t content;
 };
 
+/*
+ * Pushed by the client at the start of a SNAPSHOT_PUSH. The root's content
+ * field is the hash of the snapshot's root directory record, and
+ * hash_algorithm is the algorithm every hash in the snapshot was computed
+ * with.
+ */
+struct scas_snapshot_meta_t
+{
+    uint32_t hash_algorithm;
+    uint32_t reserved;
+    struct scas_file_meta_t root;
+};
+
 /*
  * Directory entries are setup as following:
  * offset  data
@@ -37,12 +62,51 @@ struct scas_directory_meta_t
     struct scas_hash_t parent;
 };
 
+/*
+ * A chunk list is a struct scas_chunk_list_t followed by num_chunks
+ * struct scas_chunk_t, in file order.
+ */
+struct scas_chunk_list_t
+{
+    uint32_t num_chunks;
+    uint32_t reserved;
+};
+
+struct scas_chunk_t
+{
+    uint64_t size;
+    struct scas_hash_t content;
+};
+
 static inline int
 scas_is_directory(int flags)
 {
     return (flags & flag_is_directory) != 0;
 }
 
+static inline int
+scas_is_tree_hashed(int flags)
+{
+    return (flags & flag_tree_hash) != 0;
+}
+
+static inline int
+scas_is_chunked(int flags)
+{
+    return (flags & flag_chunked) != 0;
+}
+
+/*
+ * Hashes file content with the scheme the flags call for.
+ */
+static inline struct scas_hash_t
+scas_hash_content(const void *ptr, size_t size, int flags)
+{
+    return scas_is_tree_hashed(flags)
+        ? scas_hash_buffer_tree(ptr, size)
+        : scas_hash_buffer(ptr, size);
+}
+
 static inline struct scas_file_meta_t *
 scas_get_file_meta_base(struct scas_directory_meta_t *directory)
 {
@@ -52,4 +116,50 @@ scas_get_file_meta_base(struct scas_directory_meta_t *directory)
     return (struct scas_file_meta_t *)file_meta_base;
 }
 
+static inline struct scas_chunk_t *
+scas_get_chunk_base(struct scas_chunk_list_t *list)
+{
+    void *chunk_base;
+    chunk_base = &list[1];
+
+    return (struct scas_chunk_t *)chunk_base;
+}
+
+/*
+ * Records come from clients, so their counts are checked against their
+ * sizes before their entries are looked at. A directory record must have
+ * room for the file metadata of every entry it claims; a chunk list must
+ * be exactly as long as its chunks. Each returns non-zero if the record
+ * doesn't hold together.
+ */
+static inline int
+scas_directory_is_malformed(const void *ptr, size_t size)
+{
+    const struct scas_directory_meta_t *directory;
+
+    if (size < sizeof(struct scas_directory_meta_t))
+    {
+        return 1;
+    }
+
+    directory = ptr;
+
+    return (size - sizeof(struct scas_directory_meta_t)) / sizeof(struct scas_file_meta_t) < directory->num_entries;
+}
+
+static inline int
+scas_chunk_list_is_malformed(const void *ptr, size_t size)
+{
+    const struct scas_chunk_list_t *list;
+
+    if (size < sizeof(struct scas_chunk_list_t))
+    {
+        return 1;
+    }
+
+    list = ptr;
+
+    return size != sizeof(struct scas_chunk_list_t) + (size_t)list->num_chunks * sizeof(struct scas_chunk_t);
+}
+
 #endif
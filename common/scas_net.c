@@ -4,8 +4,11 @@
  * See LICENSE for details.
  ***********************************************************************/
 
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -23,13 +26,22 @@ int
 scas_listen(void)
 {
     int socket_fd;
+    int enable;
     struct sockaddr_in addr;
     const int LISTEN_BACKLOG = 50;
 
     memset(&addr, 0, sizeof addr);
     socket_fd = socket(AF_INET, SOCK_STREAM, 0);
    
-    SCAS_VERIFY(socket_fd != 0, "Could not create socket");
+    SCAS_VERIFY(socket_fd >= 0, "Could not create socket");
+
+    /*
+     * Every socket listening on the port gets a share of the incoming
+     * connections.
+     */
+    enable = 1;
+    SCAS_VERIFY(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable) == 0, "Could not set SO_REUSEADDR");
+    SCAS_VERIFY(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable) == 0, "Could not set SO_REUSEPORT");
 
     addr.sin_port = htons(SCAS_PORT);
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -55,6 +67,14 @@ scas_accept(int socket_fd)
     return socket;
 }
 
+int
+scas_set_cork(int socket_fd, int cork)
+{
+    SCAS_VERIFY(setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof cork) == 0, "Could not set TCP_CORK");
+
+    return 0;
+}
+
 int
 scas_connect(const char *server_name)
 {
@@ -146,7 +166,7 @@ loop_write(int connection, const void *data, size_t data_size)
     }
 }
 
-static void
+static int
 loop_read(int connection, void *data, size_t data_size)
 {
     ssize_t data_read;
@@ -164,12 +184,20 @@ loop_read(int connection, void *data, size_t data_size)
         if (rv < 0)
         {
             scas_log("Unable to read data of size %d. Error code %d returned.", data_size, errno);
-            return;
+            return -1;
+        }
+
+        if (rv == 0)
+        {
+            scas_log("Connection closed while reading data of size %d.", data_size);
+            return -1;
         }
 
         data_read += rv;
         data_remaining -= rv;
     }
+
+    return 0;
 }
 
 long
@@ -177,7 +205,7 @@ scas_write(int connection, enum scas_command_t command, const void *data, size_t
 {
     struct scas_header_t header;
 
-    header.packet_size = data_size;
+    header.packet_size = data_size + sizeof(struct scas_header_t);
     header.command = command;
 
     loop_write(connection, &header, sizeof(struct scas_header_t));
@@ -192,11 +220,68 @@ scas_read(int connection)
     struct scas_header_t header;
     void *mem;
 
-    loop_read(connection, &header, sizeof(struct scas_header_t));
-    mem = malloc(header.packet_size);
-    loop_read(connection, mem, header.packet_size);
+    if (loop_read(connection, &header, sizeof(struct scas_header_t)) != 0
+        || header.packet_size < sizeof(struct scas_header_t))
+    {
+        return NULL;
+    }
+
+    mem = malloc(scas_header_payload_size(header));
+
+    if (loop_read(connection, mem, scas_header_payload_size(header)) != 0)
+    {
+        free(mem);
+        return NULL;
+    }
     
     return mem;
 }
 
+int
+scas_handshake(int connection)
+{
+    struct scas_hello_t hello;
+    struct scas_hello_t reply;
+    struct scas_header_t header;
+
+    hello.protocol_version = SCAS_PROTOCOL_VERSION;
+    hello.hash_algorithm = scas_hash_get_algorithm();
+
+    scas_write(connection, CMD_HELLO, &hello, sizeof hello);
+
+    if (loop_read(connection, &header, sizeof(struct scas_header_t)) != 0)
+    {
+        scas_log("Server closed the connection during the handshake.");
+        return -1;
+    }
+
+    if (header.command != CMD_HELLO
+        || header.packet_size != sizeof(struct scas_header_t) + sizeof(struct scas_hello_t))
+    {
+        scas_log("Server replied to the handshake with command %u of %lu bytes.",
+            (unsigned)header.command, (unsigned long)header.packet_size);
+        return -1;
+    }
+
+    if (loop_read(connection, &reply, sizeof reply) != 0)
+    {
+        scas_log("Server closed the connection during the handshake.");
+        return -1;
+    }
+
+    if (reply.protocol_version != hello.protocol_version)
+    {
+        scas_log("Server speaks protocol version %u, expected %u.", reply.protocol_version, hello.protocol_version);
+        return -1;
+    }
+
+    if (reply.hash_algorithm != hello.hash_algorithm)
+    {
+        scas_log("Server store uses hash algorithm %s, expected %s.",
+            scas_hash_algorithm_name(reply.hash_algorithm),
+            scas_hash_algorithm_name(hello.hash_algorithm));
+        return -1;
+    }
 
+    return 0;
+}
@@ -15,7 +15,10 @@ enum scas_command_t
     CMD_SNAPSHOT_PUSH,
     CMD_DATA_FETCH,
     CMD_DATA,
-    CMD_QUIT
+    CMD_QUIT,
+    CMD_HELLO,
+    CMD_HAVE_QUERY,
+    CMD_WANT_LIST
 };
 
 /*
@@ -38,12 +41,77 @@ scas_header_payload_size(struct scas_header_t header)
     return header.packet_size - sizeof(struct scas_header_t);
 }
 
+/*
+ * Sent by the client as the first packet on a connection, and echoed back by
+ * the server with its own values. A client and server whose stores use
+ * different hash algorithms can't share any content, so the connection is
+ * closed after the reply rather than letting every lookup miss.
+ *
+ *            HELLO ->
+ * struct scas_hello_t ->
+ *                    <- HELLO
+ *                    <- struct scas_hello_t
+ */
+
+#define SCAS_PROTOCOL_VERSION 1
+
+struct scas_hello_t
+{
+    uint32_t protocol_version;
+    uint32_t hash_algorithm;
+};
+
+/*
+ * Lets a client upload a batch of objects, such as everything in a
+ * directory, in a single round trip rather than waiting to be asked for
+ * each one. The client lists the objects as struct scas_file_meta_t
+ * entries, the way a directory record does, and the server answers with a
+ * bitmap of the ones it wants, bit i % 8 of byte i / 8 standing for the
+ * i'th entry. The client then sends every wanted object as a DATA packet,
+ * in order, without waiting for anything further.
+ *
+ * An object listed more than once is wanted at most once. A chunk list is
+ * only kept if every chunk it names is in the store by the time it
+ * arrives, so a chunked file's chunks go in an earlier batch, or earlier
+ * in the same one.
+ *
+ *                     HAVE_QUERY ->
+ *       struct scas_have_query_t ->
+ * struct scas_file_meta_t[count] ->
+ *                                <- WANT_LIST
+ *                                <- bitmap
+ *                           data ->
+ *                               ....
+ *                           data ->
+ */
+
+#define SCAS_HAVE_QUERY_MAX_ENTRIES (1 << 16)
+
+struct scas_have_query_t
+{
+    uint32_t num_entries;
+    uint32_t reserved;
+};
+
+/*
+ * Opens a socket listening on the server port. It may be called once per
+ * thread; the kernel spreads incoming connections over all of the sockets.
+ * Returns < 0 on failure.
+ */
 int
 scas_listen(void);
 
 int
 scas_accept(int socket_fd);
 
+/*
+ * While a socket is corked, partial packets are held back until it is
+ * uncorked, so that a header and the payload written after it go out
+ * together. Returns < 0 on failure.
+ */
+int
+scas_set_cork(int socket_fd, int cork);
+
 /*
  * Connects to the specified server. On success, returns a socket that can be 
  * read from/written to. On failure, returns < 0.
@@ -54,7 +122,19 @@ scas_connect(const char *server_name);
 long
 scas_write(int connection, enum scas_command_t command, const void *data, size_t data_size);
 
+/*
+ * Reads one packet and returns its payload, which the caller frees. Returns
+ * NULL if the connection fails or is closed before the packet is complete.
+ */
 void *
 scas_read(int connection);
 
+/*
+ * Exchanges HELLO packets with the server. Returns 0 if the server speaks the
+ * same protocol version and uses the same hash algorithm as this process,
+ * and non-zero otherwise.
+ */
+int
+scas_handshake(int connection);
+
 #endif
@@ -0,0 +1,998 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "scas_base.h"
+#include "scas_cpu.h"
+#include "scas_sha1.h"
+
+#ifdef SCAS_CPU_X86
+#    include <immintrin.h>
+#endif
+
+#define SHA1_K0 0x5a827999
+#define SHA1_K1 0x6ed9eba1
+#define SHA1_K2 0x8f1bbcdc
+#define SHA1_K3 0xca62c1d6
+
+/*
+ * Widest multi-buffer kernel, in 32 bit lanes.
+ */
+#define SHA1_MAX_LANES 16
+
+static inline uint32_t
+u32_to_big_endian(uint32_t p)
+{
+    return ((p & 0x000000FF) << 24)
+        | ((p & 0x0000FF00) << 8)
+        | ((p & 0x00FF0000) >> 8)
+        | ((p & 0xFF000000) >> 24);
+}
+
+static inline uint32_t
+left_rotate_1(uint32_t val)
+{
+    return (val << 1) | (val >> 31);
+}
+
+static inline uint32_t
+left_rotate_5(uint32_t val)
+{
+    return (val << 5) | (val >> 27);
+}
+
+static inline uint32_t
+left_rotate_30(uint32_t val)
+{
+    return (val << 30) | (val >> 2);
+}
+
+static inline struct scas_hash_t
+hash_chunk(struct scas_hash_t h, const void *mem)
+{
+    uint32_t buf[80];
+    int i;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t e;
+    uint32_t f;
+    uint32_t k;
+    uint32_t temp;
+    uint32_t words[16];
+    const uint32_t *ptr;
+
+    /*
+     * Blocks handed to us by callers aren't necessarily word aligned.
+     */
+    memcpy(words, mem, sizeof words);
+    ptr = words;
+
+    buf[0] = u32_to_big_endian(ptr[0]);
+    buf[1] = u32_to_big_endian(ptr[1]);
+    buf[2] = u32_to_big_endian(ptr[2]);
+    buf[3] = u32_to_big_endian(ptr[3]);
+    buf[4] = u32_to_big_endian(ptr[4]);
+    buf[5] = u32_to_big_endian(ptr[5]);
+    buf[6] = u32_to_big_endian(ptr[6]);
+    buf[7] = u32_to_big_endian(ptr[7]);
+    buf[8] = u32_to_big_endian(ptr[8]);
+    buf[9] = u32_to_big_endian(ptr[9]);
+    buf[10] = u32_to_big_endian(ptr[10]);
+    buf[11] = u32_to_big_endian(ptr[11]);
+    buf[12] = u32_to_big_endian(ptr[12]);
+    buf[13] = u32_to_big_endian(ptr[13]);
+    buf[14] = u32_to_big_endian(ptr[14]);
+    buf[15] = u32_to_big_endian(ptr[15]);
+
+    for (i = 16; i < 80; ++i)
+    {
+        buf[i] = left_rotate_1((buf[i - 3] ^ buf[i - 8] ^ buf[i - 14] ^ buf[i - 16]));
+    }
+
+    a = h.hash[0];
+    b = h.hash[1];
+    c = h.hash[2];
+    d = h.hash[3];
+    e = h.hash[4];
+
+    #define ITERATE() { \
+        temp = left_rotate_5(a) + f + e + k + buf[i]; \
+        e = d; \
+        d = c; \
+        c = left_rotate_30(b); \
+        b = a; \
+        a = temp; \
+    }
+
+    k = SHA1_K0;
+    for (i = 0; i < 20; ++i)
+    {
+        f = (b & c) | ((~b) & d);
+        ITERATE();
+    }
+
+    k = SHA1_K1;
+    for (; i < 40; ++i)
+    {
+        f = b ^ c ^ d;
+        ITERATE();
+    }
+
+    k = SHA1_K2;
+    for (; i < 60; ++i)
+    {
+        f = (b & c) | (b & d) | (c & d);
+        ITERATE();
+    }
+
+    k = SHA1_K3;
+    for (; i < 80; ++i)
+    {
+        f = b ^ c ^ d;
+        ITERATE();
+    }
+
+    #undef ITERATE
+
+    h.hash[0] = h.hash[0] + a;
+    h.hash[1] = h.hash[1] + b;
+    h.hash[2] = h.hash[2] + c;
+    h.hash[3] = h.hash[3] + d;
+    h.hash[4] = h.hash[4] + e;
+
+    return h;
+}
+
+static void
+sha1_compress_generic(struct scas_hash_t *hash, const unsigned char *blocks, size_t num_blocks)
+{
+    size_t i;
+
+    for (i = 0; i < num_blocks; ++i)
+    {
+        *hash = hash_chunk(*hash, blocks);
+        blocks += 64;
+    }
+}
+
+static int
+sha1_generic_is_supported(void)
+{
+    return 1;
+}
+
+#ifdef SCAS_CPU_X86
+
+/*
+ * Round function used by the kernels that compute the message schedule with
+ * SIMD instructions. The schedule arrives with the round constants already
+ * added in, so each round is a single add away from the scalar version.
+ */
+static inline void
+sha1_rounds(struct scas_hash_t *h, const uint32_t wk[80])
+{
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t e;
+    uint32_t temp;
+    int i;
+
+    a = h->hash[0];
+    b = h->hash[1];
+    c = h->hash[2];
+    d = h->hash[3];
+    e = h->hash[4];
+
+    #define ITERATE(F) { \
+        temp = left_rotate_5(a) + (F) + e + wk[i]; \
+        e = d; \
+        d = c; \
+        c = left_rotate_30(b); \
+        b = a; \
+        a = temp; \
+    }
+
+    for (i = 0; i < 20; ++i)
+        ITERATE(d ^ (b & (c ^ d)));
+
+    for (; i < 40; ++i)
+        ITERATE(b ^ c ^ d);
+
+    for (; i < 60; ++i)
+        ITERATE((b & c) | (d & (b | c)));
+
+    for (; i < 80; ++i)
+        ITERATE(b ^ c ^ d);
+
+    #undef ITERATE
+
+    h->hash[0] += a;
+    h->hash[1] += b;
+    h->hash[2] += c;
+    h->hash[3] += d;
+    h->hash[4] += e;
+}
+
+static inline uint32_t
+sha1_round_constant(int group)
+{
+    static const uint32_t k[4] = { SHA1_K0, SHA1_K1, SHA1_K2, SHA1_K3 };
+
+    /*
+     * Groups are four rounds wide, so each constant covers five groups.
+     */
+    return k[group / 5];
+}
+
+/*
+ * SSSE3 kernel. The message schedule is computed four words at a time:
+ *
+ *   W[t] = rol1(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])
+ *
+ * The top lane of each vector depends on W[t] from the bottom lane of the
+ * same vector, so it is computed without that term and patched up with
+ * rol1(W[t]) afterwards.
+ */
+#define SHA1_SCHEDULE_STEP(VEC, SRLI, SLLI, ALIGNR, XOR, OR, SHL32, SHR32, w, i) \
+    do {                                                                    \
+        VEC x_;                                                             \
+        VEC r_;                                                             \
+        VEC t_;                                                             \
+                                                                            \
+        x_ = XOR(SRLI(w[(i) - 1], 4), w[(i) - 2]);                          \
+        x_ = XOR(x_, ALIGNR(w[(i) - 3], w[(i) - 4], 8));                    \
+        x_ = XOR(x_, w[(i) - 4]);                                           \
+        r_ = OR(SHL32(x_, 1), SHR32(x_, 31));                               \
+        t_ = SLLI(r_, 12);                                                  \
+        r_ = XOR(r_, OR(SHL32(t_, 1), SHR32(t_, 31)));                      \
+        w[i] = r_;                                                          \
+    } while (0)
+
+__attribute__((target("ssse3")))
+static void
+sha1_compress_ssse3(struct scas_hash_t *hash, const unsigned char *blocks, size_t num_blocks)
+{
+    uint32_t wk[80];
+    __m128i w[20];
+    __m128i byte_swap;
+    size_t n;
+    int i;
+
+    byte_swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    for (n = 0; n < num_blocks; ++n)
+    {
+        for (i = 0; i < 4; ++i)
+        {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + i * 16)), byte_swap);
+        }
+
+        for (i = 4; i < 20; ++i)
+        {
+            SHA1_SCHEDULE_STEP(__m128i, _mm_srli_si128, _mm_slli_si128, _mm_alignr_epi8,
+                _mm_xor_si128, _mm_or_si128, _mm_slli_epi32, _mm_srli_epi32, w, i);
+        }
+
+        for (i = 0; i < 20; ++i)
+        {
+            __m128i k;
+
+            k = _mm_set1_epi32((int)sha1_round_constant(i));
+            _mm_storeu_si128((__m128i *)&wk[i * 4], _mm_add_epi32(w[i], k));
+        }
+
+        sha1_rounds(hash, wk);
+        blocks += 64;
+    }
+}
+
+static int
+sha1_ssse3_is_supported(void)
+{
+    return scas_cpu_supports(CPU_SSSE3);
+}
+
+/*
+ * AVX2 kernel. The 256 bit byte shifts and alignr operate on each 128 bit
+ * half independently, so the SSSE3 schedule carries over unchanged with one
+ * block in each half. Two schedules are produced per pass.
+ */
+__attribute__((target("avx2")))
+static void
+sha1_compress_avx2(struct scas_hash_t *hash, const unsigned char *blocks, size_t num_blocks)
+{
+    uint32_t wk[2][80];
+    __m256i w[20];
+    __m256i byte_swap;
+    size_t n;
+    int i;
+
+    byte_swap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    for (n = 0; n + 2 <= num_blocks; n += 2)
+    {
+        for (i = 0; i < 4; ++i)
+        {
+            __m128i lo;
+            __m128i hi;
+
+            lo = _mm_loadu_si128((const __m128i *)(blocks + i * 16));
+            hi = _mm_loadu_si128((const __m128i *)(blocks + 64 + i * 16));
+            w[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            w[i] = _mm256_shuffle_epi8(w[i], byte_swap);
+        }
+
+        for (i = 4; i < 20; ++i)
+        {
+            SHA1_SCHEDULE_STEP(__m256i, _mm256_srli_si256, _mm256_slli_si256, _mm256_alignr_epi8,
+                _mm256_xor_si256, _mm256_or_si256, _mm256_slli_epi32, _mm256_srli_epi32, w, i);
+        }
+
+        for (i = 0; i < 20; ++i)
+        {
+            __m256i v;
+
+            v = _mm256_add_epi32(w[i], _mm256_set1_epi32((int)sha1_round_constant(i)));
+            _mm_storeu_si128((__m128i *)&wk[0][i * 4], _mm256_castsi256_si128(v));
+            _mm_storeu_si128((__m128i *)&wk[1][i * 4], _mm256_extracti128_si256(v, 1));
+        }
+
+        sha1_rounds(hash, wk[0]);
+        sha1_rounds(hash, wk[1]);
+        blocks += 128;
+    }
+
+    if (n < num_blocks)
+    {
+        sha1_compress_ssse3(hash, blocks, 1);
+    }
+}
+
+static int
+sha1_avx2_is_supported(void)
+{
+    return scas_cpu_supports(CPU_AVX2);
+}
+
+/*
+ * SHA-NI kernel. sha1rnds4 performs four rounds at a time and
+ * sha1msg1/sha1msg2 produce the message schedule, so a block is 20 groups
+ * of four rounds with the schedule running three groups ahead.
+ *
+ * The round function selector passed to sha1rnds4 must be an immediate,
+ * hence the unrolling.
+ */
+#define SHANI_GROUP(G, F)                                                   \
+    do {                                                                    \
+        e = _mm_sha1nexte_epu32(prev_abcd, msg[(G) & 3]);                   \
+        prev_abcd = abcd;                                                   \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, F);                             \
+        if ((G) >= 3 && (G) <= 18)                                          \
+            msg[((G) + 1) & 3] = _mm_sha1msg2_epu32(msg[((G) + 1) & 3], msg[(G) & 3]); \
+        if ((G) >= 1 && (G) <= 16)                                          \
+            msg[((G) - 1) & 3] = _mm_sha1msg1_epu32(msg[((G) - 1) & 3], msg[(G) & 3]); \
+        if ((G) >= 2 && (G) <= 17)                                          \
+            msg[((G) + 2) & 3] = _mm_xor_si128(msg[((G) + 2) & 3], msg[(G) & 3]); \
+    } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_compress_shani(struct scas_hash_t *hash, const unsigned char *blocks, size_t num_blocks)
+{
+    __m128i abcd;
+    __m128i abcd_save;
+    __m128i e0;
+    __m128i e0_save;
+    __m128i e;
+    __m128i prev_abcd;
+    __m128i msg[4];
+    __m128i byte_swap;
+    size_t n;
+    int i;
+
+    byte_swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    abcd = _mm_loadu_si128((const __m128i *)hash->hash);
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    e0 = _mm_set_epi32((int)hash->hash[4], 0, 0, 0);
+
+    for (n = 0; n < num_blocks; ++n)
+    {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        for (i = 0; i < 4; ++i)
+        {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + i * 16)), byte_swap);
+        }
+
+        /*
+         * The first group adds E directly, there's no previous state to
+         * rotate.
+         */
+        e = _mm_add_epi32(e0, msg[0]);
+        prev_abcd = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+
+        SHANI_GROUP(1, 0);
+        SHANI_GROUP(2, 0);
+        SHANI_GROUP(3, 0);
+        SHANI_GROUP(4, 0);
+        SHANI_GROUP(5, 1);
+        SHANI_GROUP(6, 1);
+        SHANI_GROUP(7, 1);
+        SHANI_GROUP(8, 1);
+        SHANI_GROUP(9, 1);
+        SHANI_GROUP(10, 2);
+        SHANI_GROUP(11, 2);
+        SHANI_GROUP(12, 2);
+        SHANI_GROUP(13, 2);
+        SHANI_GROUP(14, 2);
+        SHANI_GROUP(15, 3);
+        SHANI_GROUP(16, 3);
+        SHANI_GROUP(17, 3);
+        SHANI_GROUP(18, 3);
+        SHANI_GROUP(19, 3);
+
+        e0 = _mm_sha1nexte_epu32(prev_abcd, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        blocks += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    _mm_storeu_si128((__m128i *)hash->hash, abcd);
+    hash->hash[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_GROUP
+
+static int
+sha1_shani_is_supported(void)
+{
+    return scas_cpu_supports(CPU_SHA) && scas_cpu_supports(CPU_SSE41) && scas_cpu_supports(CPU_SSSE3);
+}
+
+/*
+ * Multi-buffer kernels. Rather than vectorising within one message, these
+ * run LANES independent messages side by side with one message per SIMD
+ * lane, so the 80 rounds are carried out on whole vectors. State is kept
+ * transposed: state[word * LANES + lane].
+ *
+ * The kernel body is shared between instruction sets; the MB_* operation
+ * macros are defined before each instantiation.
+ */
+static inline uint32_t
+load_big_endian(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+#define SHA1_MB_ROUND(F)                                                    \
+    do {                                                                    \
+        if (i >= 16)                                                        \
+        {                                                                   \
+            temp = MB_XOR(MB_XOR(w[(i - 3) & 15], w[(i - 8) & 15]),         \
+                MB_XOR(w[(i - 14) & 15], w[i & 15]));                       \
+            w[i & 15] = MB_ROL(temp, 1);                                    \
+        }                                                                   \
+                                                                            \
+        temp = MB_ADD(MB_ADD(MB_ROL(a, 5), F), MB_ADD(MB_ADD(e, k), w[i & 15])); \
+        e = d;                                                              \
+        d = c;                                                              \
+        c = MB_ROL(b, 30);                                                  \
+        b = a;                                                              \
+        a = temp;                                                           \
+    } while (0)
+
+#define SHA1_MB_DEFINE_COMPRESS(NAME, TARGET, LANES, VEC)                   \
+    __attribute__((target(TARGET)))                                        \
+    static void                                                             \
+    NAME(uint32_t *state, const unsigned char *const *blocks)               \
+    {                                                                       \
+        uint32_t words[16 * (LANES)];                                       \
+        VEC w[16];                                                          \
+        VEC a;                                                              \
+        VEC b;                                                              \
+        VEC c;                                                              \
+        VEC d;                                                              \
+        VEC e;                                                              \
+        VEC k;                                                              \
+        VEC temp;                                                           \
+        int i;                                                              \
+        int lane;                                                           \
+                                                                            \
+        for (lane = 0; lane < (LANES); ++lane)                              \
+        {                                                                   \
+            for (i = 0; i < 16; ++i)                                        \
+            {                                                               \
+                words[i * (LANES) + lane] = load_big_endian(blocks[lane] + i * 4); \
+            }                                                               \
+        }                                                                   \
+                                                                            \
+        for (i = 0; i < 16; ++i)                                            \
+        {                                                                   \
+            w[i] = MB_LOAD(&words[i * (LANES)]);                            \
+        }                                                                   \
+                                                                            \
+        a = MB_LOAD(&state[0 * (LANES)]);                                   \
+        b = MB_LOAD(&state[1 * (LANES)]);                                   \
+        c = MB_LOAD(&state[2 * (LANES)]);                                   \
+        d = MB_LOAD(&state[3 * (LANES)]);                                   \
+        e = MB_LOAD(&state[4 * (LANES)]);                                   \
+                                                                            \
+        k = MB_SET1(SHA1_K0);                                               \
+        for (i = 0; i < 20; ++i)                                            \
+            SHA1_MB_ROUND(MB_CHOOSE(b, c, d));                              \
+                                                                            \
+        k = MB_SET1(SHA1_K1);                                               \
+        for (; i < 40; ++i)                                                 \
+            SHA1_MB_ROUND(MB_PARITY(b, c, d));                              \
+                                                                            \
+        k = MB_SET1(SHA1_K2);                                               \
+        for (; i < 60; ++i)                                                 \
+            SHA1_MB_ROUND(MB_MAJORITY(b, c, d));                            \
+                                                                            \
+        k = MB_SET1(SHA1_K3);                                               \
+        for (; i < 80; ++i)                                                 \
+            SHA1_MB_ROUND(MB_PARITY(b, c, d));                              \
+                                                                            \
+        MB_STORE(&state[0 * (LANES)], MB_ADD(MB_LOAD(&state[0 * (LANES)]), a)); \
+        MB_STORE(&state[1 * (LANES)], MB_ADD(MB_LOAD(&state[1 * (LANES)]), b)); \
+        MB_STORE(&state[2 * (LANES)], MB_ADD(MB_LOAD(&state[2 * (LANES)]), c)); \
+        MB_STORE(&state[3 * (LANES)], MB_ADD(MB_LOAD(&state[3 * (LANES)]), d)); \
+        MB_STORE(&state[4 * (LANES)], MB_ADD(MB_LOAD(&state[4 * (LANES)]), e)); \
+    }
+
+#define MB_LOAD(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define MB_STORE(p, v) _mm_storeu_si128((__m128i *)(void *)(p), v)
+#define MB_SET1(x) _mm_set1_epi32((int)(x))
+#define MB_ADD _mm_add_epi32
+#define MB_XOR _mm_xor_si128
+#define MB_ROL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define MB_CHOOSE(b, c, d) _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)))
+#define MB_PARITY(b, c, d) _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define MB_MAJORITY(b, c, d) _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)))
+
+SHA1_MB_DEFINE_COMPRESS(sha1_mb_compress_sse2, "sse2", 4, __m128i)
+
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_ROL
+#undef MB_CHOOSE
+#undef MB_PARITY
+#undef MB_MAJORITY
+
+#define MB_LOAD(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define MB_STORE(p, v) _mm256_storeu_si256((__m256i *)(void *)(p), v)
+#define MB_SET1(x) _mm256_set1_epi32((int)(x))
+#define MB_ADD _mm256_add_epi32
+#define MB_XOR _mm256_xor_si256
+#define MB_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define MB_CHOOSE(b, c, d) _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define MB_PARITY(b, c, d) _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define MB_MAJORITY(b, c, d) _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+
+SHA1_MB_DEFINE_COMPRESS(sha1_mb_compress_avx2, "avx2", 8, __m256i)
+
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_ROL
+#undef MB_CHOOSE
+#undef MB_PARITY
+#undef MB_MAJORITY
+
+/*
+ * AVX-512 has a native rotate and a three input logic instruction, which
+ * turns each round function into a single operation.
+ */
+#define MB_LOAD(p) _mm512_loadu_si512((const void *)(p))
+#define MB_STORE(p, v) _mm512_storeu_si512((void *)(p), v)
+#define MB_SET1(x) _mm512_set1_epi32((int)(x))
+#define MB_ADD _mm512_add_epi32
+#define MB_XOR _mm512_xor_si512
+#define MB_ROL(x, n) _mm512_rol_epi32(x, n)
+#define MB_CHOOSE(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xca)
+#define MB_PARITY(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define MB_MAJORITY(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xe8)
+
+SHA1_MB_DEFINE_COMPRESS(sha1_mb_compress_avx512, "avx512f", 16, __m512i)
+
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_ROL
+#undef MB_CHOOSE
+#undef MB_PARITY
+#undef MB_MAJORITY
+
+static int
+sha1_sse2_is_supported(void)
+{
+    return scas_cpu_supports(CPU_SSE2);
+}
+
+static int
+sha1_avx512_is_supported(void)
+{
+    return scas_cpu_supports(CPU_AVX512F);
+}
+
+#endif
+
+typedef void (*scas_sha1_compress_fn_t)(struct scas_hash_t *, const unsigned char *, size_t);
+
+struct scas_sha1_kernel_t
+{
+    const char *name;
+    scas_sha1_compress_fn_t compress;
+    int (*is_supported)(void);
+};
+
+/*
+ * Ordered from fastest to slowest; automatic selection picks the first one
+ * the CPU supports.
+ */
+static const struct scas_sha1_kernel_t kernels[] =
+{
+#ifdef SCAS_CPU_X86
+    { "shani",   sha1_compress_shani,   sha1_shani_is_supported },
+    { "avx2",    sha1_compress_avx2,    sha1_avx2_is_supported },
+    { "ssse3",   sha1_compress_ssse3,   sha1_ssse3_is_supported },
+#endif
+    { "generic", sha1_compress_generic, sha1_generic_is_supported }
+};
+
+#define NUM_KERNELS (sizeof kernels / sizeof kernels[0])
+
+/*
+ * Chosen on first use, by whichever thread hashes first. Threads that race
+ * to choose all pick the same kernel, and it's published with a single
+ * atomic store, so a thread sees either no kernel or a complete one.
+ */
+static const struct scas_sha1_kernel_t *active_kernel;
+
+static const struct scas_sha1_kernel_t *
+sha1_find_kernel(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_KERNELS; ++i)
+    {
+        if (name != NULL && strcmp(name, kernels[i].name) != 0)
+            continue;
+
+        if (!kernels[i].is_supported())
+        {
+            if (name != NULL)
+                return NULL;
+
+            continue;
+        }
+
+        return &kernels[i];
+    }
+
+    return NULL;
+}
+
+int
+scas_sha1_select_kernel(const char *name)
+{
+    const struct scas_sha1_kernel_t *kernel;
+
+    kernel = sha1_find_kernel(name);
+
+    if (kernel == NULL)
+        return -1;
+
+    __atomic_store_n(&active_kernel, kernel, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline const struct scas_sha1_kernel_t *
+scas_sha1_kernel(void)
+{
+    const struct scas_sha1_kernel_t *kernel;
+
+    kernel = __atomic_load_n(&active_kernel, __ATOMIC_ACQUIRE);
+
+    if (kernel == NULL)
+    {
+        kernel = sha1_find_kernel(NULL);
+        __atomic_store_n(&active_kernel, kernel, __ATOMIC_RELEASE);
+    }
+
+    return kernel;
+}
+
+const char *
+scas_sha1_kernel_name(void)
+{
+    return scas_sha1_kernel()->name;
+}
+
+void
+scas_sha1_compress(struct scas_hash_t *hash, const void *blocks, size_t num_blocks)
+{
+    if (num_blocks == 0)
+        return;
+
+    scas_sha1_kernel()->compress(hash, blocks, num_blocks);
+}
+
+typedef void (*scas_sha1_mb_compress_fn_t)(uint32_t *, const unsigned char *const *);
+
+struct scas_sha1_mb_kernel_t
+{
+    const char *name;
+    size_t lanes;
+    scas_sha1_mb_compress_fn_t compress;
+    int (*is_supported)(void);
+};
+
+static const struct scas_sha1_mb_kernel_t mb_kernels[] =
+{
+#ifdef SCAS_CPU_X86
+    { "avx512", 16, sha1_mb_compress_avx512, sha1_avx512_is_supported },
+    { "avx2",    8, sha1_mb_compress_avx2,   sha1_avx2_is_supported },
+    { "sse2",    4, sha1_mb_compress_sse2,   sha1_sse2_is_supported },
+#endif
+    { "none",    1, NULL,                    sha1_generic_is_supported }
+};
+
+#define NUM_MB_KERNELS (sizeof mb_kernels / sizeof mb_kernels[0])
+
+/*
+ * Chosen on first use and published like active_kernel.
+ */
+static const struct scas_sha1_mb_kernel_t *active_mb_kernel;
+
+static const struct scas_sha1_mb_kernel_t *
+sha1_find_mb_kernel(const char *name)
+{
+    size_t i;
+    int have_shani;
+
+    /*
+     * SHA-NI hashes a single stream about as fast as eight AVX2 lanes do, so
+     * when it's available only the AVX-512 kernel is worth interleaving.
+     */
+    have_shani = strcmp(scas_sha1_kernel_name(), "shani") == 0;
+
+    for (i = 0; i < NUM_MB_KERNELS; ++i)
+    {
+        if (name != NULL && strcmp(name, mb_kernels[i].name) != 0)
+            continue;
+
+        if (name == NULL && have_shani && mb_kernels[i].compress != NULL && mb_kernels[i].lanes < 16)
+            continue;
+
+        if (!mb_kernels[i].is_supported())
+        {
+            if (name != NULL)
+                return NULL;
+
+            continue;
+        }
+
+        return &mb_kernels[i];
+    }
+
+    return NULL;
+}
+
+int
+scas_sha1_select_mb_kernel(const char *name)
+{
+    const struct scas_sha1_mb_kernel_t *kernel;
+
+    kernel = sha1_find_mb_kernel(name);
+
+    if (kernel == NULL)
+        return -1;
+
+    __atomic_store_n(&active_mb_kernel, kernel, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline const struct scas_sha1_mb_kernel_t *
+scas_sha1_mb_kernel(void)
+{
+    const struct scas_sha1_mb_kernel_t *kernel;
+
+    kernel = __atomic_load_n(&active_mb_kernel, __ATOMIC_ACQUIRE);
+
+    if (kernel == NULL)
+    {
+        kernel = sha1_find_mb_kernel(NULL);
+        __atomic_store_n(&active_mb_kernel, kernel, __ATOMIC_RELEASE);
+    }
+
+    return kernel;
+}
+
+const char *
+scas_sha1_mb_kernel_name(void)
+{
+    return scas_sha1_mb_kernel()->name;
+}
+
+static inline size_t
+sha1_job_length(const struct scas_sha1_job_t *job)
+{
+    return job->num_blocks + job->num_tail_blocks;
+}
+
+static inline const unsigned char *
+sha1_job_block(const struct scas_sha1_job_t *job, size_t block)
+{
+    if (block < job->num_blocks)
+    {
+        return job->data + block * 64;
+    }
+
+    return job->tail + (block - job->num_blocks) * 64;
+}
+
+static void
+sha1_job_finish(struct scas_sha1_job_t *job, size_t block)
+{
+    if (block < job->num_blocks)
+    {
+        scas_sha1_compress(&job->hash, job->data + block * 64, job->num_blocks - block);
+        block = job->num_blocks;
+    }
+
+    block -= job->num_blocks;
+    scas_sha1_compress(&job->hash, job->tail + block * 64, job->num_tail_blocks - block);
+}
+
+static inline void
+sha1_lane_load(uint32_t *state, size_t lanes, size_t lane, const struct scas_hash_t *hash)
+{
+    size_t i;
+
+    for (i = 0; i < 5; ++i)
+    {
+        state[i * lanes + lane] = hash->hash[i];
+    }
+}
+
+static inline void
+sha1_lane_store(const uint32_t *state, size_t lanes, size_t lane, struct scas_hash_t *hash)
+{
+    size_t i;
+
+    for (i = 0; i < 5; ++i)
+    {
+        hash->hash[i] = state[i * lanes + lane];
+    }
+}
+
+void
+scas_sha1_compress_jobs(struct scas_sha1_job_t *jobs, size_t num_jobs)
+{
+    static const unsigned char idle_block[64];
+    uint32_t state[5 * SHA1_MAX_LANES];
+    const unsigned char *blocks[SHA1_MAX_LANES];
+    struct scas_sha1_job_t *lane_job[SHA1_MAX_LANES];
+    size_t lane_block[SHA1_MAX_LANES];
+    const struct scas_sha1_mb_kernel_t *kernel;
+    size_t lanes;
+    size_t lane;
+    size_t next_job;
+    size_t active;
+
+    kernel = scas_sha1_mb_kernel();
+
+    if (kernel->compress == NULL || num_jobs < 2)
+    {
+        for (next_job = 0; next_job < num_jobs; ++next_job)
+        {
+            sha1_job_finish(&jobs[next_job], 0);
+        }
+
+        return;
+    }
+
+    lanes = kernel->lanes;
+    next_job = 0;
+    active = 0;
+
+    for (lane = 0; lane < lanes; ++lane)
+    {
+        lane_job[lane] = NULL;
+    }
+
+    for (;;)
+    {
+        /*
+         * Hand pending jobs to any lanes that went idle on the last pass.
+         */
+        for (lane = 0; lane < lanes && next_job < num_jobs; ++lane)
+        {
+            struct scas_sha1_job_t *job;
+
+            if (lane_job[lane] != NULL)
+                continue;
+
+            do
+            {
+                job = &jobs[next_job++];
+            } while (sha1_job_length(job) == 0 && next_job < num_jobs);
+
+            if (sha1_job_length(job) == 0)
+                break;
+
+            sha1_lane_load(state, lanes, lane, &job->hash);
+            lane_job[lane] = job;
+            lane_block[lane] = 0;
+            ++active;
+        }
+
+        if (active == 0)
+            break;
+
+        /*
+         * Once the queue is empty the remaining stragglers, typically the
+         * larger inputs of the batch, are better served by the single
+         * stream kernel than by a mostly idle vector.
+         */
+        if (next_job == num_jobs && active * 4 <= lanes)
+        {
+            for (lane = 0; lane < lanes; ++lane)
+            {
+                if (lane_job[lane] == NULL)
+                    continue;
+
+                sha1_lane_store(state, lanes, lane, &lane_job[lane]->hash);
+                sha1_job_finish(lane_job[lane], lane_block[lane]);
+            }
+
+            break;
+        }
+
+        for (lane = 0; lane < lanes; ++lane)
+        {
+            blocks[lane] = lane_job[lane] != NULL
+                ? sha1_job_block(lane_job[lane], lane_block[lane])
+                : idle_block;
+        }
+
+        kernel->compress(state, blocks);
+
+        for (lane = 0; lane < lanes; ++lane)
+        {
+            struct scas_sha1_job_t *job;
+
+            job = lane_job[lane];
+
+            if (job == NULL || ++lane_block[lane] < sha1_job_length(job))
+                continue;
+
+            sha1_lane_store(state, lanes, lane, &job->hash);
+            lane_job[lane] = NULL;
+            --active;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_SHA1_H
+#define SCAS_SHA1_H
+
+#include <stddef.h>
+
+#include "scas_base.h"
+
+/*
+ * Runs the SHA-1 compression function over num_blocks consecutive 64 byte
+ * blocks, updating the hash state in place. Padding is the caller's
+ * responsibility.
+ *
+ * The kernel used is picked on first use from the features reported by
+ * cpuid (SHA-NI, AVX2, SSSE3), falling back to the portable C version. All
+ * kernels produce identical results.
+ */
+void
+scas_sha1_compress(struct scas_hash_t *hash, const void *blocks, size_t num_blocks);
+
+/*
+ * Forces a particular kernel ("shani", "avx2", "ssse3" or "generic"), or
+ * restores automatic selection if name is NULL. Returns 0 on success and
+ * non-zero if the kernel is unknown or not supported by this CPU.
+ *
+ * This is for benchmarks: call it at startup, before any other thread
+ * hashes. Everything else uses the kernel chosen automatically on first
+ * use.
+ */
+int
+scas_sha1_select_kernel(const char *name);
+
+const char *
+scas_sha1_kernel_name(void);
+
+/*
+ * A single message for the multi-buffer path: num_blocks full blocks at
+ * data followed by num_tail_blocks already padded blocks at tail. hash holds
+ * the initial state on input and the result on output.
+ */
+struct scas_sha1_job_t
+{
+    const unsigned char *data;
+    size_t num_blocks;
+    const unsigned char *tail;
+    size_t num_tail_blocks;
+    struct scas_hash_t hash;
+};
+
+/*
+ * Compresses a batch of independent messages, interleaving them across the
+ * lanes of the widest multi-buffer kernel available (16 lanes for AVX-512,
+ * 8 for AVX2, 4 for SSE2). Without one, each job goes through
+ * scas_sha1_compress in turn.
+ */
+void
+scas_sha1_compress_jobs(struct scas_sha1_job_t *jobs, size_t num_jobs);
+
+/*
+ * As scas_sha1_select_kernel, for the multi-buffer kernels ("avx512",
+ * "avx2", "sse2" or "none"). The same startup-only rule applies.
+ */
+int
+scas_sha1_select_mb_kernel(const char *name);
+
+const char *
+scas_sha1_mb_kernel_name(void);
+
+#endif
@@ -0,0 +1,214 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scas_base.h"
+
+#define MAX_HASH_THREADS 64
+
+/*
+ * Salt for the root hash's initial state. Changing this changes the identity
+ * of every tree hashed object.
+ */
+#define TREE_HASH_SALT "scas tree hash v1"
+
+struct scas_tree_hash_slice_t
+{
+    const void **ptrs;
+    const size_t *sizes;
+    size_t num_leaves;
+    struct scas_hash_t *out;
+};
+
+static void *
+scas_tree_hash_worker(void *arg)
+{
+    struct scas_tree_hash_slice_t *slice;
+
+    slice = arg;
+    scas_hash_buffers(slice->ptrs, slice->sizes, slice->num_leaves, slice->out);
+
+    return NULL;
+}
+
+static size_t
+scas_tree_hash_num_threads(size_t num_leaves)
+{
+    long num_cpus;
+    size_t num_threads;
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = num_cpus > 0 ? (size_t)num_cpus : 1;
+
+    if (num_threads > MAX_HASH_THREADS)
+        num_threads = MAX_HASH_THREADS;
+
+    if (num_threads > num_leaves)
+        num_threads = num_leaves;
+
+    return num_threads;
+}
+
+struct scas_hash_t
+scas_hash_buffer_tree(const void *data, size_t length)
+{
+    struct scas_tree_hash_slice_t slices[MAX_HASH_THREADS];
+    pthread_t threads[MAX_HASH_THREADS];
+    struct scas_hash_ctx_t root;
+    const void **ptrs;
+    size_t *sizes;
+    struct scas_hash_t *leaves;
+    size_t num_leaves;
+    size_t num_threads;
+    size_t leaves_per_thread;
+    size_t i;
+    uint64_t length64;
+
+    num_leaves = (length + SCAS_TREE_HASH_LEAF_SIZE - 1) / SCAS_TREE_HASH_LEAF_SIZE;
+
+    ptrs = calloc(num_leaves + 1, sizeof(const void *));
+    sizes = calloc(num_leaves + 1, sizeof(size_t));
+    leaves = calloc(num_leaves + 1, sizeof(struct scas_hash_t));
+    VERIFY(ptrs != NULL && sizes != NULL && leaves != NULL);
+
+    for (i = 0; i < num_leaves; ++i)
+    {
+        size_t offset;
+
+        offset = i * SCAS_TREE_HASH_LEAF_SIZE;
+        ptrs[i] = (const char *)data + offset;
+        sizes[i] = (length - offset < SCAS_TREE_HASH_LEAF_SIZE) ? length - offset : SCAS_TREE_HASH_LEAF_SIZE;
+    }
+
+    /*
+     * Leaves are split into contiguous runs, one per thread. Each run goes
+     * through the multi-buffer path, so a thread keeps all of its SIMD lanes
+     * busy as well. The calling thread takes the first run itself.
+     */
+    num_threads = scas_tree_hash_num_threads(num_leaves);
+    leaves_per_thread = num_threads ? (num_leaves + num_threads - 1) / num_threads : 0;
+
+    for (i = 0; i < num_threads; ++i)
+    {
+        size_t first;
+
+        first = i * leaves_per_thread;
+        slices[i].ptrs = ptrs + first;
+        slices[i].sizes = sizes + first;
+        slices[i].out = leaves + first;
+        slices[i].num_leaves = first < num_leaves ? num_leaves - first : 0;
+
+        if (slices[i].num_leaves > leaves_per_thread)
+            slices[i].num_leaves = leaves_per_thread;
+
+        if (i > 0)
+        {
+            VERIFY(pthread_create(&threads[i], NULL, scas_tree_hash_worker, &slices[i]) == 0);
+        }
+    }
+
+    if (num_threads > 0)
+    {
+        scas_tree_hash_worker(&slices[0]);
+    }
+
+    for (i = 1; i < num_threads; ++i)
+    {
+        VERIFY(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /*
+     * root = H'(length || leaf digests), where H' is the content hash in its
+     * salted form. Only the digest bytes of each leaf are fed in.
+     */
+    scas_hash_init_salted(&root, TREE_HASH_SALT);
+
+    length64 = length;
+    scas_hash_update(&root, &length64, sizeof length64);
+
+    for (i = 0; i < num_leaves; ++i)
+    {
+        scas_hash_update(&root, leaves[i].hash, scas_hash_digest_size());
+    }
+
+    free(ptrs);
+    free(sizes);
+    free(leaves);
+
+    return scas_hash_final(&root);
+}
+
+void
+scas_tree_hash_init(struct scas_tree_hash_ctx_t *ctx, uint64_t length)
+{
+    scas_hash_init_salted(&ctx->root, TREE_HASH_SALT);
+    scas_hash_update(&ctx->root, &length, sizeof length);
+    scas_hash_init(&ctx->leaf);
+
+    ctx->remaining = length;
+    ctx->leaf_bytes = 0;
+}
+
+void
+scas_tree_hash_update(struct scas_tree_hash_ctx_t *ctx, const void *data, size_t length)
+{
+    const unsigned char *ptr;
+
+    assert(length <= ctx->remaining);
+
+    ptr = data;
+    ctx->remaining -= length;
+
+    while (length > 0)
+    {
+        size_t size;
+
+        size = SCAS_TREE_HASH_LEAF_SIZE - ctx->leaf_bytes;
+
+        if (size > length)
+            size = length;
+
+        scas_hash_update(&ctx->leaf, ptr, size);
+        ctx->leaf_bytes += size;
+        ptr += size;
+        length -= size;
+
+        if (ctx->leaf_bytes == SCAS_TREE_HASH_LEAF_SIZE)
+        {
+            struct scas_hash_t leaf;
+
+            leaf = scas_hash_final(&ctx->leaf);
+            scas_hash_update(&ctx->root, leaf.hash, scas_hash_digest_size());
+            scas_hash_init(&ctx->leaf);
+            ctx->leaf_bytes = 0;
+        }
+    }
+}
+
+struct scas_hash_t
+scas_tree_hash_final(struct scas_tree_hash_ctx_t *ctx)
+{
+    assert(ctx->remaining == 0);
+
+    /*
+     * The last leaf is shorter than the rest unless the length is a multiple
+     * of the leaf size, in which case it has already been fed in.
+     */
+    if (ctx->leaf_bytes > 0)
+    {
+        struct scas_hash_t leaf;
+
+        leaf = scas_hash_final(&ctx->leaf);
+        scas_hash_update(&ctx->root, leaf.hash, scas_hash_digest_size());
+    }
+
+    return scas_hash_final(&ctx->root);
+}
@@ -4,91 +4,313 @@
  * See LICENSE for details.
  ***********************************************************************/
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <fcntl.h>
-#include <sys/epoll.h>
-#include <sys/socket.h>
-
+#include "scas_arg_parse.h"
 #include "scas_base.h"
 #include "scas_cas.h"
 #include "scas_connection.h"
+#include "scas_epoll.h"
+#include "scas_gc.h"
 #include "scas_net.h"
+#include "scas_uring.h"
 
 static int done;
+static const char *hash_algorithm_name;
+static size_t max_mappings = SCAS_CAS_DEFAULT_MAX_MAPPINGS;
+static size_t max_mapped_bytes = SCAS_CAS_DEFAULT_MAX_MAPPED_BYTES;
+static unsigned gc_interval = SCAS_GC_DEFAULT_INTERVAL;
+static unsigned gc_rate = SCAS_GC_DEFAULT_RATE;
+static unsigned fetch_window = SCAS_CONNECTION_DEFAULT_FETCH_WINDOW;
+static uint64_t max_object_size = SCAS_CONNECTION_DEFAULT_MAX_OBJECT_SIZE;
+static unsigned num_reactors;
+static const char *io_backend_name;
+static int use_io_uring;
+
+#define MAX_NUM_REACTORS 256
+
+/*
+ * Each reactor thread has a listening socket, event loop and connection
+ * pool of its own, and handles the connections it accepts from start to
+ * finish, so a slow push only holds up the connections sharing its thread.
+ */
+struct scas_reactor_t
+{
+    pthread_t thread;
+    int socket_fd;
+};
+
+static struct scas_reactor_t reactors[MAX_NUM_REACTORS];
+
+static void
+scas_parse_arg_hash(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
 
-#define MAX_NUM_EVENTS 128
+    hash_algorithm_name = value;
+}
 
 static void
-scas_add_to_epoll_list(int epoll_fd, int fd)
+scas_parse_arg_max_mappings(void *context, const struct scas_arg_t *arg, const char *value)
 {
-    struct epoll_event event;
+    UNUSED(context);
+    UNUSED(arg);
 
-    memset(&event, 0, sizeof event);
-    fcntl(fd, F_SETFD, O_NONBLOCK);
-    event.events = EPOLLIN | EPOLLOUT;
-    event.data.fd = fd;
-    VERIFY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != -1);
+    max_mappings = (size_t)strtoull(value, NULL, 0);
 }
 
 static void
-scas_remove_from_epoll_list(int epoll_fd, int fd)
+scas_parse_arg_max_mapped_bytes(void *context, const struct scas_arg_t *arg, const char *value)
 {
-    VERIFY(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) != -1);
+    UNUSED(context);
+    UNUSED(arg);
+
+    max_mapped_bytes = (size_t)strtoull(value, NULL, 0);
+}
+
+/*
+ * The interval is in seconds; 0 turns garbage collection off.
+ */
+static void
+scas_parse_arg_gc_interval(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
+
+    gc_interval = (unsigned)strtoul(value, NULL, 0);
+}
+
+static void
+scas_parse_arg_gc_rate(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
+
+    gc_rate = (unsigned)strtoul(value, NULL, 0);
+}
+
+static void
+scas_parse_arg_fetch_window(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
+
+    fetch_window = (unsigned)strtoul(value, NULL, 0);
+}
+
+static void
+scas_parse_arg_max_object_size(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
+
+    max_object_size = (uint64_t)strtoull(value, NULL, 0);
+}
+
+/*
+ * The number of reactor threads; 0, the default, runs one per CPU.
+ */
+static void
+scas_parse_arg_threads(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
+
+    num_reactors = (unsigned)strtoul(value, NULL, 0);
+}
+
+/*
+ * Either io_uring or epoll. By default io_uring is used where the kernel
+ * supports it.
+ */
+static void
+scas_parse_arg_io_backend(void *context, const struct scas_arg_t *arg, const char *value)
+{
+    UNUSED(context);
+    UNUSED(arg);
+
+    io_backend_name = value;
+}
+
+static void
+scas_parse_args(int argc, char **argv)
+{
+    struct scas_arg_t args[] =
+    {
+        { "-H", "--hash",             ARG_TYPE_PARAMETER, scas_parse_arg_hash },
+        { "-m", "--max-mappings",     ARG_TYPE_PARAMETER, scas_parse_arg_max_mappings },
+        { "-M", "--max-mapped-bytes", ARG_TYPE_PARAMETER, scas_parse_arg_max_mapped_bytes },
+        { "-g", "--gc-interval",      ARG_TYPE_PARAMETER, scas_parse_arg_gc_interval },
+        { "-r", "--gc-rate",          ARG_TYPE_PARAMETER, scas_parse_arg_gc_rate },
+        { "-w", "--fetch-window",     ARG_TYPE_PARAMETER, scas_parse_arg_fetch_window },
+        { "-O", "--max-object-size",  ARG_TYPE_PARAMETER, scas_parse_arg_max_object_size },
+        { "-t", "--threads",          ARG_TYPE_PARAMETER, scas_parse_arg_threads },
+        { "-b", "--io-backend",       ARG_TYPE_PARAMETER, scas_parse_arg_io_backend },
+    };
+    struct scas_arg_context_t context =
+    {
+        argc,
+        argv,
+        NULL,
+        sizeof args / sizeof args[0],
+        args,
+        NULL
+    };
+
+    scas_arg_parse(&context);
+}
+
+/*
+ * Picks the hash algorithm for this run. An existing store keeps the
+ * algorithm it was created with; --hash only chooses the algorithm for a
+ * new store and is otherwise checked against the existing one.
+ */
+static int
+scas_select_hash_algorithm(void)
+{
+    enum scas_hash_algorithm_t requested;
+    enum scas_hash_algorithm_t stored;
+
+    requested = scas_hash_get_algorithm();
+
+    if (hash_algorithm_name != NULL
+        && scas_hash_algorithm_from_name(hash_algorithm_name, &requested) != 0)
+    {
+        fprintf(stderr, "Unknown hash algorithm %s.\n", hash_algorithm_name);
+        return 0;
+    }
+
+    if (scas_cas_read_hash_algorithm(&stored) == 0)
+    {
+        if (hash_algorithm_name != NULL && stored != requested)
+        {
+            fprintf(stderr, "Store uses hash algorithm %s, not %s.\n",
+                scas_hash_algorithm_name(stored), hash_algorithm_name);
+            return 0;
+        }
+
+        requested = stored;
+    }
+
+    scas_hash_set_algorithm(requested);
+
+    return 1;
+}
+
+/*
+ * Falls back to epoll, with a warning, when io_uring was asked for but the
+ * kernel doesn't support it.
+ */
+static int
+scas_select_io_backend(void)
+{
+    if (io_backend_name != NULL && strcmp(io_backend_name, "epoll") == 0)
+    {
+        return 1;
+    }
+
+    if (io_backend_name != NULL && strcmp(io_backend_name, "io_uring") != 0)
+    {
+        fprintf(stderr, "Unknown I/O backend %s.\n", io_backend_name);
+        return 0;
+    }
+
+    use_io_uring = scas_uring_is_supported();
+
+    if (!use_io_uring && io_backend_name != NULL)
+    {
+        scas_log("io_uring is not supported by this kernel, falling back to epoll.");
+    }
+
+    return 1;
+}
+
+static void *
+scas_reactor_run(void *arg)
+{
+    struct scas_reactor_t *reactor;
+
+    reactor = arg;
+
+    if (use_io_uring)
+    {
+        scas_uring_reactor_run(reactor->socket_fd, &done);
+    }
+    else
+    {
+        scas_epoll_reactor_run(reactor->socket_fd, &done);
+    }
+
+    return NULL;
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
-    int socket_fd;
-    int epoll_fd;
-    struct epoll_event event;
-    struct epoll_event events[MAX_NUM_EVENTS];
+    unsigned i;
 
-    scas_connection_initialize();
-    scas_cas_cache_initialize();
+    scas_parse_args(argc, argv);
+
+    if (!scas_select_hash_algorithm() || !scas_select_io_backend())
+    {
+        return EXIT_FAILURE;
+    }
 
-    socket_fd = scas_listen();
-    epoll_fd = epoll_create1(0);
-    VERIFY(epoll_fd >= 0);
+    if (num_reactors == 0)
+    {
+        long num_cpus;
 
-    event.events = EPOLLIN;
-    event.data.fd = socket_fd;
-    VERIFY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == 0);
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_reactors = num_cpus > 0 ? (unsigned)num_cpus : 1;
+    }
 
-    while (!done)
+    if (num_reactors > MAX_NUM_REACTORS)
     {
-        int num_ready_fds;
-        int i;
+        num_reactors = MAX_NUM_REACTORS;
+    }
 
-        num_ready_fds = epoll_wait(epoll_fd, events, MAX_NUM_EVENTS, -1);
-        VERIFY(num_ready_fds != -1);
+    /*
+     * A client that goes away is noticed by the write to it failing.
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    scas_connection_set_fetch_window(fetch_window);
+    scas_connection_set_max_object_size(max_object_size);
+    scas_cas_set_mapping_limits(max_mappings, max_mapped_bytes);
+    scas_cas_cache_initialize();
+    scas_gc_start(gc_interval, gc_rate);
 
-        for (i = 0; i < num_ready_fds; ++i)
+    /*
+     * Every socket is listening before any thread starts, so a port that
+     * can't be bound is reported up front.
+     */
+    for (i = 0; i < num_reactors; ++i)
+    {
+        reactors[i].socket_fd = scas_listen();
+
+        if (reactors[i].socket_fd < 0)
         {
-            int fd;
-
-            fd = events[i].data.fd;
-
-            if (fd == socket_fd)
-            {
-                int new_socket;
-
-                new_socket = scas_accept(fd);
-                scas_add_to_epoll_list(epoll_fd, new_socket);
-            }
-            else if (scas_handle_connection(fd))
-            {
-                scas_remove_from_epoll_list(epoll_fd, fd);
-                close(fd);
-            }
+            return EXIT_FAILURE;
         }
     }
 
-    close(socket_fd);
-    close(epoll_fd);
+    for (i = 1; i < num_reactors; ++i)
+    {
+        VERIFY(pthread_create(&reactors[i].thread, NULL, scas_reactor_run, &reactors[i]) == 0);
+    }
+
+    scas_reactor_run(&reactors[0]);
+
+    for (i = 1; i < num_reactors; ++i)
+    {
+        VERIFY(pthread_join(reactors[i].thread, NULL) == 0);
+    }
 
     return 0;
 }
-
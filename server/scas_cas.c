@@ -11,69 +11,224 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "scas_base.h"
 #include "scas_cas.h"
+#include "scas_gc.h"
+#include "scas_hash_index.h"
+#include "scas_lz4.h"
+#include "scas_pack.h"
+#include "scas_store_index.h"
 
 #define CACHE_ROOT "cache/"
-#define FILENAME_SIZE ((sizeof(struct scas_hash_t) * 2) + sizeof(CACHE_ROOT))
-#define CACHE_SIZE (size_t)0x100000000UL
+#define HASH_ALGORITHM_FILENAME CACHE_ROOT "hash_algorithm"
+#define INDEX_FILENAME CACHE_ROOT "index"
+#define JOURNAL_FILENAME CACHE_ROOT "journal"
+#define PACK_DIRECTORY CACHE_ROOT "packs"
+#define ROOTS_FILENAME CACHE_ROOT "roots"
+#define LZ4_EXTENSION ".lz4"
+/*
+ * Two hex characters per hash byte plus the separator after the first byte,
+ * and the extension of a compressed object.
+ */
+#define FILENAME_SIZE ((sizeof(struct scas_hash_t) * 2) + 1 + sizeof(CACHE_ROOT) + sizeof(LZ4_EXTENSION) - 1)
+/*
+ * Room for a '.' and a 16 digit hex counter.
+ */
+#define TEMP_FILENAME_SIZE (FILENAME_SIZE + 17)
+#define SHARD_CACHE_SIZE (size_t)0x100000000UL
+/*
+ * Compressing an object takes a buffer about its size and a copy of it in
+ * memory of its own, so objects larger than this are stored as they are,
+ * which also lets DATA_FETCH send them straight from their file.
+ */
+#define COMPRESSION_MAX_SIZE ((size_t)64 << 20)
 
-struct scas_cas_entry_t *cache;
-struct scas_cas_entry_t *cache_end;
-struct scas_cas_entry_t *cache_alloc_limit;
-struct scas_cas_entry_t *cache_limit;
-long cache_counter;
+/*
+ * The cache is split into shards, each with its own lock, entries, index and
+ * eviction clock, so connections on different threads rarely contend.
+ * Objects are assigned to shards by the third word of their hash rather than
+ * the first, because the first bytes already pick the directory, the index
+ * group and the index tag.
+ */
+#define NUM_SHARDS 64
 
-void
-scas_cas_cache_initialize(void)
+/*
+ * Each shard's entries live in one reserved region that is committed a page
+ * at a time as it fills. Entries never move once allocated, so the pointers
+ * handed out by scas_cas_read_acquire stay valid however large the cache
+ * grows.
+ *
+ * The lock is held shared to look up an entry that is already mapped and
+ * exclusively to add, map or unmap entries.
+ */
+struct scas_cas_shard_t
 {
-    scas_mkdir(CACHE_ROOT);
+    pthread_rwlock_t lock;
+    struct scas_cas_entry_t *entries;
+    struct scas_cas_entry_t *entries_end;
+    struct scas_cas_entry_t *entries_alloc_limit;
+    struct scas_cas_entry_t *entries_limit;
+    struct scas_hash_index_t index;
 
-    if (cache != NULL)
-        return;
+    /*
+     * Mapped entries, in the order the eviction clock hand visits them.
+     */
+    struct scas_cas_entry_t **mapped_entries;
+    size_t num_mapped_entries;
+    size_t mapped_entries_capacity;
+    size_t clock_hand;
+};
+
+/*
+ * A write in progress goes to a file of its own, which is renamed into place
+ * once complete and committed. Several connections may then write the same
+ * object at once. Objects small enough to be packed are written to memory
+ * instead and have no filename.
+ *
+ * The file is mapped at its full size up front but only given space as
+ * the data arrives, extent bytes of it so far, so that a client claiming
+ * a huge object can't take the space before sending any of it.
+ *
+ * Finished writes wait in a queue, in cache_entry, for the next commit.
+ */
+struct scas_cas_write_t
+{
+    struct scas_cas_entry_t entry;
+    char filename[TEMP_FILENAME_SIZE];
+    int fd;
+    size_t extent;
+    struct scas_cas_write_t *next;
+    struct scas_cas_entry_t *cache_entry;
+    uint64_t location;
+    uint32_t codec;
+};
+
+/*
+ * A loose object removed from the store, whose file is deleted by the next
+ * commit once the removal is durable.
+ */
+struct scas_cas_removal_t
+{
+    struct scas_cas_removal_t *next;
+    char filename[FILENAME_SIZE];
+};
+
+/*
+ * A directory whose subtree has been found complete, to be marked as such
+ * by the next commit, which also commits everything in the subtree. Roots
+ * of pushed snapshots wait for the next commit in the same way.
+ */
+struct scas_cas_marker_t
+{
+    struct scas_cas_marker_t *next;
+    struct scas_hash_t hash;
+};
+
+struct scas_cas_shard_t shards[NUM_SHARDS];
+long cache_counter;
+long write_counter;
+
+/*
+ * The mapping budget is shared by all shards; the counters are updated
+ * atomically.
+ */
+size_t num_mappings;
+size_t mapped_bytes;
+size_t max_mappings = SCAS_CAS_DEFAULT_MAX_MAPPINGS;
+size_t max_mapped_bytes = SCAS_CAS_DEFAULT_MAX_MAPPED_BYTES;
+
+/*
+ * The shard to try next when a shard has nothing of its own left to evict,
+ * advanced round-robin so the clocks of all shards are turned in turn.
+ */
+size_t eviction_shard;
+
+/*
+ * Writes and removals waiting to be committed. commit_lock is held for the
+ * whole of a commit, so batches are published in the order they were taken.
+ */
+struct scas_cas_write_t *pending_head;
+struct scas_cas_write_t **pending_tail = &pending_head;
+size_t pending_bytes;
+struct scas_cas_removal_t *pending_removals;
+struct scas_cas_marker_t *pending_markers;
+struct scas_cas_marker_t *pending_roots;
+pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    cache = mmap(NULL, CACHE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(cache != MAP_FAILED);
+void
+scas_cas_set_mapping_limits(size_t new_max_mappings, size_t new_max_mapped_bytes)
+{
+    max_mappings = new_max_mappings;
+    max_mapped_bytes = new_max_mapped_bytes;
+}
 
-    cache_end = cache;
-    cache_alloc_limit = cache;
-    cache_limit = (struct scas_cas_entry_t *)((char *)cache + CACHE_SIZE);
+static struct scas_cas_shard_t *
+scas_cas_shard(struct scas_hash_t hash)
+{
+    return &shards[hash.hash[2] % NUM_SHARDS];
 }
 
-static int
-scas_cas_cache_comparator(const void *ptr_a, const void *ptr_b)
+int
+scas_cas_read_hash_algorithm(enum scas_hash_algorithm_t *algorithm)
 {
-    const struct scas_cas_entry_t *a;
-    const struct scas_cas_entry_t *b;
+    FILE *fp;
+    char name[32];
+    int result;
+
+    fp = fopen(HASH_ALGORITHM_FILENAME, "r");
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    result = -1;
+
+    if (fgets(name, sizeof name, fp) != NULL)
+    {
+        name[strcspn(name, "\n")] = 0;
+        result = scas_hash_algorithm_from_name(name, algorithm);
+    }
+
+    fclose(fp);
 
-    a = ptr_a;
-    b = ptr_b;
+    if (result != 0)
+    {
+        scas_log("Unrecognized hash algorithm in %s.", HASH_ALGORITHM_FILENAME);
+    }
 
-    return memcmp(&a->hash, &b->hash, sizeof(struct scas_hash_t));
+    return result;
 }
-    
-static struct scas_cas_entry_t *
-scas_cas_cache_find(struct scas_hash_t hash)
+
+static void
+scas_cas_write_hash_algorithm(void)
 {
-    struct scas_cas_entry_t temp;
-    struct scas_cas_entry_t *entry;
+    FILE *fp;
 
-    /*
-     * TODO: Not thread-safe.
-     */
+    if (access(HASH_ALGORITHM_FILENAME, F_OK) == 0)
+    {
+        return;
+    }
 
-    temp.hash = hash;
-    entry = bsearch(&temp, cache, cache_end - cache, sizeof(struct scas_cas_entry_t), scas_cas_cache_comparator); 
+    fp = fopen(HASH_ALGORITHM_FILENAME, "w");
+    VERIFY(fp != NULL);
 
-    return entry;
+    fprintf(fp, "%s\n", scas_hash_algorithm_name(scas_hash_get_algorithm()));
+    fclose(fp);
 }
 
 static void
@@ -87,20 +242,19 @@ scas_cas_create_filename(char *filename, size_t filename_length, struct scas_has
     hash_ptr = (char *)&hash;
 
     idx = 0;
-    for (i = 0; i < sizeof hash; ++i)
+    for (i = 0; i < scas_hash_digest_size(); ++i)
     {
         unsigned char c = (unsigned char)hash_ptr[i];
         unsigned char idx0 = (c >> 4) & 0xf;
         unsigned char idx1 = c & 0xf;
 
         filename[idx++] = hex_chars[idx0];
+        filename[idx++] = hex_chars[idx1];
 
-        if (idx == 2) 
+        if (i == 0) 
         {
             filename[idx++] = '/';
         }
-
-        filename[idx++] = hex_chars[idx1];
     }
 
     filename[idx++] = 0;
@@ -108,186 +262,1007 @@ scas_cas_create_filename(char *filename, size_t filename_length, struct scas_has
     assert(idx <= filename_length);
 }
 
-static struct scas_cas_entry_t *
-scas_cas_find_destination_entry(struct scas_hash_t hash, struct scas_cas_entry_t *begin, struct scas_cas_entry_t *end)
+/*
+ * Parses num_bytes bytes of hex, returning a pointer to what follows them or
+ * NULL if they aren't hex.
+ */
+static const char *
+scas_cas_parse_hex(const char *hex, unsigned char *out, size_t num_bytes)
 {
-    ssize_t index;
-    ssize_t half;
-    int result;
+    size_t i;
 
-    if (begin == end)
+    for (i = 0; i < num_bytes * 2; ++i)
     {
-        return begin;
+        int nibble;
+        char c;
+
+        c = hex[i];
+
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else
+            return NULL;
+
+        out[i / 2] = (unsigned char)((i & 1) ? (out[i / 2] | nibble) : (nibble << 4));
     }
 
-    index = end - begin;
-    assert(index >= 0);
+    return hex + i;
+}
+
+/*
+ * Reads the header of a loose compressed object.
+ */
+static int
+scas_cas_read_object_header(const char *filename, struct scas_object_header_t *header)
+{
+    int fd;
+    ssize_t result;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    result = pread(fd, header, sizeof(struct scas_object_header_t), 0);
+    close(fd);
+
+    return result == (ssize_t)sizeof(struct scas_object_header_t) ? 0 : -1;
+}
+
+/*
+ * Walks the store and adds every object to the store index. This is the
+ * inverse of scas_cas_create_filename: the directory name is the first byte
+ * of the hash and the file name the rest, followed by the codec's extension
+ * if the object is compressed. Only needed when there is no
+ * index checkpoint yet, such as for a store created by an older server.
+ */
+static void
+scas_cas_scan_store(void)
+{
+    DIR *root;
+    struct dirent *subdir_entry;
+    size_t digest_size;
 
-    half = index / 2;
-    result = memcmp(&begin[half].hash, &hash, sizeof(struct scas_hash_t));
+    digest_size = scas_hash_digest_size();
+    root = opendir(CACHE_ROOT);
+    VERIFY(root != NULL);
 
-    if (result == 1)
+    while ((subdir_entry = readdir(root)) != NULL)
     {
-        return scas_cas_find_destination_entry(hash, begin + half, end);
+        char path[FILENAME_SIZE] = CACHE_ROOT;
+        struct scas_hash_t hash;
+        DIR *subdir;
+        struct dirent *file_entry;
+        const char *rest;
+
+        memset(&hash, 0, sizeof hash);
+
+        rest = scas_cas_parse_hex(subdir_entry->d_name, (unsigned char *)&hash, 1);
+
+        if (rest == NULL || *rest != 0)
+            continue;
+
+        strcat(path, subdir_entry->d_name);
+        subdir = opendir(path);
+
+        if (subdir == NULL)
+            continue;
+
+        while ((file_entry = readdir(subdir)) != NULL)
+        {
+            char filename[FILENAME_SIZE] = CACHE_ROOT;
+            struct stat meta;
+            struct scas_object_header_t header;
+
+            rest = scas_cas_parse_hex(file_entry->d_name, (unsigned char *)&hash + 1, digest_size - 1);
+
+            if (rest == NULL)
+                continue;
+
+            scas_cas_create_filename(filename + sizeof(CACHE_ROOT) - 1, sizeof filename - (sizeof(CACHE_ROOT) - 1), hash);
+
+            if (*rest == 0)
+            {
+                if (stat(filename, &meta) == 0)
+                    scas_store_index_add(hash, (uint64_t)meta.st_size, SCAS_STORE_LOCATION_LOOSE, SCAS_CODEC_NONE);
+            }
+            else if (strcmp(rest, LZ4_EXTENSION) == 0)
+            {
+                strcat(filename, LZ4_EXTENSION);
+
+                if (scas_cas_read_object_header(filename, &header) == 0 && header.codec == SCAS_CODEC_LZ4)
+                    scas_store_index_add(hash, header.size, SCAS_STORE_LOCATION_LOOSE, SCAS_CODEC_LZ4);
+            }
+        }
+
+        closedir(subdir);
     }
-    else if (result == 0)
+
+    closedir(root);
+}
+
+/*
+ * Drops an object a pack records as removed, unless it has been added again
+ * somewhere else since.
+ */
+static void
+scas_cas_rebuild_remove(struct scas_hash_t hash, uint64_t location)
+{
+    scas_store_index_relocate(hash, location, SCAS_STORE_LOCATION_DELETED);
+}
+
+static void *
+scas_cas_commit_thread(void *context);
+
+void
+scas_cas_cache_initialize(void)
+{
+    size_t i;
+    pthread_t commit_thread;
+
+    scas_mkdir(CACHE_ROOT);
+    scas_cas_write_hash_algorithm();
+
+    if (shards[0].entries != NULL)
+        return;
+
+    for (i = 0; i < NUM_SHARDS; ++i)
     {
-        assert(0 && "Uh, if these hashes are equal then something bad has happened.");
-        abort();
+        struct scas_cas_shard_t *shard;
+
+        shard = &shards[i];
+        VERIFY(pthread_rwlock_init(&shard->lock, NULL) == 0);
+
+        shard->entries = mmap(NULL, SHARD_CACHE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(shard->entries != MAP_FAILED);
+
+        shard->entries_end = shard->entries;
+        shard->entries_alloc_limit = shard->entries;
+        shard->entries_limit = (struct scas_cas_entry_t *)((char *)shard->entries + SHARD_CACHE_SIZE);
+
+        scas_hash_index_initialize(&shard->index, shard->entries, sizeof(struct scas_cas_entry_t));
     }
-    else
+
+    scas_pack_initialize(PACK_DIRECTORY);
+    scas_gc_initialize(ROOTS_FILENAME);
+
+    if (scas_store_index_load(INDEX_FILENAME, JOURNAL_FILENAME) != 0)
     {
-        return scas_cas_find_destination_entry(hash, begin, begin + half);
+        scas_cas_scan_store();
+        scas_pack_scan(scas_store_index_add, scas_cas_rebuild_remove);
+        scas_store_index_checkpoint();
     }
+
+    VERIFY(pthread_create(&commit_thread, NULL, scas_cas_commit_thread, NULL) == 0);
+    VERIFY(pthread_detach(commit_thread) == 0);
+}
+
+/*
+ * The functions taking a shard expect its lock to be held; lookups may hold
+ * it shared, everything else exclusively.
+ */
+static struct scas_cas_entry_t *
+scas_cas_cache_find(struct scas_cas_shard_t *shard, struct scas_hash_t hash)
+{
+    uint32_t entry_idx;
+
+    entry_idx = scas_hash_index_find(&shard->index, hash);
+
+    return entry_idx == SCAS_HASH_INDEX_NONE ? NULL : &shard->entries[entry_idx];
 }
 
 static struct scas_cas_entry_t *
-scas_cas_allocate_entry(struct scas_hash_t hash)
+scas_cas_allocate_entry(struct scas_cas_shard_t *shard, struct scas_hash_t hash)
 {
     struct scas_cas_entry_t *entry;
 
-    /*
-     * TODO: Not thread safe.
-     */
+    assert(scas_cas_cache_find(shard, hash) == NULL);
 
-    if (cache_end + 1 > cache_alloc_limit)
+    if (shard->entries_end + 1 > shard->entries_alloc_limit)
     {
         int result;
         long pagesize;
 
         pagesize = sysconf(_SC_PAGESIZE);
-        result = mprotect(cache_alloc_limit, (size_t)pagesize, PROT_READ | PROT_WRITE);
+        assert((char *)shard->entries_alloc_limit + pagesize <= (char *)shard->entries_limit);
+        result = mprotect(shard->entries_alloc_limit, (size_t)pagesize, PROT_READ | PROT_WRITE);
         assert(result == 0);
 
-        cache_alloc_limit = (struct scas_cas_entry_t *)((char *)cache_alloc_limit + pagesize);
+        shard->entries_alloc_limit = (struct scas_cas_entry_t *)((char *)shard->entries_alloc_limit + pagesize);
     }
 
-    entry = scas_cas_find_destination_entry(hash, cache, cache_end);
-
-    /*
-     * TODO: Yup, this is horrible. Make more efficient later.
-     */
-    memmove(entry, entry + 1, (cache_end - entry) * sizeof(struct scas_cas_entry_t));
-    ++cache_end;
-
-    /*
-     * TODO: This should be atomic if we need to run multiple threads.
-     */
-    entry->id = cache_counter++;
+    entry = shard->entries_end++;
+    entry->hash = hash;
+    scas_hash_index_insert(&shard->index, (uint32_t)(entry - shard->entries));
+    entry->id = __atomic_fetch_add(&cache_counter, 1, __ATOMIC_RELAXED);
 
     return entry;
 }
 
+/*
+ * Objects that haven't been committed yet aren't in the store index, but
+ * they are in the cache and pinned there, mapped. A cache entry that isn't
+ * mapped is either in the store index or has been removed.
+ *
+ * The shard lock is held throughout so that a running collection either
+ * sees the object marked live or removes it before it's looked up.
+ */
 int
 scas_cas_contains(struct scas_hash_t hash)
 {
-    char filename[FILENAME_SIZE] = CACHE_ROOT;
-    struct stat meta;
+    struct scas_cas_shard_t *shard;
+    struct scas_cas_entry_t *entry;
     int result;
 
-    scas_cas_create_filename(filename + sizeof(CACHE_ROOT), sizeof filename, hash);
-    result = stat(filename, &meta);
+    shard = scas_cas_shard(hash);
+    VERIFY(pthread_rwlock_rdlock(&shard->lock) == 0);
 
-    return result == 0;
-}
+    result = scas_store_index_contains(hash);
 
-const struct scas_cas_entry_t *
-scas_cas_read_acquire(struct scas_hash_t hash)
-{
-    struct scas_cas_entry_t *entry;
-    char filename[FILENAME_SIZE] = CACHE_ROOT;
-    int fd;
-    struct stat meta;
+    if (!result)
+    {
+        entry = scas_cas_cache_find(shard, hash);
+        result = entry != NULL && entry->mem != NULL;
+    }
 
-    entry = scas_cas_cache_find(hash);
-    if (entry != NULL)
+    if (result)
     {
-        ++entry->ref_count;
+        scas_gc_note_live(hash);
+    }
 
-        return entry;
+    VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+
+    return result;
+}
+
+/*
+ * Tracks a newly mapped entry in its shard's clock ring.
+ */
+static void
+scas_cas_track_mapping(struct scas_cas_shard_t *shard, struct scas_cas_entry_t *entry)
+{
+    if (shard->num_mapped_entries == shard->mapped_entries_capacity)
+    {
+        shard->mapped_entries_capacity = shard->mapped_entries_capacity == 0 ? 64 : shard->mapped_entries_capacity * 2;
+        shard->mapped_entries = realloc(shard->mapped_entries, shard->mapped_entries_capacity * sizeof(struct scas_cas_entry_t *));
+        VERIFY(shard->mapped_entries != NULL);
     }
 
-    scas_cas_create_filename(filename + sizeof(CACHE_ROOT), sizeof filename, hash);
-    fd = open(filename, O_RDONLY);
+    shard->mapped_entries[shard->num_mapped_entries++] = entry;
+    __atomic_fetch_add(&num_mappings, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mapped_bytes, entry->size, __ATOMIC_RELAXED);
+    entry->referenced = 1;
+}
 
-    if (fd < 0)
+/*
+ * Unmaps one entry of the shard that nobody holds, chosen with the CLOCK
+ * algorithm: the hand sweeps the ring of mapped entries, giving each
+ * recently acquired entry a second chance by clearing its referenced bit,
+ * and evicts the first unreferenced one. The entry itself stays in the
+ * cache, unmapped, and is mapped again by the next scas_cas_read_acquire.
+ * Returns 0 if every mapped entry of the shard is in use.
+ */
+static int
+scas_cas_evict_one(struct scas_cas_shard_t *shard)
+{
+    size_t i;
+
+    for (i = 0; i < 2 * shard->num_mapped_entries; ++i)
     {
-        if (errno == ENFILE)
+        struct scas_cas_entry_t *entry;
+
+        if (shard->clock_hand >= shard->num_mapped_entries)
+            shard->clock_hand = 0;
+
+        entry = shard->mapped_entries[shard->clock_hand];
+
+        /*
+         * Readers only ever take a reference with the shard lock held, which
+         * the caller holds exclusively, so a count of zero stays zero.
+         */
+        if (__atomic_load_n(&entry->ref_count, __ATOMIC_ACQUIRE) > 0)
+        {
+            ++shard->clock_hand;
+        }
+        else if (__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
         {
+            __atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+            ++shard->clock_hand;
+        }
+        else
+        {
+            VERIFY(munmap(entry->mem, entry->size) == 0);
+            entry->mem = NULL;
+            __atomic_fetch_sub(&num_mappings, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&mapped_bytes, entry->size, __ATOMIC_RELAXED);
+
             /*
-             * TODO: Evict entries from the cache and try again.
+             * The last entry takes the evicted one's place in the ring and
+             * is looked at next.
              */
-            BREAK();
-            return scas_cas_read_acquire(hash);
-        }
+            shard->mapped_entries[shard->clock_hand] = shard->mapped_entries[--shard->num_mapped_entries];
 
-        return NULL;
+            return 1;
+        }
     }
 
-    if (fstat(fd, &meta) < 0)
+    return 0;
+}
+
+/*
+ * Stops tracking an entry that is being unmapped other than by eviction.
+ */
+static void
+scas_cas_untrack_mapping(struct scas_cas_shard_t *shard, struct scas_cas_entry_t *entry)
+{
+    size_t i;
+
+    for (i = 0; i < shard->num_mapped_entries; ++i)
     {
-        return NULL;
+        if (shard->mapped_entries[i] == entry)
+        {
+            shard->mapped_entries[i] = shard->mapped_entries[--shard->num_mapped_entries];
+            __atomic_fetch_sub(&num_mappings, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&mapped_bytes, entry->size, __ATOMIC_RELAXED);
+            return;
+        }
     }
+}
 
-    /*
-     * TODO: Not thread safe.
-     */
+/*
+ * Evicts one entry from the shard, whose lock the caller holds exclusively,
+ * or failing that from another shard. Other shards are only try-locked, so
+ * two threads evicting on each other's behalf can't deadlock, and one that
+ * is busy is passed over. Returns 0 if nothing could be evicted anywhere.
+ */
+static int
+scas_cas_evict(struct scas_cas_shard_t *shard)
+{
+    size_t i;
 
-    entry = scas_cas_allocate_entry(hash);
-    entry->mem = mmap(NULL, meta.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    assert(entry->mem != MAP_FAILED);
+    if (scas_cas_evict_one(shard))
+        return 1;
 
-    entry->fd = fd;
-    entry->size = meta.st_size;
-    ++entry->ref_count;
+    for (i = 0; i < NUM_SHARDS; ++i)
+    {
+        struct scas_cas_shard_t *other;
+        int evicted;
 
-    return entry;
+        other = &shards[__atomic_fetch_add(&eviction_shard, 1, __ATOMIC_RELAXED) % NUM_SHARDS];
+
+        if (other == shard || pthread_rwlock_trywrlock(&other->lock) != 0)
+            continue;
+
+        evicted = scas_cas_evict_one(other);
+        VERIFY(pthread_rwlock_unlock(&other->lock) == 0);
+
+        if (evicted)
+            return 1;
+    }
+
+    return 0;
 }
 
-void
-scas_cas_read_release(const struct scas_cas_entry_t *entry)
+/*
+ * Evicts until a mapping of the given size fits in the budget. The budget is
+ * exceeded rather than failing if everything mapped is in use, or in shards
+ * that are busy.
+ */
+static void
+scas_cas_reserve_mapping(struct scas_cas_shard_t *shard, size_t size)
 {
-    struct scas_cas_entry_t *writable_entry;
-
-    writable_entry = (struct scas_cas_entry_t *)entry;
-    --writable_entry->ref_count;
+    while (__atomic_load_n(&num_mappings, __ATOMIC_RELAXED) >= max_mappings
+        || __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) + size > max_mapped_bytes)
+    {
+        if (!scas_cas_evict(shard))
+            break;
+    }
 }
 
-struct scas_cas_entry_t *
-scas_cas_begin_write(struct scas_hash_t hash, size_t size)
+/*
+ * Compresses an object for storage. Returns a buffer allocated with malloc
+ * holding the object header and the compressed data, with its size in
+ * stored_size, or NULL if the object is too large to compress or doesn't
+ * shrink by at least an eighth, and is better stored as it is.
+ */
+static void *
+scas_cas_compress(const void *data, size_t size, size_t *stored_size)
 {
-    static __thread struct scas_cas_entry_t entry;
-    char filename[FILENAME_SIZE] = CACHE_ROOT;
-    int fd;
-    int result;
+    struct scas_object_header_t *header;
+    size_t capacity;
+    size_t compressed_size;
 
-    assert(entry.mem == NULL);
-    assert(entry.size == 0);
-    assert(entry.fd == 0);
+    capacity = size - size / 8;
 
-    scas_cas_create_filename(filename + sizeof(CACHE_ROOT), sizeof filename, hash);
-    fd = open(filename, O_RDWR);
-    assert(fd >= 0);
+    if (size > COMPRESSION_MAX_SIZE || capacity <= sizeof(struct scas_object_header_t))
+        return NULL;
 
-    result = ftruncate(fd, size);
-    assert(result == 0);
+    header = malloc(capacity);
+    VERIFY(header != NULL);
 
-    entry.mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(entry.mem != MAP_FAILED);
+    compressed_size = scas_lz4_compress(data, size, &header[1], capacity - sizeof(struct scas_object_header_t));
 
-    entry.hash = hash;
-    entry.fd = fd;
-    entry.size = size;
+    if (compressed_size == 0)
+    {
+        free(header);
+        return NULL;
+    }
+
+    memset(header, 0, sizeof(struct scas_object_header_t));
+    header->codec = SCAS_CODEC_LZ4;
+    header->size = size;
+    *stored_size = sizeof(struct scas_object_header_t) + compressed_size;
 
-    return &entry;
+    return header;
 }
 
-void
-scas_cas_end_write(struct scas_cas_entry_t *entry)
-{
-    struct scas_cas_entry_t *cache_entry;
+/*
+ * Decompresses a stored object into an anonymous mapping, so that it is
+ * cached and evicted exactly like a mapped loose object.
+ */
+static int
+scas_cas_decompress(struct scas_cas_shard_t *shard, const void *stored, size_t stored_size, size_t size, void **mem)
+{
+    const struct scas_object_header_t *header;
+
+    header = stored;
+
+    if (stored_size < sizeof(struct scas_object_header_t)
+        || header->codec != SCAS_CODEC_LZ4
+        || header->size != size)
+    {
+        return 0;
+    }
+
+    scas_cas_reserve_mapping(shard, size);
+    *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (*mem == MAP_FAILED)
+        return 0;
+
+    if (scas_lz4_decompress(&header[1], stored_size - sizeof(struct scas_object_header_t), *mem, size) != 0)
+    {
+        scas_log("Stored object fails to decompress.");
+        munmap(*mem, size);
+        return 0;
+    }
+
+    VERIFY(mprotect(*mem, size, PROT_READ) == 0);
+
+    return 1;
+}
+
+/*
+ * Loads a compressed object, from its pack or its own file.
+ */
+static int
+scas_cas_load_compressed(struct scas_cas_shard_t *shard, const struct scas_store_record_t *record, void **mem, size_t *size)
+{
+    char filename[FILENAME_SIZE] = CACHE_ROOT;
+    void *stored;
+    int fd;
+    struct stat meta;
+    int result;
+
+    *size = (size_t)record->size;
+
+    if (record->location != SCAS_STORE_LOCATION_LOOSE)
+    {
+        return scas_cas_decompress(shard, scas_pack_resolve(record->location), scas_pack_stored_size(record->location), *size, mem);
+    }
+
+    scas_cas_create_filename(filename + sizeof(CACHE_ROOT) - 1, sizeof filename - (sizeof(CACHE_ROOT) - 1), record->hash);
+    strcat(filename, LZ4_EXTENSION);
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    if (fstat(fd, &meta) < 0 || meta.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    stored = mmap(NULL, (size_t)meta.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (stored == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    result = scas_cas_decompress(shard, stored, (size_t)meta.st_size, *size, mem);
+    munmap(stored, (size_t)meta.st_size);
+
+    return result;
+}
+
+/*
+ * Maps the object with the given hash read-only. A packed object is a slice
+ * of its pack's mapping, which is never unmapped, so it isn't tracked for
+ * eviction. Loose objects are mapped on their own, and the descriptor is
+ * closed straight away as the mapping holds its own reference to the file.
+ * Compressed objects are decompressed into memory of their own, which is
+ * evicted like a loose object's mapping.
+ *
+ * An object the store index has no record of is absent, even if its file
+ * is still there: a removed object's file is only deleted once the removal
+ * is committed. Objects not committed yet are pinned in the cache and never
+ * get here.
+ */
+static int
+scas_cas_map_object(struct scas_cas_shard_t *shard, struct scas_hash_t hash, void **mem, size_t *size, int *evictable)
+{
+    char filename[FILENAME_SIZE] = CACHE_ROOT;
+    struct scas_store_record_t record;
+    int fd;
+    struct stat meta;
+
+    if (scas_store_index_find(hash, &record) != 0)
+    {
+        return 0;
+    }
+
+    if (record.codec != SCAS_CODEC_NONE)
+    {
+        *evictable = 1;
+
+        return scas_cas_load_compressed(shard, &record, mem, size);
+    }
+
+    if (record.location != SCAS_STORE_LOCATION_LOOSE)
+    {
+        *mem = (void *)scas_pack_resolve(record.location);
+        *size = (size_t)record.size;
+        *evictable = 0;
+
+        return 1;
+    }
+
+    *evictable = 1;
+    scas_cas_create_filename(filename + sizeof(CACHE_ROOT) - 1, sizeof filename - (sizeof(CACHE_ROOT) - 1), hash);
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    if (fstat(fd, &meta) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    *size = (size_t)meta.st_size;
+    scas_cas_reserve_mapping(shard, *size);
+
+    /*
+     * Running out of address space or mappings is dealt with by evicting
+     * further.
+     */
+    do
+    {
+        *mem = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    while (*mem == MAP_FAILED && errno == ENOMEM && scas_cas_evict(shard));
+
+    close(fd);
+
+    return *mem != MAP_FAILED;
+}
+
+const struct scas_cas_entry_t *
+scas_cas_read_acquire(struct scas_hash_t hash)
+{
+    struct scas_cas_shard_t *shard;
+    struct scas_cas_entry_t *entry;
+    void *mem;
+    size_t size;
+    int evictable;
+
+    shard = scas_cas_shard(hash);
+
+    /*
+     * The common case, an entry that is already mapped, only needs the lock
+     * shared.
+     */
+    VERIFY(pthread_rwlock_rdlock(&shard->lock) == 0);
+    entry = scas_cas_cache_find(shard, hash);
+
+    if (entry != NULL && entry->mem != NULL)
+    {
+        __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&entry->ref_count, 1, __ATOMIC_ACQUIRE);
+        VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+
+        return entry;
+    }
+
+    VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+    VERIFY(pthread_rwlock_wrlock(&shard->lock) == 0);
+
+    /*
+     * Another thread may have mapped the entry while the lock was dropped.
+     */
+    entry = scas_cas_cache_find(shard, hash);
+
+    if (entry == NULL || entry->mem == NULL)
+    {
+        if (!scas_cas_map_object(shard, hash, &mem, &size, &evictable))
+        {
+            VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+            return NULL;
+        }
+
+        if (entry == NULL)
+        {
+            entry = scas_cas_allocate_entry(shard, hash);
+        }
+
+        entry->mem = mem;
+        entry->size = size;
+
+        if (evictable)
+        {
+            scas_cas_track_mapping(shard, entry);
+        }
+    }
+
+    entry->referenced = 1;
+    __atomic_fetch_add(&entry->ref_count, 1, __ATOMIC_ACQUIRE);
+    VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+
+    return entry;
+}
+
+/*
+ * The shard lock is held so that the object isn't removed between looking
+ * it up and opening it. Once open, the file stays readable even if the
+ * object is removed and the file deleted.
+ */
+int
+scas_cas_open_object(struct scas_hash_t hash, size_t *size)
+{
+    char filename[FILENAME_SIZE] = CACHE_ROOT;
+    struct scas_cas_shard_t *shard;
+    struct scas_store_record_t record;
+    int fd;
+
+    shard = scas_cas_shard(hash);
+    VERIFY(pthread_rwlock_rdlock(&shard->lock) == 0);
+
+    fd = -1;
+
+    if (scas_store_index_find(hash, &record) == 0
+        && record.location == SCAS_STORE_LOCATION_LOOSE
+        && record.codec == SCAS_CODEC_NONE)
+    {
+        scas_cas_create_filename(filename + sizeof(CACHE_ROOT) - 1, sizeof filename - (sizeof(CACHE_ROOT) - 1), hash);
+        fd = open(filename, O_RDONLY);
+        *size = (size_t)record.size;
+    }
+
+    VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+
+    return fd;
+}
+
+void
+scas_cas_read_release(const struct scas_cas_entry_t *entry)
+{
+    struct scas_cas_entry_t *writable_entry;
+
+    writable_entry = (struct scas_cas_entry_t *)entry;
+    __atomic_fetch_sub(&writable_entry->ref_count, 1, __ATOMIC_RELEASE);
+}
+
+struct scas_cas_entry_t *
+scas_cas_begin_write(struct scas_hash_t hash, size_t size)
+{
+    struct scas_cas_write_t *write;
+    int fd;
+    size_t length;
+
+    write = calloc(1, sizeof(struct scas_cas_write_t));
+    VERIFY(write != NULL);
+
+    write->entry.hash = hash;
+    write->entry.size = size;
+    write->fd = -1;
+
+    if (size <= SCAS_PACK_THRESHOLD)
+    {
+        write->entry.mem = malloc(size == 0 ? 1 : size);
+        VERIFY(write->entry.mem != NULL);
+        write->extent = size;
+
+        return &write->entry;
+    }
+
+    strcpy(write->filename, CACHE_ROOT);
+    scas_cas_create_filename(write->filename + sizeof(CACHE_ROOT) - 1, FILENAME_SIZE - (sizeof(CACHE_ROOT) - 1), hash);
+
+    /*
+     * Objects are spread over one directory per leading hash byte.
+     */
+    write->filename[sizeof(CACHE_ROOT) + 1] = 0;
+    scas_mkdir(write->filename);
+    write->filename[sizeof(CACHE_ROOT) + 1] = '/';
+
+    length = strlen(write->filename);
+    sprintf(write->filename + length, ".%lx", (unsigned long)__atomic_fetch_add(&write_counter, 1, __ATOMIC_RELAXED));
+
+    fd = open(write->filename, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+    if (fd < 0)
+    {
+        scas_log("Unable to create %s. Error code %d returned.", write->filename, errno);
+        free(write);
+        return NULL;
+    }
+
+    write->entry.mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (write->entry.mem == MAP_FAILED)
+    {
+        scas_log("Unable to map %s. Error code %d returned.", write->filename, errno);
+        close(fd);
+        unlink(write->filename);
+        free(write);
+        return NULL;
+    }
+
+    write->fd = fd;
+
+    return &write->entry;
+}
+
+size_t
+scas_cas_extend_write(struct scas_cas_entry_t *entry, size_t written)
+{
+    struct scas_cas_write_t *write;
+    size_t extent;
     int result;
 
+    write = (struct scas_cas_write_t *)entry;
+
+    if (written < write->extent || write->extent == entry->size)
+    {
+        return write->extent;
+    }
+
+    extent = entry->size - write->extent > SCAS_CAS_WRITE_EXTENT ? write->extent + SCAS_CAS_WRITE_EXTENT : entry->size;
+
+    /*
+     * Unlike ftruncate, which leaves a hole, the space is allocated here,
+     * so running out of it is an error rather than a SIGBUS on the mapping.
+     */
+    result = posix_fallocate(write->fd, (off_t)write->extent, (off_t)(extent - write->extent));
+
+    if (result != 0)
+    {
+        scas_log("Unable to grow %s to %lu bytes. Error code %d returned.", write->filename, (unsigned long)extent, result);
+        return 0;
+    }
+
+    write->extent = extent;
+
+    return extent;
+}
+
+/*
+ * Copies an object into an anonymous mapping, for compressed objects whose
+ * stored form can't be read directly.
+ */
+static void *
+scas_cas_copy_to_anonymous(const void *data, size_t size)
+{
+    void *mem;
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    VERIFY(mem != MAP_FAILED);
+
+    memcpy(mem, data, size);
+    VERIFY(mprotect(mem, size, PROT_READ) == 0);
+
+    return mem;
+}
+
+/*
+ * Makes a finished write readable by adding it to the cache, and queues it
+ * to be made durable by the next commit. Until then the entry is pinned
+ * with a reference of its own, so its memory is never evicted: the object
+ * can't be found through the store index or under its final name yet.
+ * Returns 0 without queueing anything if the object is already stored or
+ * about to be, having been written concurrently by another connection.
+ */
+static int
+scas_cas_queue_write(struct scas_cas_write_t *write, void *mem, int evictable)
+{
+    struct scas_cas_shard_t *shard;
+    struct scas_cas_entry_t *cache_entry;
+
+    shard = scas_cas_shard(write->entry.hash);
+    VERIFY(pthread_rwlock_wrlock(&shard->lock) == 0);
+
+    scas_gc_note_live(write->entry.hash);
+    cache_entry = scas_cas_cache_find(shard, write->entry.hash);
+
+    if (cache_entry != NULL && (cache_entry->mem != NULL || scas_store_index_contains(write->entry.hash)))
+    {
+        VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+        return 0;
+    }
+
+    if (evictable)
+    {
+        scas_cas_reserve_mapping(shard, write->entry.size);
+    }
+
+    /*
+     * The entry of an object that was removed is reused.
+     */
+    if (cache_entry == NULL)
+    {
+        cache_entry = scas_cas_allocate_entry(shard, write->entry.hash);
+    }
+
+    cache_entry->mem = mem;
+    cache_entry->size = write->entry.size;
+    cache_entry->ref_count = 1;
+
+    if (evictable)
+    {
+        scas_cas_track_mapping(shard, cache_entry);
+    }
+
+    VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+
+    write->cache_entry = cache_entry;
+
+    VERIFY(pthread_mutex_lock(&pending_lock) == 0);
+
+    *pending_tail = write;
+    pending_tail = &write->next;
+    pending_bytes += write->entry.size;
+
+    if (pending_bytes >= SCAS_CAS_COMMIT_BYTES)
+    {
+        VERIFY(pthread_cond_signal(&pending_cond) == 0);
+    }
+
+    VERIFY(pthread_mutex_unlock(&pending_lock) == 0);
+
+    return 1;
+}
+
+/*
+ * Appends a small object to a pack, compressed if that helps. An object
+ * stored as it is then lives in the pack's mapping, so the buffer it was
+ * written to is freed. A compressed one is copied to memory of its own,
+ * which is evicted like any other mapping once the object is committed.
+ */
+static void
+scas_cas_end_packed_write(struct scas_cas_write_t *write)
+{
+    struct scas_cas_entry_t *entry;
+    void *compressed;
+    size_t compressed_size;
+    void *mem;
+    int evictable;
+
+    entry = &write->entry;
+
+    if (scas_cas_contains(entry->hash))
+    {
+        free(entry->mem);
+        free(write);
+        return;
+    }
+
+    compressed = scas_cas_compress(entry->mem, entry->size, &compressed_size);
+
+    if (compressed != NULL)
+    {
+        write->location = scas_pack_append(entry->hash, compressed, compressed_size, SCAS_CODEC_LZ4);
+        write->codec = SCAS_CODEC_LZ4;
+        free(compressed);
+
+        mem = scas_cas_copy_to_anonymous(entry->mem, entry->size);
+        evictable = 1;
+    }
+    else
+    {
+        write->location = scas_pack_append(entry->hash, entry->mem, entry->size, SCAS_CODEC_NONE);
+        write->codec = SCAS_CODEC_NONE;
+
+        mem = (void *)scas_pack_resolve(write->location);
+        evictable = 0;
+    }
+
+    free(entry->mem);
+
+    /*
+     * A duplicate appended concurrently leaves a few unreferenced bytes in
+     * the pack.
+     */
+    if (!scas_cas_queue_write(write, mem, evictable))
+    {
+        if (evictable)
+        {
+            VERIFY(munmap(mem, entry->size) == 0);
+        }
+
+        free(write);
+    }
+}
+
+/*
+ * Replaces the contents of a loose object's temporary file with its
+ * compressed form, which is given the compressed name when it's committed.
+ * The object itself is kept in memory of its own until it's evicted, after
+ * which it is decompressed again when next read.
+ */
+static void *
+scas_cas_write_compressed(struct scas_cas_write_t *write, const void *compressed, size_t compressed_size)
+{
+    struct scas_cas_entry_t *entry;
+    const char *ptr;
+    size_t remaining;
+    void *mem;
+    int fd;
+
+    entry = &write->entry;
+    mem = scas_cas_copy_to_anonymous(entry->mem, entry->size);
+    VERIFY(munmap(entry->mem, entry->size) == 0);
+
+    fd = open(write->filename, O_WRONLY | O_TRUNC);
+    VERIFY(fd >= 0);
+
+    for (ptr = compressed, remaining = compressed_size; remaining > 0; )
+    {
+        ssize_t result;
+
+        result = pwrite(fd, ptr, remaining, (off_t)(compressed_size - remaining));
+        VERIFY(result > 0);
+
+        ptr += result;
+        remaining -= (size_t)result;
+    }
+
+    close(fd);
+
+    write->codec = SCAS_CODEC_LZ4;
+
+    return mem;
+}
+
+void
+scas_cas_end_write(struct scas_cas_entry_t *entry)
+{
+    struct scas_cas_write_t *write;
+    void *compressed;
+    size_t compressed_size;
+    void *mem;
+    int result;
+
+    write = (struct scas_cas_write_t *)entry;
+
+    if (write->filename[0] == 0)
+    {
+        scas_cas_end_packed_write(write);
+        return;
+    }
+
+    assert(write->extent == entry->size);
+    close(write->fd);
+
     /*
      * After the write has finished the memory is marked as read-only to
      * prevent any unfortunate side-effects from mangling it.
@@ -295,12 +1270,436 @@ scas_cas_end_write(struct scas_cas_entry_t *entry)
     result = mprotect(entry->mem, entry->size, PROT_READ);
     assert(result == 0);
 
-    cache_entry = scas_cas_allocate_entry(entry->hash);
-    cache_entry->hash = entry->hash;
-    cache_entry->mem = entry->mem;
-    cache_entry->fd = entry->fd;
-    cache_entry->size = entry->size;
+    write->location = SCAS_STORE_LOCATION_LOOSE;
+    write->codec = SCAS_CODEC_NONE;
+    mem = entry->mem;
+    compressed = scas_cas_compress(entry->mem, entry->size, &compressed_size);
+
+    if (compressed != NULL)
+    {
+        mem = scas_cas_write_compressed(write, compressed, compressed_size);
+        free(compressed);
+    }
 
-    memset(entry, 0, sizeof(struct scas_cas_entry_t));
+    if (!scas_cas_queue_write(write, mem, 1))
+    {
+        VERIFY(munmap(mem, entry->size) == 0);
+        unlink(write->filename);
+        free(write);
+    }
 }
 
+/*
+ * Makes a batch of finished writes durable and publishes them. Every
+ * object's data is flushed before any of them is renamed into place, the
+ * renames are flushed before any of them is added to the store index, and
+ * the journal is flushed once for the whole batch. A crash at any point
+ * leaves each object either published in full or not at all; what it
+ * leaves behind is temporary files and unreferenced pack space.
+ */
+static void
+scas_cas_commit_batch(struct scas_cas_write_t *batch, struct scas_cas_marker_t *markers)
+{
+    char directories[256];
+    char path[FILENAME_SIZE];
+    struct scas_cas_write_t *write;
+    int any_loose;
+    int fd;
+    size_t i;
+
+    memset(directories, 0, sizeof directories);
+    any_loose = 0;
+
+    for (write = batch; write != NULL; write = write->next)
+    {
+        if (write->filename[0] == 0)
+            continue;
+
+        fd = open(write->filename, O_RDONLY);
+        VERIFY(fd >= 0);
+        VERIFY(fdatasync(fd) == 0);
+        close(fd);
+    }
+
+    if (batch != NULL)
+    {
+        scas_pack_sync();
+    }
+
+    for (write = batch; write != NULL; write = write->next)
+    {
+        char filename[TEMP_FILENAME_SIZE];
+
+        if (write->filename[0] == 0)
+            continue;
+
+        /*
+         * Renaming over a copy committed by another connection after this
+         * one was queued is harmless, as both have the same contents.
+         */
+        strcpy(filename, write->filename);
+        *strrchr(filename, '.') = 0;
+
+        if (write->codec == SCAS_CODEC_LZ4)
+        {
+            strcat(filename, LZ4_EXTENSION);
+        }
+
+        VERIFY(rename(write->filename, filename) == 0);
+
+        directories[*(unsigned char *)&write->entry.hash] = 1;
+        any_loose = 1;
+    }
+
+    /*
+     * The root is flushed too, as it may have gained a directory.
+     */
+    for (i = 0; any_loose && i <= sizeof directories; ++i)
+    {
+        if (i == sizeof directories)
+            strcpy(path, CACHE_ROOT);
+        else if (directories[i])
+            sprintf(path, CACHE_ROOT "%02x", (unsigned)i);
+        else
+            continue;
+
+        fd = open(path, O_RDONLY);
+        VERIFY(fd >= 0);
+        VERIFY(fsync(fd) == 0);
+        close(fd);
+    }
+
+    for (write = batch; write != NULL; write = write->next)
+    {
+        scas_store_index_add(write->entry.hash, write->entry.size, write->location, write->codec);
+    }
+
+    while (markers != NULL)
+    {
+        struct scas_cas_marker_t *marker;
+
+        marker = markers;
+        markers = marker->next;
+
+        scas_store_index_set_flags(marker->hash, SCAS_STORE_FLAG_SUBTREE_COMPLETE);
+        free(marker);
+    }
+
+    scas_store_index_sync();
+
+    while (batch != NULL)
+    {
+        write = batch;
+        batch = write->next;
+
+        __atomic_fetch_sub(&write->cache_entry->ref_count, 1, __ATOMIC_RELEASE);
+        free(write);
+    }
+}
+
+/*
+ * Deletes the files of removed loose objects once their removal from the
+ * store index is durable. This happens before any write taken in the same
+ * batch is renamed into place, as that may be the same object written
+ * again.
+ */
+static void
+scas_cas_commit_removals(struct scas_cas_removal_t *removals)
+{
+    scas_store_index_sync();
+
+    while (removals != NULL)
+    {
+        struct scas_cas_removal_t *removal;
+
+        removal = removals;
+        removals = removal->next;
+
+        unlink(removal->filename);
+        free(removal);
+    }
+}
+
+/*
+ * Records the roots of pushed snapshots with the garbage collector, once
+ * everything written before them has been committed.
+ */
+static void
+scas_cas_commit_roots(struct scas_cas_marker_t *roots)
+{
+    struct scas_cas_marker_t *root;
+    struct scas_hash_t *hashes;
+    size_t num_roots;
+
+    for (root = roots, num_roots = 0; root != NULL; root = root->next)
+    {
+        ++num_roots;
+    }
+
+    hashes = malloc(num_roots * sizeof(struct scas_hash_t));
+    VERIFY(hashes != NULL);
+
+    for (root = roots, num_roots = 0; root != NULL; root = root->next)
+    {
+        hashes[num_roots++] = root->hash;
+    }
+
+    scas_gc_record_roots(hashes, num_roots);
+    free(hashes);
+
+    while (roots != NULL)
+    {
+        root = roots;
+        roots = root->next;
+        free(root);
+    }
+}
+
+void
+scas_cas_sync(void)
+{
+    struct scas_cas_write_t *batch;
+    struct scas_cas_removal_t *removals;
+    struct scas_cas_marker_t *markers;
+    struct scas_cas_marker_t *roots;
+
+    VERIFY(pthread_mutex_lock(&commit_lock) == 0);
+    VERIFY(pthread_mutex_lock(&pending_lock) == 0);
+
+    batch = pending_head;
+    pending_head = NULL;
+    pending_tail = &pending_head;
+    pending_bytes = 0;
+
+    removals = pending_removals;
+    pending_removals = NULL;
+
+    markers = pending_markers;
+    pending_markers = NULL;
+
+    roots = pending_roots;
+    pending_roots = NULL;
+
+    VERIFY(pthread_mutex_unlock(&pending_lock) == 0);
+
+    if (removals != NULL)
+    {
+        scas_cas_commit_removals(removals);
+    }
+
+    if (batch != NULL || markers != NULL)
+    {
+        scas_cas_commit_batch(batch, markers);
+    }
+
+    if (roots != NULL)
+    {
+        scas_cas_commit_roots(roots);
+    }
+
+    VERIFY(pthread_mutex_unlock(&commit_lock) == 0);
+}
+
+static void
+scas_cas_queue_marker(struct scas_cas_marker_t **list, struct scas_hash_t hash)
+{
+    struct scas_cas_marker_t *marker;
+
+    marker = malloc(sizeof(struct scas_cas_marker_t));
+    VERIFY(marker != NULL);
+    marker->hash = hash;
+
+    VERIFY(pthread_mutex_lock(&pending_lock) == 0);
+    marker->next = *list;
+    *list = marker;
+    VERIFY(pthread_mutex_unlock(&pending_lock) == 0);
+}
+
+void
+scas_cas_mark_subtree_complete(struct scas_hash_t hash)
+{
+    scas_cas_queue_marker(&pending_markers, hash);
+}
+
+void
+scas_cas_add_root(struct scas_hash_t hash)
+{
+    scas_cas_queue_marker(&pending_roots, hash);
+}
+
+/*
+ * While a collection runs, a subtree may lose objects between a marker being
+ * read and the push relying on it, so pushes walk every subtree instead and
+ * mark what they find as live.
+ */
+int
+scas_cas_is_subtree_complete(struct scas_hash_t hash)
+{
+    struct scas_store_record_t record;
+
+    if (scas_gc_is_collecting())
+        return 0;
+
+    return scas_store_index_find(hash, &record) == 0 && (record.flags & SCAS_STORE_FLAG_SUBTREE_COMPLETE) != 0;
+}
+
+int
+scas_cas_remove(struct scas_hash_t hash, int reachable)
+{
+    struct scas_cas_shard_t *shard;
+    struct scas_cas_entry_t *entry;
+    struct scas_store_record_t record;
+    struct scas_cas_removal_t *removal;
+
+    shard = scas_cas_shard(hash);
+    VERIFY(pthread_rwlock_wrlock(&shard->lock) == 0);
+
+    entry = scas_cas_cache_find(shard, hash);
+
+    if (scas_store_index_find(hash, &record) != 0)
+    {
+        VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+        return -1;
+    }
+
+    /*
+     * An object that is live only because a push found it, such as the
+     * directory of a push abandoned before walking it, is kept even though
+     * its children may not be.
+     */
+    if (scas_gc_is_live(hash))
+    {
+        if (!reachable)
+        {
+            scas_store_index_set_flags(hash, 0);
+        }
+
+        VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+        return -1;
+    }
+
+    /*
+     * The same goes for an object in use. Uncommitted objects are pinned,
+     * so they count as in use.
+     */
+    if (entry != NULL && __atomic_load_n(&entry->ref_count, __ATOMIC_ACQUIRE) > 0)
+    {
+        scas_store_index_set_flags(hash, 0);
+        VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+        return -1;
+    }
+
+    /*
+     * Objects stored as they are in a pack are slices of the pack's
+     * mapping; everything else was mapped on its own.
+     */
+    if (entry != NULL && entry->mem != NULL)
+    {
+        if (record.location == SCAS_STORE_LOCATION_LOOSE || record.codec != SCAS_CODEC_NONE)
+        {
+            scas_cas_untrack_mapping(shard, entry);
+            VERIFY(munmap(entry->mem, entry->size) == 0);
+        }
+
+        entry->mem = NULL;
+    }
+
+    removal = NULL;
+
+    if (record.location == SCAS_STORE_LOCATION_LOOSE)
+    {
+        removal = malloc(sizeof(struct scas_cas_removal_t));
+        VERIFY(removal != NULL);
+
+        strcpy(removal->filename, CACHE_ROOT);
+        scas_cas_create_filename(removal->filename + sizeof(CACHE_ROOT) - 1, FILENAME_SIZE - (sizeof(CACHE_ROOT) - 1), hash);
+
+        if (record.codec == SCAS_CODEC_LZ4)
+        {
+            strcat(removal->filename, LZ4_EXTENSION);
+        }
+    }
+
+    if (record.location != SCAS_STORE_LOCATION_LOOSE)
+    {
+        scas_pack_remove(hash, record.location);
+    }
+
+    scas_store_index_remove(hash);
+
+    if (removal != NULL)
+    {
+        VERIFY(pthread_mutex_lock(&pending_lock) == 0);
+        removal->next = pending_removals;
+        pending_removals = removal;
+        VERIFY(pthread_mutex_unlock(&pending_lock) == 0);
+    }
+
+    VERIFY(pthread_rwlock_unlock(&shard->lock) == 0);
+
+    return 0;
+}
+
+/*
+ * Commits whatever has been written every SCAS_CAS_COMMIT_INTERVAL_MS, or
+ * sooner once SCAS_CAS_COMMIT_BYTES are waiting. Store index checkpoints
+ * are written here too, once the journal has grown long enough, so writing
+ * one never holds up the threads adding to the index.
+ */
+static void *
+scas_cas_commit_thread(void *context)
+{
+    UNUSED(context);
+
+    for (;;)
+    {
+        struct timespec deadline;
+
+        VERIFY(clock_gettime(CLOCK_REALTIME, &deadline) == 0);
+        deadline.tv_nsec += SCAS_CAS_COMMIT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        VERIFY(pthread_mutex_lock(&pending_lock) == 0);
+
+        while (pending_bytes < SCAS_CAS_COMMIT_BYTES)
+        {
+            if (pthread_cond_timedwait(&pending_cond, &pending_lock, &deadline) != 0)
+                break;
+        }
+
+        VERIFY(pthread_mutex_unlock(&pending_lock) == 0);
+
+        scas_cas_sync();
+
+        if (scas_store_index_checkpoint_due())
+        {
+            scas_store_index_checkpoint();
+        }
+    }
+
+    return NULL;
+}
+
+void
+scas_cas_abort_write(struct scas_cas_entry_t *entry)
+{
+    struct scas_cas_write_t *write;
+    int result;
+
+    write = (struct scas_cas_write_t *)entry;
+
+    if (write->filename[0] == 0)
+    {
+        free(entry->mem);
+        free(write);
+        return;
+    }
+
+    result = munmap(entry->mem, entry->size);
+    assert(result == 0);
+
+    close(write->fd);
+    unlink(write->filename);
+    free(write);
+}
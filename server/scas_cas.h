@@ -9,32 +9,142 @@
 
 #include "scas_base.h"
 
+/*
+ * All of the functions below may be called from any number of threads at
+ * once. ref_count and referenced are only ever accessed atomically.
+ */
 struct scas_cas_entry_t
 {
     struct scas_hash_t hash;
     void *mem;
-    int fd;
     size_t size;
     long id;
     int ref_count;
+    int referenced;
 };
 
+/*
+ * Objects are mapped into memory while they're being read. Mappings that
+ * nobody holds are kept around for reuse until the cache exceeds either the
+ * number of mappings or the number of bytes mapped, at which point the least
+ * recently used ones are unmapped.
+ */
+#define SCAS_CAS_DEFAULT_MAX_MAPPINGS 16384
+#define SCAS_CAS_DEFAULT_MAX_MAPPED_BYTES ((size_t)4 << 30)
+
+void
+scas_cas_set_mapping_limits(size_t max_mappings, size_t max_mapped_bytes);
+
+/*
+ * Creates the store if it doesn't exist yet, recording the current hash
+ * algorithm as the store's.
+ */
 void
 scas_cas_cache_initialize(void);
 
+/*
+ * Reads the hash algorithm recorded in an existing store. Returns 0 on
+ * success and non-zero if there is no store yet.
+ */
+int
+scas_cas_read_hash_algorithm(enum scas_hash_algorithm_t *algorithm);
+
 const struct scas_cas_entry_t *
 scas_cas_read_acquire(struct scas_hash_t hash);
 
 void
 scas_cas_read_release(const struct scas_cas_entry_t *entry);
 
+/*
+ * Opens the file of an object that is stored loose and uncompressed, so that
+ * it can be sent straight from the page cache, and returns the descriptor,
+ * which the caller closes, along with the object's size. Returns -1 for
+ * objects stored any other way or not committed yet, which have to be read
+ * with scas_cas_read_acquire.
+ */
+int
+scas_cas_open_object(struct scas_hash_t hash, size_t *size);
+
 int
 scas_cas_contains(struct scas_hash_t hash);
 
+/*
+ * Starts writing an object of the given size, returning the entry whose
+ * memory the object is written to, or NULL if there is no room for it.
+ */
 struct scas_cas_entry_t *
 scas_cas_begin_write(struct scas_hash_t hash, size_t size);
 
+/*
+ * Large objects are given room SCAS_CAS_WRITE_EXTENT bytes at a time as
+ * they are written. Returns how much of the entry's memory can be written
+ * to, growing it first if the written bytes already fill it, or 0 if there
+ * is no room for more.
+ */
+#define SCAS_CAS_WRITE_EXTENT ((size_t)16 << 20)
+
+size_t
+scas_cas_extend_write(struct scas_cas_entry_t *entry, size_t written);
+
 void
 scas_cas_end_write(struct scas_cas_entry_t *entry);
 
+/*
+ * Finished writes are readable straight away but only become durable, and
+ * part of the store after a restart, when they are committed. Commits
+ * happen every SCAS_CAS_COMMIT_INTERVAL_MS, or sooner once
+ * SCAS_CAS_COMMIT_BYTES are waiting, and flush the whole batch at once
+ * rather than each object on its own.
+ */
+#define SCAS_CAS_COMMIT_INTERVAL_MS 100
+#define SCAS_CAS_COMMIT_BYTES ((size_t)64 << 20)
+
+/*
+ * Commits every finished write right away, returning once they are durable.
+ */
+void
+scas_cas_sync(void);
+
+/*
+ * Marks a directory record as the root of a subtree whose objects are all in
+ * the store, to be skipped by later pushes. Like a write, the mark only
+ * becomes visible, and durable, when it's committed; by then everything
+ * written before it has been committed as well.
+ */
+void
+scas_cas_mark_subtree_complete(struct scas_hash_t hash);
+
+int
+scas_cas_is_subtree_complete(struct scas_hash_t hash);
+
+/*
+ * Records the root directory of a pushed snapshot as a garbage collection
+ * root. Like a subtree mark it is written by the next commit, after
+ * everything written before it; a root that is already recorded isn't
+ * recorded again.
+ */
+void
+scas_cas_add_root(struct scas_hash_t hash);
+
+/*
+ * Removes an object from the store, unless it is in use, not yet committed
+ * or live as far as a running garbage collection is concerned. Returns 0 if
+ * the object was removed. Its file, if it has one, is deleted by the next
+ * commit; the space of a packed object is reclaimed when its pack is
+ * compacted.
+ *
+ * reachable says whether the collection's walk from the roots reached the
+ * object. One that is kept without having been reached may have lost its
+ * children, so it is no longer marked as a complete subtree.
+ */
+int
+scas_cas_remove(struct scas_hash_t hash, int reachable);
+
+/*
+ * Discards a write started with scas_cas_begin_write, for instance when the
+ * received data doesn't match its hash. Nothing is added to the CAS.
+ */
+void
+scas_cas_abort_write(struct scas_cas_entry_t *entry);
+
 #endif
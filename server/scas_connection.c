@@ -15,37 +15,68 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 
 #include "scas_base.h"
 #include "scas_cas.h"
 #include "scas_connection.h"
+#include "scas_gc.h"
+#include "scas_linear_allocator.h"
 #include "scas_meta.h"
 #include "scas_net.h"
 
 #define POOL_REALLOCATION_DELTA 16
 
+static uint32_t fetch_window = SCAS_CONNECTION_DEFAULT_FETCH_WINDOW;
+static uint64_t max_object_size = SCAS_CONNECTION_DEFAULT_MAX_OBJECT_SIZE;
+
 enum connection_state_t
 {
     NEW,
-    RECEIVING_HEADER
+    RECEIVING_HEADER,
+    PROCESSING_COMMAND
 };
 
 struct scas_connection_t
 {
     struct scas_connection_t *next;
     struct scas_connection_t *prev;
+    struct scas_connection_pool_t *pool;
     struct scas_header_t header;
     int fd;
     enum connection_state_t state;
     void *context;
+    void (*release_context)(void *context);
+    struct scas_linear_allocator_t *arena;
+    void *arena_start;
     void *ptr;
     uint64_t offset;
     uint64_t size;
 };
 
-struct scas_connection_t free_list_anchor;
-struct scas_connection_t live_list_anchor;
+/*
+ * Each reactor thread allocates its connections from a pool of its own, so
+ * threads never contend over them.
+ */
+struct scas_connection_pool_t
+{
+    struct scas_connection_t free_list_anchor;
+    struct scas_connection_io_t io;
+};
+
+/*
+ * Connections are looked up by socket fd in a two level table, so finding
+ * one costs the same however many are open. A page of the table is only
+ * allocated once an fd in its range is first used. The table is shared by
+ * every reactor thread, but each slot is only ever touched by the thread
+ * that owns the socket.
+ */
+#define CONNECTION_TABLE_PAGE_BITS 10
+#define CONNECTION_TABLE_PAGE_SIZE (1 << CONNECTION_TABLE_PAGE_BITS)
+#define CONNECTION_TABLE_NUM_PAGES 1024
+
+struct scas_connection_t **connection_table[CONNECTION_TABLE_NUM_PAGES];
 
 static void
 scas_connection_list_remove(struct scas_connection_t *connection)
@@ -84,53 +115,114 @@ scas_connection_list_is_empty(struct scas_connection_t *list)
 }
 
 static struct scas_connection_t *
-scas_connection_allocate(void)
+scas_connection_allocate(struct scas_connection_pool_t *pool)
 {
     struct scas_connection_t *connection;
 
-    if (scas_connection_list_is_empty(&free_list_anchor))
+    if (scas_connection_list_is_empty(&pool->free_list_anchor))
     {
         struct scas_connection_t *slab;
         int i;
 
         slab = calloc(POOL_REALLOCATION_DELTA, sizeof(struct scas_connection_t));
+        VERIFY(slab != NULL);
+
         for (i = 0; i < POOL_REALLOCATION_DELTA; ++i)
         {
-            scas_connection_list_add(&free_list_anchor, &slab[i]);
+            scas_connection_list_add(&pool->free_list_anchor, &slab[i]);
         }
 
-        return scas_connection_allocate();
+        return scas_connection_allocate(pool);
     }
 
-    connection = free_list_anchor.next;
+    connection = pool->free_list_anchor.next;
     scas_connection_list_remove(connection);
+    connection->pool = pool;
+
+    if (connection->arena == NULL)
+    {
+        connection->arena = scas_linear_allocator_create(DEFAULT_ALLOCATOR_SIZE);
+        connection->arena_start = scas_linear_allocator_mark(connection->arena);
+    }
 
     return connection;
 }
 
-static struct scas_connection_t *
-scas_connection_find(int fd)
+static struct scas_connection_t **
+scas_connection_table_slot(int fd)
 {
-    struct scas_connection_t *connection;
-    struct scas_connection_t *i;
+    struct scas_connection_t **page;
+    size_t page_idx;
+
+    assert(fd >= 0);
 
-    for (i = &live_list_anchor; i != NULL; i = i->next)
+    page_idx = (size_t)fd >> CONNECTION_TABLE_PAGE_BITS;
+    VERIFY(page_idx < CONNECTION_TABLE_NUM_PAGES);
+
+    page = __atomic_load_n(&connection_table[page_idx], __ATOMIC_ACQUIRE);
+
+    /*
+     * Threads may race to allocate the same page, in which case all but
+     * the first throw theirs away.
+     */
+    if (page == NULL)
     {
-        if (i->fd == fd)
+        struct scas_connection_t **expected;
+
+        page = calloc(CONNECTION_TABLE_PAGE_SIZE, sizeof(struct scas_connection_t *));
+        VERIFY(page != NULL);
+        expected = NULL;
+
+        if (!__atomic_compare_exchange_n(&connection_table[page_idx], &expected, page, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
         {
-            return i;
+            free(page);
+            page = expected;
         }
     }
 
-    connection = scas_connection_allocate();
+    return &page[fd & (CONNECTION_TABLE_PAGE_SIZE - 1)];
+}
+
+static struct scas_connection_t *
+scas_connection_find(struct scas_connection_pool_t *pool, int fd)
+{
+    struct scas_connection_t **slot;
+    struct scas_connection_t *connection;
+
+    slot = scas_connection_table_slot(fd);
+
+    if (*slot != NULL)
+    {
+        return *slot;
+    }
+
+    connection = scas_connection_allocate(pool);
     assert(connection != NULL);
 
     connection->fd = fd;
-    scas_connection_list_add(&live_list_anchor, connection);
+    *slot = connection;
 
     return connection;
 }
 
+/*
+ * Command contexts, and everything else a command keeps until it finishes,
+ * are allocated from the connection's arena, zeroed like calloc would. The
+ * arena is rewound when the connection is reset and stays with the
+ * connection when it goes back to the pool, so serving a command doesn't
+ * call malloc.
+ */
+static void *
+scas_arena_alloc(struct scas_linear_allocator_t *arena, size_t size)
+{
+    void *mem;
+
+    mem = scas_linear_allocator_alloc(arena, size);
+    memset(mem, 0, size);
+
+    return mem;
+}
+
 static void
 scas_connection_reset(struct scas_connection_t *connection)
 {
@@ -144,52 +236,102 @@ scas_connection_reset(struct scas_connection_t *connection)
 
     if (context)
     {
-        free(context);
+        if (connection->release_context != NULL)
+        {
+            connection->release_context(context);
+        }
+
         connection->context = NULL;
+        connection->release_context = NULL;
+    }
+
+    if (connection->arena != NULL)
+    {
+        scas_linear_allocator_rewind(connection->arena, connection->arena_start);
     }
 
     connection->ptr = NULL;
     connection->size = 0;
     connection->offset = 0;
+    connection->state = NEW;
 }
 
 static void
 scas_connection_free(struct scas_connection_t *connection)
 {
-    scas_connection_list_remove(connection);
+    struct scas_connection_pool_t *pool;
+    struct scas_linear_allocator_t *arena;
+    void *arena_start;
+
+    pool = connection->pool;
+    *scas_connection_table_slot(connection->fd) = NULL;
 
     scas_connection_reset(connection);
+    arena = connection->arena;
+    arena_start = connection->arena_start;
     memset(connection, 0, sizeof(struct scas_connection_t));
+    connection->arena = arena;
+    connection->arena_start = arena_start;
+
+    scas_connection_list_add(&pool->free_list_anchor, connection);
+}
 
-    scas_connection_list_add(&free_list_anchor, connection);
+void
+scas_connection_set_fetch_window(uint32_t window)
+{
+    fetch_window = window > 0 ? window : 1;
 }
 
 void
-scas_connection_initialize(void)
+scas_connection_set_max_object_size(uint64_t size)
+{
+    max_object_size = size;
+}
+
+ssize_t
+scas_connection_send_file(void *context, int fd, int file_fd, uint64_t offset, size_t size)
 {
-    free_list_anchor.next = &free_list_anchor;
-    free_list_anchor.prev = &free_list_anchor;
+    off_t file_offset;
 
-    live_list_anchor.next = &live_list_anchor;
-    live_list_anchor.prev = &live_list_anchor;
+    UNUSED(context);
+    file_offset = (off_t)offset;
+
+    return sendfile(fd, file_fd, &file_offset, size);
+}
+
+struct scas_connection_pool_t *
+scas_connection_pool_create(const struct scas_connection_io_t *io)
+{
+    struct scas_connection_pool_t *pool;
+
+    pool = calloc(1, sizeof(struct scas_connection_pool_t));
+    VERIFY(pool != NULL);
+
+    pool->free_list_anchor.next = &pool->free_list_anchor;
+    pool->free_list_anchor.prev = &pool->free_list_anchor;
+    pool->io = *io;
+
+    return pool;
 }
 
 #define SCAS_CONNECTION_DEFINE_OP(OP)                                       \
     static int                                                              \
     scas_connection_ ## OP(struct scas_connection_t *connection)            \
     {                                                                       \
+        struct scas_connection_io_t *io;                                    \
         ssize_t result;                                                     \
         char *ptr;                                                          \
         size_t offset;                                                      \
         size_t size;                                                        \
         size_t nbytes;                                                      \
                                                                             \
+        io = &connection->pool->io;                                         \
         offset = connection->offset;                                        \
         size = connection->size;                                            \
         ptr = (char *)connection->ptr + offset;                             \
         nbytes = size - offset;                                             \
                                                                             \
-        result = OP(connection->fd, ptr, nbytes);                           \
+        result = io->OP(io->context, connection->fd, ptr, nbytes);          \
                                                                             \
         if (result >= 0)                                                    \
         {                                                                   \
@@ -208,8 +350,9 @@ scas_connection_initialize(void)
         }                                                                   \
                                                                             \
         /*                                                                  \
-         * The only error codes we should see here should be EAGAIN/EWOULDBLOCK. \
-         * All else are "unexpected".                                       \
+         * The io operations report the end of the stream and failures as   \
+         * EAGAIN too, having arranged for the connection to be closed once \
+         * it returns, so this is the only error we should see here.        \
          */                                                                 \
         assert(errno == EAGAIN || errno == EWOULDBLOCK);                    \
         return 1;                                                           \
@@ -218,472 +361,1682 @@ scas_connection_initialize(void)
 SCAS_CONNECTION_DEFINE_OP(read)
 SCAS_CONNECTION_DEFINE_OP(write)
 
-struct scas_recursion_context_t
+/*
+ * Sends the first connection->size bytes of a file, carrying on from
+ * connection->offset, and returns like the operations above.
+ */
+static int
+scas_connection_write_file(struct scas_connection_t *connection, int file_fd)
 {
-    uint32_t num_entries;
-    uint32_t current_idx;
-    int visited;
-};
+    struct scas_connection_io_t *io;
+    ssize_t result;
 
-struct scas_fetch_packet_t
-{
-    struct scas_header_t header;
-    struct scas_hash_t hash;
-};
+    io = &connection->pool->io;
+    result = io->send_file(io->context, connection->fd, file_fd, connection->offset, (size_t)(connection->size - connection->offset));
 
-struct scas_snapshot_push_context_t
-{
-    struct scas_file_meta_t snapshot_meta;
-    struct scas_hash_t current_dir_record;
-    struct scas_hash_t current_file_record;
-    struct scas_header_t push_header;
-    struct scas_fetch_packet_t fetch_packet;
-    struct scas_cas_entry_t *cas_entry;
-    int have_root;
-    int depth;
-    int state;
-    struct scas_recursion_context_t stack[1024];
-};
+    if (result >= 0)
+    {
+        connection->offset += (uint64_t)result;
 
-static struct scas_hash_t
-scas_get_parent(struct scas_hash_t hash)
-{
-    const struct scas_cas_entry_t *cas_entry;
-    struct scas_directory_meta_t *meta;
+        if (connection->offset == connection->size)
+        {
+            connection->size = 0;
+            connection->offset = 0;
+            return 0;
+        }
 
-    cas_entry = scas_cas_read_acquire(hash);
-    meta = cas_entry->mem;
-    scas_cas_read_release(cas_entry);
+        return 1;
+    }
 
-    return meta->parent;
+    assert(errno == EAGAIN || errno == EWOULDBLOCK);
+    return 1;
 }
 
-static struct scas_snapshot_push_context_t *
-scas_initialize_snapshot_push_context(struct scas_connection_t *connection)
+/*
+ * An object arriving in a DATA packet, which is hashed as it arrives,
+ * while it is still hot in the cache, rather than in a second pass over
+ * the whole entry once the read completes. It is read a CAS write extent
+ * at a time, bytes_received counting the extents that have been filled.
+ */
+struct scas_object_receive_t
 {
-    struct scas_snapshot_push_context_t *context;
-
-    if (connection->context != NULL)
-    {
-        return connection->context;
-    }
-
-    context = calloc(1, sizeof(struct scas_snapshot_push_context_t));
-    context->have_root = 0;
-
-    connection->context = context;
-    connection->ptr = &context->snapshot_meta;
-    connection->size = sizeof(struct scas_snapshot_push_context_t);
-    connection->offset = 0;
-
-    return context;
-}
+    struct scas_header_t header;
+    struct scas_cas_entry_t *cas_entry;
+    struct scas_hash_ctx_t hash_ctx;
+    struct scas_tree_hash_ctx_t tree_hash_ctx;
+    uint64_t bytes_received;
+    uint64_t bytes_hashed;
+};
 
+/*
+ * Reads the header of a DATA packet carrying the given object, then
+ * allocates a new CAS entry for it of the size stated in the header.
+ * Returns 1 until the header has arrived, or -1 if it isn't a DATA packet
+ * or is for an object too large to take or store.
+ */
 static int
-scas_snapshot_push_issue_fetch(struct scas_connection_t *connection, struct scas_hash_t hash)
+scas_connection_receive_header(struct scas_connection_t *connection, struct scas_object_receive_t *receive, struct scas_hash_t record, uint32_t flags)
 {
-    struct scas_snapshot_push_context_t *context;
-
-    context = connection->context;
+    uint64_t size;
 
     if (connection->ptr == NULL)
     {
-        context->fetch_packet.header.packet_size = sizeof(struct scas_header_t) + sizeof(struct scas_hash_t);
-        context->fetch_packet.header.command = CMD_DATA_FETCH;
-        context->fetch_packet.hash = hash;
-
-        connection->ptr = &context->fetch_packet;
+        connection->ptr = &receive->header;
         connection->offset = 0;
-        connection->size = sizeof(struct scas_fetch_packet_t);
+        connection->size = sizeof(struct scas_header_t);
     }
 
-    if (scas_connection_write(connection) != 0)
+    if (scas_connection_read(connection) != 0)
     {
         return 1;
     }
 
-    connection->ptr = &context->push_header;
-    connection->offset = 0;
-    connection->size = sizeof(struct scas_header_t);
-
-    return 0;
-}
+    size = scas_header_payload_size(receive->header);
 
-static int
-scas_snapshot_push_read_header(struct scas_connection_t *connection, struct scas_hash_t record)
-{
-    struct scas_snapshot_push_context_t *context;
+    if (receive->header.command != CMD_DATA || size > max_object_size)
+    {
+        scas_log("Expected an object but received command %u of %lu bytes, dropping connection.",
+            (unsigned)receive->header.command, (unsigned long)size);
+        return -1;
+    }
 
-    context = connection->context;
+    receive->cas_entry = scas_cas_begin_write(record, (size_t)size);
 
-    if (scas_connection_read(connection) != 0)
+    if (receive->cas_entry == NULL)
     {
-        return 1;
+        scas_log("Unable to store an object of %lu bytes, dropping connection.", (unsigned long)size);
+        return -1;
     }
 
-    assert(context->push_header.command == CMD_DATA);
+    if (scas_is_tree_hashed((int)flags))
+    {
+        scas_tree_hash_init(&receive->tree_hash_ctx, size);
+    }
+    else
+    {
+        scas_hash_init(&receive->hash_ctx);
+    }
 
-    context->cas_entry = scas_cas_begin_write(record, scas_header_payload_size(context->push_header));
-    connection->ptr = context->cas_entry->mem;
-    connection->offset = 0;
-    connection->size = context->cas_entry->size;
+    receive->bytes_received = 0;
+    receive->bytes_hashed = 0;
 
     return 0;
 }
 
+/*
+ * Reads the object into its CAS entry, which is given room for it as it
+ * arrives. Returns 0 once all of it has been read, 1 while more is to
+ * come, or -1 if there is no room left for it.
+ */
 static int
-scas_snapshot_push_iterate(struct scas_connection_t *connection)
+scas_connection_receive_payload(struct scas_connection_t *connection, struct scas_object_receive_t *receive, uint32_t flags)
 {
-    /*
-     * When we enter this function we can be in one of a number of states:
-     *   1) Writing a FETCH_DATA request for a directory record
-     *   2) Writing a FETCH_DATA request for a blob
-     *   4) Reading the results of a FETCH_DATA request for a directory
-     *      record.
-     *   6) Reading the results of a FETCH_DATA request for a blob
-     */
-
-    /*
-     * Workflow:
-     * 1) Check CAS for record. 
-     *    a) If it exists, we're done, and can back up the tree.
-     *    b) If it doesn't exist, continue.
-     * 2) Fetch directory record.
-     * 3) Fetch
-     */
-
-    /* 
-     * When do we return? When we're "blocked" on a read or write.
-     */
-
-    enum scas_snapshot_push_iterate_state_t
-    {
-        INITIAL,
-        FETCHING_DIRECTORY,
-        READING_DIRECTORY_HEADER,
-        READING_DIRECTORY,
-        ITERATING_OVER_DIRECTORY,
-        FETCHING_FILE,
-        READING_FILE_HEADER,
-        READ_FILE
-    };
-
-    struct scas_snapshot_push_context_t *context;
-    enum scas_snapshot_push_iterate_state_t state;
+    unsigned char *mem;
+    size_t size;
 
-    context = connection->context;
-    state = context->state;
+    mem = receive->cas_entry->mem;
+    size = receive->cas_entry->size;
 
     for (;;)
     {
-        /*
-         * Each state block is something that can block. If the operation
-         * blocks we can exit the function and resume later. 
-         */
+        uint64_t bytes_received;
+        size_t extent_size;
+        int result;
 
-        /*
-         * The initial state happens the first time we recurse into a 
-         * directory. It checks to see if the current directory entry
-         * exists in the CAS and if it does, skips out.
-         */
-        if (state == INITIAL)
+        if (connection->ptr == NULL)
         {
-            if (scas_cas_contains(context->current_dir_record))
+            size_t extent;
+
+            if (receive->bytes_received == size)
             {
-                assert(0 && "Program erroneously made it to this state.");
-                goto up_one_level;
+                return 0;
             }
 
-            state = FETCHING_DIRECTORY;
-        }
+            extent = scas_cas_extend_write(receive->cas_entry, (size_t)receive->bytes_received);
 
-        /*
-         * In the fetch directory state we grab the directory record from
-         * the client by writing a DATA_FETCH command for the specified 
-         * hash value.
-         *
-         * This can block on writing the fetch packet to the network stream,
-         * though likely won't in practice.
-         */
-        if (state == FETCHING_DIRECTORY)
-        {
-            if (scas_snapshot_push_issue_fetch(connection, context->current_dir_record))
+            if (extent == 0)
             {
-                goto save_state_and_yield;
+                scas_log("Unable to store an object of %lu bytes, dropping connection.", (unsigned long)size);
+                return -1;
             }
 
-            state = READING_DIRECTORY_HEADER;
+            connection->ptr = mem + receive->bytes_received;
+            connection->offset = 0;
+            connection->size = extent - (size_t)receive->bytes_received;
         }
 
-        /*
-         * Read the directory entry fetch packet header. This then allocates
-         * a new CAS entry for the record we are reading plus the size of
-         * the record as stated in the fetch packet header.
-         */
-        if (state == READING_DIRECTORY_HEADER)
-        {
-            if (scas_snapshot_push_read_header(connection, context->current_dir_record))
-            {
-                goto save_state_and_yield;
-            }
+        extent_size = connection->size;
+        result = scas_connection_read(connection);
+        bytes_received = receive->bytes_received + (result == 0 ? extent_size : connection->offset);
 
-            state = READING_DIRECTORY;
+        if (scas_is_tree_hashed((int)flags))
+        {
+            scas_tree_hash_update(&receive->tree_hash_ctx, mem + receive->bytes_hashed, bytes_received - receive->bytes_hashed);
+        }
+        else
+        {
+            scas_hash_update(&receive->hash_ctx, mem + receive->bytes_hashed, bytes_received - receive->bytes_hashed);
         }
 
-        /*
-         * Read the directory header. It's possible that this would block on
-         * the read if the directory entry was big. After the directory entry
-         * is read we then prep the stack should we need to recurse into it.
-         */
-        if (state == READING_DIRECTORY)
+        receive->bytes_hashed = bytes_received;
+
+        if (result != 0)
         {
-            struct scas_cas_entry_t *cas_entry;
-            struct scas_directory_meta_t *directory_entry;
-            struct scas_recursion_context_t *stack;
+            return result;
+        }
 
-            if (scas_connection_read(connection) != 0)
-            {
-                goto save_state_and_yield;
-            }
+        receive->bytes_received = bytes_received;
+    }
+}
 
-            cas_entry = context->cas_entry;
-            directory_entry = cas_entry->mem;
+static int
+scas_connection_verify_payload(struct scas_object_receive_t *receive, struct scas_hash_t record, uint32_t flags)
+{
+    struct scas_hash_t hash;
 
-            stack = &context->stack[context->depth];
-            stack->num_entries = directory_entry->num_entries;
-            stack->current_idx = 0;
-            
-            scas_cas_end_write(cas_entry);
-            state = ITERATING_OVER_DIRECTORY;
-        }
+    /*
+     * Both kinds of hash are computed as the data arrives, so all that is
+     * left is to finish them.
+     */
+    if (scas_is_tree_hashed((int)flags))
+    {
+        hash = scas_tree_hash_final(&receive->tree_hash_ctx);
+    }
+    else
+    {
+        hash = scas_hash_final(&receive->hash_ctx);
+    }
 
-        /*
-         * Iterate over each entry in the directory, descending into 
-         * subdirectories where they exist.
-         */
-        if (state == ITERATING_OVER_DIRECTORY)
-        {
-            uint32_t num_entries;
-            uint32_t i;
-            const struct scas_cas_entry_t *directory;
-            struct scas_directory_meta_t *directory_entry;
-            struct scas_file_meta_t *meta;
-            struct scas_recursion_context_t *stack;
-            
-            stack = &context->stack[context->depth];
-            directory = scas_cas_read_acquire(context->current_dir_record);
-            directory_entry = directory->mem;
-            meta = scas_get_file_meta_base(directory_entry);
-
-            for (i = stack->current_idx, num_entries = stack->num_entries; i < num_entries; ++i)
-            {
-                if (scas_cas_contains(meta[i].content))
-                {
-                    continue;
-                }
+    if (memcmp(&hash, &record, sizeof(struct scas_hash_t)) == 0)
+    {
+        return 0;
+    }
 
-                if (scas_is_directory(meta[i].flags))
-                {
-                    context->depth++;
-                    context->current_dir_record = meta[i].content;
-                    state = INITIAL;
-                    break;
-                }
-                else
-                {
-                    context->current_file_record = meta[i].content;
-                    state = FETCHING_FILE;
-                    break;
-                }
-            }
+    scas_log("Received data does not match its hash, dropping connection.");
 
-            scas_cas_read_release(directory);
-            stack->current_idx = i;
+    return 1;
+}
 
-            if (i == num_entries)
-            {
-                goto up_one_level;
-            }
-        }
+/*
+ * A directory record or chunk list that still has something outstanding
+ * below it. A directory is only marked as a complete subtree, and a chunk
+ * list only added to the CAS, once everything below it is in, so pending
+ * counts the fetches and nodes below it that haven't finished yet, plus
+ * one while the node itself is still being walked. When it drops to zero
+ * the node is finished, which drops its parent's count in turn.
+ */
+struct scas_push_node_t
+{
+    struct scas_push_node_t *next;
+    struct scas_push_node_t *prev;
+    struct scas_push_node_t *parent;
+    struct scas_hash_t record;
+    struct scas_cas_entry_t *chunk_list_entry;
+    const struct scas_cas_entry_t *stored_chunk_list;
+    uint32_t pending;
+};
 
-        if (state == FETCHING_FILE)
-        {
-            if (scas_snapshot_push_issue_fetch(connection, context->current_file_record))
-            {
-                goto save_state_and_yield;
-            }
+struct scas_recursion_context_t
+{
+    struct scas_push_node_t *node;
+    uint32_t num_entries;
+    uint32_t current_idx;
+};
 
-            state = READING_FILE_HEADER;
-        }
+/*
+ * A DATA_FETCH that hasn't been answered yet. A file or chunk that is
+ * already being fetched isn't asked for again; the duplicate is complete
+ * once the earlier fetch's reply, which comes first, has been read.
+ */
+struct scas_push_fetch_t
+{
+    struct scas_push_node_t *parent;
+    struct scas_hash_t record;
+    uint32_t flags;
+    int duplicate;
+};
 
-        if (state == READING_FILE_HEADER)
-        {
-            if (scas_snapshot_push_read_header(connection, context->current_file_record))
-            {
-                goto save_state_and_yield;
-            }
+struct scas_fetch_packet_t
+{
+    struct scas_header_t header;
+    struct scas_hash_t hash;
+};
 
-            state = READ_FILE;
-        }
+/*
+ * The outstanding fetches are kept in a ring of fetch_window entries in the
+ * order they were issued, which is the order the client answers them in.
+ * Fetch packets that haven't been written yet are gathered in
+ * fetch_packets so a whole batch goes out in one write.
+ */
+struct scas_snapshot_push_context_t
+{
+    struct scas_linear_allocator_t *arena;
+    struct scas_snapshot_meta_t snapshot_meta;
+    struct scas_object_receive_t receive;
+    int have_root;
+    int have_gc_token;
+    unsigned gc_token;
+    int walk_stored;
+    int state;
+    struct scas_push_node_t node_list_anchor;
+    struct scas_push_node_t *free_nodes;
+    struct scas_recursion_context_t *stack;
+    uint32_t depth;
+    uint32_t stack_capacity;
+    struct scas_push_fetch_t *fetches;
+    struct scas_fetch_packet_t *fetch_packets;
+    uint32_t fetch_window;
+    uint32_t first_fetch;
+    uint32_t num_fetches;
+    uint32_t num_unsent_fetches;
+};
 
-        /*
-         * After the file read has finished we continue iterating over the
-         * directory.
-         */
-        if (state == READ_FILE)
-        {
-            struct scas_cas_entry_t *cas_entry;
+static void
+scas_snapshot_push_release_context(void *ptr)
+{
+    struct scas_snapshot_push_context_t *context;
+    struct scas_push_node_t *anchor;
 
-            if (scas_connection_read(connection) != 0)
-            {
-                goto save_state_and_yield;
-            }
+    context = ptr;
+    anchor = &context->node_list_anchor;
 
-            cas_entry = context->cas_entry;
-            scas_cas_end_write(cas_entry);
-            state = ITERATING_OVER_DIRECTORY;
-        }
+    /*
+     * A push that ends before it's complete leaves nodes behind, whose
+     * chunk lists were never added to the CAS.
+     */
+    while (anchor->next != anchor)
+    {
+        struct scas_push_node_t *node;
 
-        continue;
+        node = anchor->next;
+        anchor->next = node->next;
 
-    up_one_level:
-        context->current_dir_record = scas_get_parent(context->current_dir_record);
-        if (context->depth-- == 0)
+        if (node->chunk_list_entry != NULL)
         {
-            break;
+            scas_cas_abort_write(node->chunk_list_entry);
         }
 
-        state = ITERATING_OVER_DIRECTORY;
-        continue;
+        if (node->stored_chunk_list != NULL)
+        {
+            scas_cas_read_release(node->stored_chunk_list);
+        }
+    }
 
-    save_state_and_yield:
-        context->state = state;
-        return 0;
+    if (context->receive.cas_entry != NULL)
+    {
+        scas_cas_abort_write(context->receive.cas_entry);
     }
 
-    scas_connection_reset(connection);
-    return 0;
+    if (context->have_gc_token)
+    {
+        scas_gc_push_end(context->gc_token, NULL);
+    }
+}
+
+static struct scas_snapshot_push_context_t *
+scas_initialize_snapshot_push_context(struct scas_connection_t *connection)
+{
+    struct scas_snapshot_push_context_t *context;
+
+    if (connection->context != NULL)
+    {
+        return connection->context;
+    }
+
+    context = scas_arena_alloc(connection->arena, sizeof(struct scas_snapshot_push_context_t));
+    context->arena = connection->arena;
+    context->have_root = 0;
+    context->node_list_anchor.next = &context->node_list_anchor;
+    context->node_list_anchor.prev = &context->node_list_anchor;
+
+    context->fetch_window = fetch_window;
+    context->fetches = scas_arena_alloc(context->arena, fetch_window * sizeof(struct scas_push_fetch_t));
+    context->fetch_packets = scas_arena_alloc(context->arena, fetch_window * sizeof(struct scas_fetch_packet_t));
+
+    connection->context = context;
+    connection->release_context = scas_snapshot_push_release_context;
+    connection->ptr = &context->snapshot_meta;
+    connection->size = sizeof(struct scas_snapshot_meta_t);
+    connection->offset = 0;
+
+    return context;
+}
+
+/*
+ * Nodes come from the connection's arena, and finished ones are kept on a
+ * free list to be reused, so a push's memory follows how many nodes are
+ * outstanding at once rather than how many the snapshot has.
+ */
+static struct scas_push_node_t *
+scas_snapshot_push_create_node(struct scas_snapshot_push_context_t *context, struct scas_push_node_t *parent, struct scas_hash_t record)
+{
+    struct scas_push_node_t *node;
+    struct scas_push_node_t *anchor;
+
+    if (context->free_nodes != NULL)
+    {
+        node = context->free_nodes;
+        context->free_nodes = node->next;
+        memset(node, 0, sizeof(struct scas_push_node_t));
+    }
+    else
+    {
+        node = scas_arena_alloc(context->arena, sizeof(struct scas_push_node_t));
+    }
+
+    node->parent = parent;
+    node->record = record;
+    node->pending = 1;
+
+    anchor = &context->node_list_anchor;
+    node->next = anchor->next;
+    node->prev = anchor;
+    anchor->next->prev = node;
+    anchor->next = node;
+
+    return node;
+}
+
+/*
+ * Drops one of the node's pending counts, finishing the node and then each
+ * of its ancestors that runs out in turn.
+ */
+static void
+scas_snapshot_push_release_node(struct scas_snapshot_push_context_t *context, struct scas_push_node_t *node)
+{
+    while (node != NULL && --node->pending == 0)
+    {
+        struct scas_push_node_t *parent;
+
+        if (node->chunk_list_entry != NULL)
+        {
+            scas_cas_end_write(node->chunk_list_entry);
+        }
+        else if (node->stored_chunk_list != NULL)
+        {
+            scas_cas_read_release(node->stored_chunk_list);
+        }
+        else
+        {
+            scas_cas_mark_subtree_complete(node->record);
+        }
+
+        node->next->prev = node->prev;
+        node->prev->next = node->next;
+
+        parent = node->parent;
+        node->next = context->free_nodes;
+        context->free_nodes = node;
+        node = parent;
+    }
+}
+
+/*
+ * Puts a node on the stack of directories and chunk lists to walk. The
+ * stack grows as needed: directories that arrive while others are still
+ * being walked are stacked on top of them.
+ */
+static void
+scas_snapshot_push_enter(struct scas_snapshot_push_context_t *context, struct scas_push_node_t *node, uint32_t num_entries)
+{
+    struct scas_recursion_context_t *stack;
+
+    /*
+     * The old stack is left behind in the arena when it's outgrown, which
+     * costs no more than the stack has grown to.
+     */
+    if (context->depth == context->stack_capacity)
+    {
+        context->stack_capacity = context->stack_capacity == 0 ? 16 : context->stack_capacity * 2;
+        stack = scas_linear_allocator_alloc(context->arena, context->stack_capacity * sizeof(struct scas_recursion_context_t));
+
+        if (context->depth > 0)
+        {
+            memcpy(stack, context->stack, context->depth * sizeof(struct scas_recursion_context_t));
+        }
+
+        context->stack = stack;
+    }
+
+    stack = &context->stack[context->depth++];
+    stack->node = node;
+    stack->num_entries = num_entries;
+    stack->current_idx = 0;
+}
+
+/*
+ * Starts walking a directory record that is already in the CAS. Returns
+ * non-zero if it has gone missing in the meantime. A record that doesn't
+ * hold together, which can only have been stored before records were
+ * checked on arrival, has nothing to walk.
+ */
+static int
+scas_snapshot_push_enter_directory(struct scas_snapshot_push_context_t *context, struct scas_push_node_t *parent, struct scas_hash_t record)
+{
+    const struct scas_cas_entry_t *directory;
+    struct scas_directory_meta_t *directory_entry;
+    uint32_t num_entries;
+
+    directory = scas_cas_read_acquire(record);
+
+    if (directory == NULL)
+    {
+        return 1;
+    }
+
+    directory_entry = directory->mem;
+    num_entries = scas_directory_is_malformed(directory->mem, directory->size) ? 0 : directory_entry->num_entries;
+
+    scas_cas_read_release(directory);
+
+    if (parent != NULL)
+    {
+        ++parent->pending;
+    }
+
+    scas_snapshot_push_enter(context, scas_snapshot_push_create_node(context, parent, record), num_entries);
+
+    return 0;
+}
+
+/*
+ * Starts walking the chunks of a chunked file whose chunk list is already
+ * in the CAS, which a push only does while a collection is running; the
+ * list is held until the walk is done. A list that doesn't hold together
+ * has nothing to walk. Returns non-zero if it has gone missing in the
+ * meantime.
+ */
+static int
+scas_snapshot_push_enter_chunk_list(struct scas_snapshot_push_context_t *context, struct scas_push_node_t *parent, struct scas_hash_t record)
+{
+    const struct scas_cas_entry_t *list_entry;
+    const struct scas_chunk_list_t *list;
+    struct scas_push_node_t *node;
+
+    list_entry = scas_cas_read_acquire(record);
+
+    if (list_entry == NULL)
+    {
+        return 1;
+    }
+
+    if (scas_chunk_list_is_malformed(list_entry->mem, list_entry->size))
+    {
+        scas_cas_read_release(list_entry);
+        return 0;
+    }
+
+    list = list_entry->mem;
+    ++parent->pending;
+
+    node = scas_snapshot_push_create_node(context, parent, record);
+    node->stored_chunk_list = list_entry;
+    scas_snapshot_push_enter(context, node, list->num_chunks);
+
+    return 0;
+}
+
+static struct scas_push_fetch_t *
+scas_snapshot_push_first_fetch(struct scas_snapshot_push_context_t *context)
+{
+    assert(context->num_fetches > 0);
+
+    return &context->fetches[context->first_fetch];
+}
+
+static void
+scas_snapshot_push_retire_fetch(struct scas_snapshot_push_context_t *context)
+{
+    assert(context->num_fetches > 0);
+
+    context->first_fetch = (context->first_fetch + 1) % context->fetch_window;
+    --context->num_fetches;
+}
+
+/*
+ * Adds a fetch to the window, and its packet to the batch to be written
+ * unless the same file or chunk is already being fetched. Directories and
+ * chunk lists are always fetched again, since the earlier reply doesn't
+ * finish them.
+ */
+static void
+scas_snapshot_push_issue_fetch(struct scas_snapshot_push_context_t *context, struct scas_push_node_t *parent, struct scas_hash_t record, uint32_t flags)
+{
+    struct scas_push_fetch_t *fetch;
+    struct scas_fetch_packet_t *packet;
+    uint32_t i;
+    int duplicate;
+
+    assert(context->num_fetches < context->fetch_window);
+
+    duplicate = 0;
+
+    if (!scas_is_directory((int)flags) && !scas_is_chunked((int)flags))
+    {
+        for (i = 0; i < context->num_fetches && !duplicate; ++i)
+        {
+            fetch = &context->fetches[(context->first_fetch + i) % context->fetch_window];
+            duplicate = !fetch->duplicate && memcmp(&fetch->record, &record, sizeof(struct scas_hash_t)) == 0;
+        }
+    }
+
+    fetch = &context->fetches[(context->first_fetch + context->num_fetches) % context->fetch_window];
+    ++context->num_fetches;
+
+    fetch->parent = parent;
+    fetch->record = record;
+    fetch->flags = flags;
+    fetch->duplicate = duplicate;
+
+    if (parent != NULL)
+    {
+        ++parent->pending;
+    }
+
+    if (!duplicate)
+    {
+        packet = &context->fetch_packets[context->num_unsent_fetches++];
+        packet->header.packet_size = sizeof(struct scas_header_t) + sizeof(struct scas_hash_t);
+        packet->header.command = CMD_DATA_FETCH;
+        packet->hash = record;
+    }
+}
+
+/*
+ * Walks a directory from where it was left off, descending into the first
+ * subdirectory that is in the CAS but not known to be complete. Returns
+ * when it does, when the directory is done or when the window is full.
+ * Returns non-zero if the directory has gone from the CAS, which a push
+ * that holds it live shouldn't see.
+ *
+ * While a collection is running, finding an object only marks the object
+ * itself, so a push that started during one descends into every stored
+ * subdirectory and chunk list as well, marking what they refer to.
+ */
+static int
+scas_snapshot_push_walk_directory(struct scas_snapshot_push_context_t *context, struct scas_recursion_context_t *stack)
+{
+    const struct scas_cas_entry_t *directory;
+    struct scas_directory_meta_t *directory_entry;
+    struct scas_file_meta_t *meta;
+    struct scas_push_node_t *node;
+
+    node = stack->node;
+    directory = scas_cas_read_acquire(node->record);
+
+    if (directory == NULL)
+    {
+        return 1;
+    }
+
+    /*
+     * The entry count was checked against the record's size when the walk
+     * was entered.
+     */
+    directory_entry = directory->mem;
+    meta = scas_get_file_meta_base(directory_entry);
+
+    while (stack->current_idx < stack->num_entries && context->num_fetches < context->fetch_window)
+    {
+        struct scas_file_meta_t entry;
+
+        entry = meta[stack->current_idx++];
+
+        if (!scas_is_directory((int)entry.flags))
+        {
+            if (!scas_cas_contains(entry.content))
+            {
+                scas_snapshot_push_issue_fetch(context, node, entry.content, entry.flags);
+            }
+            else if (context->walk_stored && scas_is_chunked((int)entry.flags))
+            {
+                scas_cas_read_release(directory);
+
+                if (scas_snapshot_push_enter_chunk_list(context, node, entry.content) != 0)
+                {
+                    scas_snapshot_push_issue_fetch(context, node, entry.content, entry.flags);
+                }
+
+                return 0;
+            }
+
+            continue;
+        }
+
+        if (!context->walk_stored && scas_cas_is_subtree_complete(entry.content))
+        {
+            continue;
+        }
+
+        /*
+         * Entering the subdirectory may move the stack, so the walk stops
+         * here and picks up with the subdirectory.
+         */
+        if (scas_cas_contains(entry.content))
+        {
+            scas_cas_read_release(directory);
+
+            if (scas_snapshot_push_enter_directory(context, node, entry.content) != 0)
+            {
+                scas_snapshot_push_issue_fetch(context, node, entry.content, entry.flags);
+            }
+
+            return 0;
+        }
+
+        scas_snapshot_push_issue_fetch(context, node, entry.content, entry.flags);
+    }
+
+    scas_cas_read_release(directory);
+    return 0;
+}
+
+/*
+ * Fetches each chunk of a chunked file that the CAS doesn't have yet.
+ * Chunks shared with other files, or with an earlier version of this one,
+ * are skipped.
+ */
+static void
+scas_snapshot_push_walk_chunks(struct scas_snapshot_push_context_t *context, struct scas_recursion_context_t *stack)
+{
+    struct scas_push_node_t *node;
+    struct scas_chunk_t *chunks;
+
+    node = stack->node;
+
+    if (node->chunk_list_entry != NULL)
+        chunks = scas_get_chunk_base(node->chunk_list_entry->mem);
+    else
+        chunks = scas_get_chunk_base(node->stored_chunk_list->mem);
+
+    while (stack->current_idx < stack->num_entries && context->num_fetches < context->fetch_window)
+    {
+        struct scas_hash_t content;
+
+        content = chunks[stack->current_idx++].content;
+
+        if (!scas_cas_contains(content))
+        {
+            scas_snapshot_push_issue_fetch(context, stack->node, content, 0);
+        }
+    }
+}
+
+/*
+ * Walks whatever is on top of the stack, issuing fetches for everything the
+ * CAS doesn't have, until the fetch window is full or there is nothing left
+ * to walk. Returns non-zero if a directory being walked has gone missing.
+ */
+static int
+scas_snapshot_push_walk(struct scas_snapshot_push_context_t *context)
+{
+    while (context->depth > 0 && context->num_fetches < context->fetch_window)
+    {
+        struct scas_recursion_context_t *stack;
+        struct scas_push_node_t *node;
+
+        stack = &context->stack[context->depth - 1];
+        node = stack->node;
+
+        if (stack->current_idx == stack->num_entries)
+        {
+            --context->depth;
+            scas_snapshot_push_release_node(context, node);
+        }
+        else if (node->chunk_list_entry != NULL || node->stored_chunk_list != NULL)
+        {
+            scas_snapshot_push_walk_chunks(context, stack);
+        }
+        else if (scas_snapshot_push_walk_directory(context, stack) != 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Takes in an object that has been read and verified. Directory records and
+ * chunk lists become nodes to walk; the fetch's hold on its parent passes
+ * to them. Returns non-zero if the object is malformed.
+ */
+static int
+scas_snapshot_push_receive(struct scas_snapshot_push_context_t *context, const struct scas_push_fetch_t *fetch)
+{
+    struct scas_cas_entry_t *cas_entry;
+    struct scas_push_node_t *node;
+
+    cas_entry = context->receive.cas_entry;
+    context->receive.cas_entry = NULL;
+
+    if (scas_is_directory((int)fetch->flags))
+    {
+        struct scas_directory_meta_t *directory_entry;
+        uint32_t num_entries;
+
+        if (scas_directory_is_malformed(cas_entry->mem, cas_entry->size))
+        {
+            scas_log("Received a malformed directory record, dropping connection.");
+            scas_cas_abort_write(cas_entry);
+            return 1;
+        }
+
+        directory_entry = cas_entry->mem;
+        num_entries = directory_entry->num_entries;
+        scas_cas_end_write(cas_entry);
+
+        node = scas_snapshot_push_create_node(context, fetch->parent, fetch->record);
+        scas_snapshot_push_enter(context, node, num_entries);
+    }
+    else if (scas_is_chunked((int)fetch->flags))
+    {
+        struct scas_chunk_list_t *list;
+
+        /*
+         * What was read for a chunked file is its chunk list. The list is
+         * only added to the CAS once every chunk it names is there, so
+         * finding the file's content in the CAS still means the whole file
+         * is present.
+         */
+        if (scas_chunk_list_is_malformed(cas_entry->mem, cas_entry->size))
+        {
+            scas_log("Received a malformed chunk list, dropping connection.");
+            scas_cas_abort_write(cas_entry);
+            return 1;
+        }
+
+        list = cas_entry->mem;
+        node = scas_snapshot_push_create_node(context, fetch->parent, fetch->record);
+        node->chunk_list_entry = cas_entry;
+        scas_snapshot_push_enter(context, node, list->num_chunks);
+    }
+    else
+    {
+        scas_cas_end_write(cas_entry);
+        scas_snapshot_push_release_node(context, fetch->parent);
+    }
+
+    return 0;
+}
+
+static int
+scas_snapshot_push_iterate(struct scas_connection_t *connection)
+{
+    /*
+     * When we enter this function we can be in one of a number of states:
+     *   1) Walking the tree for objects to fetch
+     *   2) Writing a batch of DATA_FETCH requests
+     *   3) Reading the header of the reply to the oldest outstanding
+     *      DATA_FETCH
+     *   4) Reading the payload of that reply
+     */
+
+    /*
+     * Workflow:
+     * 1) Walk the directories and chunk lists that are in the CAS, noting
+     *    every object the CAS doesn't have, until the fetch window is
+     *    full.
+     *    a) A directory whose subtree is complete is skipped.
+     *    b) A directory that exists but whose subtree isn't complete, left
+     *       by a push that was cut short, is walked without being fetched
+     *       again.
+     * 2) Send the fetches for those objects in one batch.
+     * 3) Read the replies in order. Directories and chunk lists that arrive
+     *    are walked in turn, while the fetches issued before them are
+     *    still being answered.
+     * 4) Once less than half of the window is outstanding, go back to 1.
+     */
+
+    /*
+     * When do we return? When we're "blocked" on a read or write.
+     */
+
+    enum scas_snapshot_push_iterate_state_t
+    {
+        WALKING,
+        SENDING_FETCHES,
+        READING_HEADER,
+        READING_PAYLOAD
+    };
+
+    struct scas_snapshot_push_context_t *context;
+    enum scas_snapshot_push_iterate_state_t state;
+    int result;
+
+    context = connection->context;
+    state = context->state;
+
+    for (;;)
+    {
+        struct scas_push_fetch_t *fetch;
+
+        /*
+         * The window is refilled once half of it has been answered, so
+         * that fetches are written in batches rather than one per reply.
+         * The push is done once nothing is left to walk or outstanding.
+         */
+        if (state == WALKING)
+        {
+            if (context->num_fetches <= context->fetch_window / 2 && scas_snapshot_push_walk(context) != 0)
+            {
+                scas_log("A directory went missing during a snapshot push, dropping connection.");
+                goto abort_push;
+            }
+
+            if (context->num_unsent_fetches > 0)
+            {
+                connection->ptr = context->fetch_packets;
+                connection->offset = 0;
+                connection->size = context->num_unsent_fetches * sizeof(struct scas_fetch_packet_t);
+                state = SENDING_FETCHES;
+            }
+            else if (context->num_fetches > 0)
+            {
+                state = READING_HEADER;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        /*
+         * This can block on writing the fetch packets to the network
+         * stream, though the window is small enough that it likely won't
+         * in practice.
+         */
+        if (state == SENDING_FETCHES)
+        {
+            if (scas_connection_write(connection) != 0)
+            {
+                goto save_state_and_yield;
+            }
+
+            context->num_unsent_fetches = 0;
+            state = READING_HEADER;
+        }
+
+        /*
+         * Read the reply's header, then allocate a new CAS entry for the
+         * object plus the size of the object as stated in the header. A
+         * duplicate fetch has no reply of its own.
+         */
+        if (state == READING_HEADER)
+        {
+            fetch = scas_snapshot_push_first_fetch(context);
+
+            if (fetch->duplicate)
+            {
+                scas_snapshot_push_release_node(context, fetch->parent);
+                scas_snapshot_push_retire_fetch(context);
+                state = WALKING;
+                continue;
+            }
+
+            result = scas_connection_receive_header(connection, &context->receive, fetch->record, fetch->flags);
+
+            if (result < 0)
+            {
+                goto abort_push;
+            }
+
+            if (result != 0)
+            {
+                goto save_state_and_yield;
+            }
+
+            state = READING_PAYLOAD;
+        }
+
+        if (state == READING_PAYLOAD)
+        {
+            fetch = scas_snapshot_push_first_fetch(context);
+
+            result = scas_connection_receive_payload(connection, &context->receive, fetch->flags);
+
+            if (result < 0)
+            {
+                goto abort_push;
+            }
+
+            if (result != 0)
+            {
+                goto save_state_and_yield;
+            }
+
+            if (scas_connection_verify_payload(&context->receive, fetch->record, fetch->flags) != 0
+                || scas_snapshot_push_receive(context, fetch) != 0)
+            {
+                goto abort_push;
+            }
+
+            scas_snapshot_push_retire_fetch(context);
+            state = WALKING;
+        }
+
+        continue;
+
+    save_state_and_yield:
+        context->state = state;
+        return 0;
+
+    /*
+     * Freeing the context abandons everything still outstanding.
+     */
+    abort_push:
+        scas_connection_free(connection);
+        return 1;
+    }
+
+    context->have_gc_token = 0;
+    scas_gc_push_end(context->gc_token, &context->snapshot_meta.root.content);
+    scas_connection_reset(connection);
+    return 0;
+}
+
+int
+scas_connection_handle_snapshot_push(struct scas_connection_t *connection)
+{
+    struct scas_snapshot_push_context_t *context;
+
+    /*
+     * The arrays meta/name_blob_indices/name_blob all have nentries
+     * entries in them. The name_blob field consists of all the names
+     * for files in the directory, null terminated, jammed together.
+     * The indices for the start of each name are stored in
+     * name_blob_indices, meaning that to index the seventh name in
+     * the directory entry, you would use the expression
+     * name_blog[name_blob_indices[6]].
+     *
+     * The client only sends the root node of the snapshot. The server
+     * will iterate over the contained files in the root node and its
+     * descendents to verify the contents. For content it does not
+     * have, the server will issue DATA_FETCH commands to the client.
+     * Up to the fetch window's worth of them are outstanding at once,
+     * and the client answers them in the order they were issued.
+     *
+     * In the case of the meta blob pushed as a part of the SNAPSHOT_PUSH
+     * handshake, the root's content field points to the root entry hash.
+     * A snapshot hashed with a different algorithm than the store's can't
+     * be verified, so the connection is dropped.
+     *
+     *                      SNAPSHOT_PUSH ->
+     *   struct scas_snapshot_meta_t meta ->
+     *                                    <- DATA_FETCH
+     *                                    <- struct scas_hash_t hash
+     *                                    <- DATA_FETCH ...
+     *                                    <- struct scas_hash_t hash
+     *                               data ->
+     *                               data ->
+     *                                   ....
+     */
+
+    if (connection->context == NULL
+        && scas_header_payload_size(connection->header) != sizeof(struct scas_snapshot_meta_t))
+    {
+        scas_log("Malformed SNAPSHOT_PUSH, dropping connection.");
+        scas_connection_free(connection);
+        return 1;
+    }
+
+    context = scas_initialize_snapshot_push_context(connection);
+
+    if (!context->have_root)
+    {
+        if (scas_connection_read(connection) != 0)
+            return 0;
+
+        if (context->snapshot_meta.hash_algorithm != (uint32_t)scas_hash_get_algorithm())
+        {
+            scas_log("Snapshot was hashed with %s but the store uses %s, dropping connection.",
+                scas_hash_algorithm_name(context->snapshot_meta.hash_algorithm),
+                scas_hash_algorithm_name(scas_hash_get_algorithm()));
+            scas_connection_free(connection);
+            return 1;
+        }
+
+        context->have_root = 1;
+
+        /*
+         * The push is registered with the garbage collector before anything
+         * is looked up in the CAS, and the snapshot becomes a root once it
+         * has been pushed.
+         */
+        context->gc_token = scas_gc_push_begin();
+        context->have_gc_token = 1;
+        context->walk_stored = scas_gc_is_collecting();
+
+        /*
+         * A snapshot that has been pushed in full before has nothing left to
+         * fetch.
+         */
+        if (!context->walk_stored && scas_cas_is_subtree_complete(context->snapshot_meta.root.content))
+        {
+            context->have_gc_token = 0;
+            scas_gc_push_end(context->gc_token, &context->snapshot_meta.root.content);
+            scas_connection_reset(connection);
+            return 0;
+        }
+
+        if (!scas_cas_contains(context->snapshot_meta.root.content)
+            || scas_snapshot_push_enter_directory(context, NULL, context->snapshot_meta.root.content) != 0)
+        {
+            scas_snapshot_push_issue_fetch(context, NULL, context->snapshot_meta.root.content, flag_is_directory);
+        }
+    }
+
+    return scas_snapshot_push_iterate(connection);
+}
+
+/*
+ * An object stored in a file of its own is sent straight from the page
+ * cache with sendfile, so that serving a large object never copies it
+ * through the server. Anything else is sent from its mapping. The socket
+ * is corked while the reply is written, so the header goes out in the
+ * same segment as the start of the payload rather than on its own.
+ */
+struct scas_data_fetch_context_t
+{
+    int state;
+    struct scas_hash_t hash;
+    struct scas_header_t reply_header;
+    const struct scas_cas_entry_t *cas_entry;
+    int file_fd;
+    uint64_t size;
+};
+
+static void
+scas_data_fetch_release_context(void *ptr)
+{
+    struct scas_data_fetch_context_t *context;
+
+    context = ptr;
+
+    if (context->file_fd >= 0)
+    {
+        close(context->file_fd);
+    }
+
+    if (context->cas_entry != NULL)
+    {
+        scas_cas_read_release(context->cas_entry);
+    }
+}
+
+static struct scas_data_fetch_context_t *
+scas_initialize_data_fetch_context(struct scas_connection_t *connection)
+{
+    struct scas_data_fetch_context_t *context;
+
+    if (connection->context != NULL)
+    {
+        return connection->context;
+    }
+
+    context = scas_arena_alloc(connection->arena, sizeof(struct scas_data_fetch_context_t));
+    context->file_fd = -1;
+
+    connection->context = context;
+    connection->release_context = scas_data_fetch_release_context;
+    connection->ptr = &context->hash;
+    connection->offset = 0;
+    connection->size = sizeof(struct scas_hash_t);
+
+    return context;
+}
+
+/*
+ * Finds the object to send, by file if it has one. Returns non-zero if the
+ * store doesn't have it.
+ */
+static int
+scas_data_fetch_open(struct scas_data_fetch_context_t *context)
+{
+    size_t size;
+
+    context->file_fd = scas_cas_open_object(context->hash, &size);
+
+    if (context->file_fd < 0)
+    {
+        context->cas_entry = scas_cas_read_acquire(context->hash);
+
+        if (context->cas_entry == NULL)
+        {
+            return 1;
+        }
+
+        size = context->cas_entry->size;
+    }
+
+    context->size = size;
+
+    return 0;
+}
+
+static int
+scas_connection_handle_data_fetch(struct scas_connection_t *connection)
+{
+    enum scas_data_fetch_state_t
+    {
+        READING_HASH,
+        SENDING_HEADER,
+        SENDING_PAYLOAD
+    };
+
+    struct scas_data_fetch_context_t *context;
+
+    /*
+     * struct scas_hash_t
+     * {
+     *     uint32_t hash[8];
+     * };
+     *
+     *              DATA_FETCH ->
+     * struct scas_hash_t hash ->
+     *                         <- DATA
+     *                         <- data
+     */
+
+    if (connection->context == NULL
+        && scas_header_payload_size(connection->header) != sizeof(struct scas_hash_t))
+    {
+        scas_log("Malformed DATA_FETCH, dropping connection.");
+        scas_connection_free(connection);
+        return 1;
+    }
+
+    context = scas_initialize_data_fetch_context(connection);
+
+    if (context->state == READING_HASH)
+    {
+        if (scas_connection_read(connection) != 0)
+        {
+            return 0;
+        }
+
+        if (scas_data_fetch_open(context) != 0)
+        {
+            scas_log("Client fetched an object that isn't in the store, dropping connection.");
+            scas_connection_free(connection);
+            return 1;
+        }
+
+        context->reply_header.packet_size = context->size + sizeof(struct scas_header_t);
+        context->reply_header.command = CMD_DATA;
+
+        scas_set_cork(connection->fd, 1);
+        connection->ptr = &context->reply_header;
+        connection->offset = 0;
+        connection->size = sizeof(struct scas_header_t);
+        context->state = SENDING_HEADER;
+    }
+
+    if (context->state == SENDING_HEADER)
+    {
+        if (scas_connection_write(connection) != 0)
+        {
+            return 0;
+        }
+
+        connection->ptr = context->cas_entry != NULL ? context->cas_entry->mem : NULL;
+        connection->offset = 0;
+        connection->size = context->size;
+        context->state = SENDING_PAYLOAD;
+    }
+
+    if (context->size > 0)
+    {
+        int result;
+
+        if (context->file_fd >= 0)
+        {
+            result = scas_connection_write_file(connection, context->file_fd);
+        }
+        else
+        {
+            result = scas_connection_write(connection);
+        }
+
+        if (result != 0)
+        {
+            return 0;
+        }
+    }
+
+    scas_set_cork(connection->fd, 0);
+    scas_connection_reset(connection);
+    return 0;
 }
 
-int
-scas_connection_handle_snapshot_push(struct scas_connection_t *connection)
+/*
+ * The WANT_LIST reply is built in one allocation, the header followed by
+ * the bitmap.
+ */
+struct scas_have_query_context_t
 {
-    struct scas_snapshot_push_context_t *context;
+    struct scas_linear_allocator_t *arena;
+    struct scas_have_query_t query;
+    struct scas_file_meta_t *entries;
+    struct scas_header_t *want_list;
+    unsigned char *wanted;
+    uint32_t current_idx;
+    int state;
+    struct scas_object_receive_t receive;
+};
+
+struct scas_have_query_sort_t
+{
+    struct scas_hash_t hash;
+    uint32_t idx;
+};
+
+static int
+scas_have_query_compare(const void *lhs, const void *rhs)
+{
+    const struct scas_have_query_sort_t *a;
+    const struct scas_have_query_sort_t *b;
+    int result;
+
+    a = lhs;
+    b = rhs;
+    result = memcmp(&a->hash, &b->hash, sizeof(struct scas_hash_t));
+
+    if (result != 0)
+    {
+        return result;
+    }
+
+    return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+static void
+scas_have_query_release_context(void *ptr)
+{
+    struct scas_have_query_context_t *context;
+
+    context = ptr;
+
+    if (context->receive.cas_entry != NULL)
+    {
+        scas_cas_abort_write(context->receive.cas_entry);
+    }
+}
+
+static struct scas_have_query_context_t *
+scas_initialize_have_query_context(struct scas_connection_t *connection)
+{
+    struct scas_have_query_context_t *context;
+
+    if (connection->context != NULL)
+    {
+        return connection->context;
+    }
+
+    context = scas_arena_alloc(connection->arena, sizeof(struct scas_have_query_context_t));
+    context->arena = connection->arena;
+
+    connection->context = context;
+    connection->release_context = scas_have_query_release_context;
+    connection->ptr = &context->query;
+    connection->offset = 0;
+    connection->size = sizeof(struct scas_have_query_t);
+
+    return context;
+}
+
+/*
+ * Wants every listed object the CAS doesn't have, once. Duplicates are
+ * found by sorting the entries by hash, keeping the first of each run. The
+ * sorted copy is only needed here, so the arena is rewound past it.
+ */
+static void
+scas_have_query_build_want_list(struct scas_have_query_context_t *context)
+{
+    struct scas_have_query_sort_t *sorted;
+    void *mark;
+    size_t bitmap_size;
+    uint32_t num_entries;
+    uint32_t i;
+
+    num_entries = context->query.num_entries;
+    bitmap_size = (num_entries + 7) / 8;
+
+    context->want_list = scas_arena_alloc(context->arena, sizeof(struct scas_header_t) + bitmap_size);
+    context->want_list->packet_size = sizeof(struct scas_header_t) + bitmap_size;
+    context->want_list->command = CMD_WANT_LIST;
+    context->wanted = (unsigned char *)&context->want_list[1];
+
+    mark = scas_linear_allocator_mark(context->arena);
+    sorted = scas_linear_allocator_alloc(context->arena, num_entries * sizeof(struct scas_have_query_sort_t));
+
+    for (i = 0; i < num_entries; ++i)
+    {
+        sorted[i].hash = context->entries[i].content;
+        sorted[i].idx = i;
+    }
+
+    qsort(sorted, num_entries, sizeof(struct scas_have_query_sort_t), scas_have_query_compare);
+
+    for (i = 0; i < num_entries; ++i)
+    {
+        uint32_t idx;
+
+        if (i > 0 && memcmp(&sorted[i].hash, &sorted[i - 1].hash, sizeof(struct scas_hash_t)) == 0)
+        {
+            continue;
+        }
+
+        idx = sorted[i].idx;
+
+        if (!scas_cas_contains(sorted[i].hash))
+        {
+            context->wanted[idx / 8] |= (unsigned char)(1 << (idx % 8));
+        }
+    }
+
+    scas_linear_allocator_rewind(context->arena, mark);
+}
+
+/*
+ * Adds a received object to the CAS. A chunk list naming chunks the CAS
+ * doesn't have is dropped rather than stored. Returns non-zero if the
+ * object is a malformed directory record or chunk list.
+ */
+static int
+scas_have_query_store(struct scas_have_query_context_t *context, const struct scas_file_meta_t *entry)
+{
+    struct scas_cas_entry_t *cas_entry;
+
+    cas_entry = context->receive.cas_entry;
+    context->receive.cas_entry = NULL;
+
+    if (scas_is_directory((int)entry->flags)
+        && scas_directory_is_malformed(cas_entry->mem, cas_entry->size))
+    {
+        scas_log("Received a malformed directory record, dropping connection.");
+        scas_cas_abort_write(cas_entry);
+        return 1;
+    }
+
+    if (scas_is_chunked((int)entry->flags))
+    {
+        struct scas_chunk_list_t *list;
+        struct scas_chunk_t *chunks;
+        uint32_t i;
+
+        if (scas_chunk_list_is_malformed(cas_entry->mem, cas_entry->size))
+        {
+            scas_log("Received a malformed chunk list, dropping connection.");
+            scas_cas_abort_write(cas_entry);
+            return 1;
+        }
+
+        list = cas_entry->mem;
+        chunks = scas_get_chunk_base(list);
+
+        for (i = 0; i < list->num_chunks; ++i)
+        {
+            if (!scas_cas_contains(chunks[i].content))
+            {
+                scas_cas_abort_write(cas_entry);
+                return 0;
+            }
+        }
+    }
+
+    scas_cas_end_write(cas_entry);
 
+    return 0;
+}
+
+static int
+scas_connection_handle_have_query(struct scas_connection_t *connection)
+{
     /*
-     * The arrays meta/name_blob_indices/name_blob all have nentries
-     * entries in them. The name_blob field consists of all the names
-     * for files in the directory, null terminated, jammed together.
-     * The indices for the start of each name are stored in 
-     * name_blob_indices, meaning that to index the seventh name in 
-     * the directory entry, you would use the expression
-     * name_blog[name_blob_indices[6]].
-     *
-     * The client only sends the root node of the snapshot. The server
-     * will iterate over the contained files in the root node and its
-     * descendents to verify the contents. For content it does not
-     * have, the server will issue DATA_FETCH commands to the client.
-     *
-     * In the case of the meta blob pushed as a part of the SNAPSHOT_PUSH
-     * handshake, the content field points to the root entry hash.
-     *
-     *                      SNAPSHOT_PUSH ->
-     *       struct scas_file_meta_t meta ->
-     *                                    <- DATA_FETCH 
-     *                                    <- struct scas_hash_t hash
-     *             data (gzip compressed) ->
-     *                                   ....
-     *                                    <- DATA_FETCH ...
-     *                                    <- struct scas_hash_t hash
-     *             data (gzip compressed) ->
+     *                     HAVE_QUERY ->
+     *       struct scas_have_query_t ->
+     * struct scas_file_meta_t[count] ->
+     *                                <- WANT_LIST
+     *                                <- bitmap
+     *                           data ->
+     *                               ....
+     *                           data ->
      */
 
-    context = scas_initialize_snapshot_push_context(connection);
+    enum scas_have_query_state_t
+    {
+        READING_QUERY,
+        READING_ENTRIES,
+        SENDING_WANT_LIST,
+        RECEIVING_HEADER,
+        RECEIVING_PAYLOAD
+    };
 
-    if (!context->have_root)
+    struct scas_have_query_context_t *context;
+    enum scas_have_query_state_t state;
+    int result;
+
+    context = scas_initialize_have_query_context(connection);
+    state = context->state;
+
+    if (state == READING_QUERY)
     {
+        size_t entries_size;
+
         if (scas_connection_read(connection) != 0)
+        {
             return 0;
-        
-        context->have_root = 1;
-        context->current_dir_record = context->snapshot_meta.content;
+        }
 
-        /*
-         * If a snapshot is being pushed we should *not* have it in the CAS
-         * already, but we should check just to be sure.
-         */
-        if (scas_cas_contains(context->current_dir_record))
+        entries_size = (size_t)context->query.num_entries * sizeof(struct scas_file_meta_t);
+
+        if (context->query.num_entries > SCAS_HAVE_QUERY_MAX_ENTRIES
+            || scas_header_payload_size(connection->header) != sizeof(struct scas_have_query_t) + entries_size)
         {
-            scas_connection_reset(connection);
-            return 0;
+            scas_log("Received a malformed have query, dropping connection.");
+            scas_connection_free(connection);
+            return 1;
         }
+
+        context->entries = scas_linear_allocator_alloc(context->arena, entries_size);
+
+        connection->ptr = context->entries;
+        connection->offset = 0;
+        connection->size = entries_size;
+        state = READING_ENTRIES;
     }
 
-    return scas_snapshot_push_iterate(connection);
+    if (state == READING_ENTRIES)
+    {
+        if (scas_connection_read(connection) != 0)
+        {
+            goto save_state_and_yield;
+        }
+
+        scas_have_query_build_want_list(context);
+
+        connection->ptr = context->want_list;
+        connection->offset = 0;
+        connection->size = context->want_list->packet_size;
+        state = SENDING_WANT_LIST;
+    }
+
+    if (state == SENDING_WANT_LIST)
+    {
+        if (scas_connection_write(connection) != 0)
+        {
+            goto save_state_and_yield;
+        }
+
+        context->current_idx = 0;
+        state = RECEIVING_HEADER;
+    }
+
+    /*
+     * The wanted objects arrive back to back, in the order they were
+     * listed.
+     */
+    for (;;)
+    {
+        const struct scas_file_meta_t *entry;
+        uint32_t idx;
+
+        for (idx = context->current_idx; idx < context->query.num_entries; ++idx)
+        {
+            if (context->wanted[idx / 8] & (1 << (idx % 8)))
+            {
+                break;
+            }
+        }
+
+        context->current_idx = idx;
+
+        if (idx == context->query.num_entries)
+        {
+            break;
+        }
+
+        entry = &context->entries[idx];
+
+        if (state == RECEIVING_HEADER)
+        {
+            result = scas_connection_receive_header(connection, &context->receive, entry->content, entry->flags);
+
+            if (result < 0)
+            {
+                scas_connection_free(connection);
+                return 1;
+            }
+
+            if (result != 0)
+            {
+                goto save_state_and_yield;
+            }
+
+            state = RECEIVING_PAYLOAD;
+        }
+
+        result = scas_connection_receive_payload(connection, &context->receive, entry->flags);
+
+        if (result < 0)
+        {
+            scas_connection_free(connection);
+            return 1;
+        }
+
+        if (result != 0)
+        {
+            goto save_state_and_yield;
+        }
+
+        if (scas_connection_verify_payload(&context->receive, entry->content, entry->flags) != 0
+            || scas_have_query_store(context, entry) != 0)
+        {
+            scas_connection_free(connection);
+            return 1;
+        }
+
+        ++context->current_idx;
+        state = RECEIVING_HEADER;
+    }
+
+    scas_connection_reset(connection);
+    return 0;
+
+save_state_and_yield:
+    context->state = state;
+    return 0;
 }
 
-struct scas_data_fetch_context_t
+struct scas_hello_packet_t
 {
-    const struct scas_cas_entry_t *cas_entry;
-    int have_hash;
-    struct scas_hash_t hash;
-    struct scas_header_t fetch_header;
+    struct scas_header_t header;
+    struct scas_hello_t hello;
 };
 
-static struct scas_data_fetch_context_t *
-scas_initialize_data_fetch_context(struct scas_connection_t *connection)
+struct scas_hello_context_t
 {
-    struct scas_data_fetch_context_t *context;
+    struct scas_hello_t request;
+    struct scas_hello_packet_t reply;
+    int have_request;
+};
+
+static struct scas_hello_context_t *
+scas_initialize_hello_context(struct scas_connection_t *connection)
+{
+    struct scas_hello_context_t *context;
 
     if (connection->context != NULL)
     {
         return connection->context;
     }
 
-    context = calloc(1, sizeof(struct scas_data_fetch_context_t));
+    context = scas_arena_alloc(connection->arena, sizeof(struct scas_hello_context_t));
 
     connection->context = context;
-    connection->ptr = &context->hash;
+    connection->ptr = &context->request;
     connection->offset = 0;
-    connection->size = sizeof(struct scas_hash_t);
+    connection->size = sizeof(struct scas_hello_t);
 
     return context;
 }
 
 static int
-scas_connection_handle_data_fetch(struct scas_connection_t *connection)
+scas_connection_handle_hello(struct scas_connection_t *connection)
 {
-    struct scas_data_fetch_context_t *context;
+    struct scas_hello_context_t *context;
 
     /*
-     * struct scas_hash_t
-     * {
-     *     uint32_t hash[5];
-     * };
-     *
-     *              DATA_FETCH ->
-     * struct scas_hash_t hash ->
-     *                         <- data (gzip compressed)
+     *              HELLO ->
+     * struct scas_hello_t ->
+     *                    <- HELLO
+     *                    <- struct scas_hello_t
+     *                    XX (on mismatch)
      */
 
-    context = scas_initialize_data_fetch_context(connection);
-    
-    if (!context->have_hash)
+    if (connection->context == NULL
+        && scas_header_payload_size(connection->header) != sizeof(struct scas_hello_t))
     {
-        const struct scas_cas_entry_t *cas_entry;
+        scas_log("Malformed HELLO, dropping connection.");
+        scas_connection_free(connection);
+        return 1;
+    }
 
-        if (!scas_connection_read(connection))
+    context = scas_initialize_hello_context(connection);
+
+    if (!context->have_request)
+    {
+        if (scas_connection_read(connection) != 0)
         {
             return 0;
         }
 
-        context->have_hash = 1;
-        cas_entry = scas_cas_read_acquire(context->hash);
+        context->have_request = 1;
+        context->reply.header.packet_size = sizeof(struct scas_hello_packet_t);
+        context->reply.header.command = CMD_HELLO;
+        context->reply.hello.protocol_version = SCAS_PROTOCOL_VERSION;
+        context->reply.hello.hash_algorithm = scas_hash_get_algorithm();
+
+        connection->ptr = &context->reply;
+        connection->offset = 0;
+        connection->size = sizeof(struct scas_hello_packet_t);
+    }
+
+    if (scas_connection_write(connection) != 0)
+    {
+        return 0;
+    }
 
-        context->fetch_header.packet_size = cas_entry->size + sizeof(struct scas_header_t);
-        context->fetch_header.command = CMD_DATA;
+    if (context->request.protocol_version != SCAS_PROTOCOL_VERSION
+        || context->request.hash_algorithm != (uint32_t)scas_hash_get_algorithm())
+    {
+        scas_log("Client protocol or hash algorithm does not match, dropping connection.");
+        scas_connection_free(connection);
+        return 1;
     }
 
+    scas_connection_reset(connection);
     return 0;
 }
 
@@ -705,6 +2058,10 @@ scas_connection_process_command(struct scas_connection_t *connection)
             return scas_connection_handle_snapshot_push(connection);
         case CMD_DATA_FETCH:
             return scas_connection_handle_data_fetch(connection);
+        case CMD_HELLO:
+            return scas_connection_handle_hello(connection);
+        case CMD_HAVE_QUERY:
+            return scas_connection_handle_have_query(connection);
         case CMD_QUIT:
             /*
              * By returning non-zero from here to the main loop the session
@@ -713,10 +2070,11 @@ scas_connection_process_command(struct scas_connection_t *connection)
             scas_connection_free(connection);
             return 1;
         default:
-            assert(0 && "Garbled command field.");
+            scas_log("Received unknown command %u, dropping connection.",
+                (unsigned)connection->header.command);
+            scas_connection_free(connection);
+            return 1;
     }
-
-    return 0;
 }
 
 static int
@@ -725,31 +2083,45 @@ scas_connection_iterate(struct scas_connection_t *connection)
     switch (connection->state)
     {
         case NEW:
-            connection->context = &connection->header;
+            connection->ptr = &connection->header;
+            connection->offset = 0;
             connection->size = sizeof(struct scas_header_t);
             connection->state = RECEIVING_HEADER;
-            /*
-             * Deliberate fall-through to the RECEIVING_HEADER case.
-             */
+            /* fall through */
         case RECEIVING_HEADER:
             if (scas_connection_read(connection) != 0)
             {
                 return 0;
             }
 
+            connection->state = PROCESSING_COMMAND;
+            /* fall through */
         default:
             return scas_connection_process_command(connection);
-            break;
     }
 }
 
 int
-scas_handle_connection(int fd)
+scas_handle_connection(struct scas_connection_pool_t *pool, int fd)
 {
     struct scas_connection_t *connection;
 
-    connection = scas_connection_find(fd);
+    connection = scas_connection_find(pool, fd);
 
     return scas_connection_iterate(connection);
 }
 
+void
+scas_drop_connection(struct scas_connection_pool_t *pool, int fd)
+{
+    struct scas_connection_t *connection;
+
+    connection = *scas_connection_table_slot(fd);
+
+    if (connection != NULL)
+    {
+        assert(connection->pool == pool);
+        scas_connection_free(connection);
+    }
+}
+
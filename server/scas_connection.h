@@ -7,10 +7,68 @@
 #ifndef SCAS_CONNECTION_H
 #define SCAS_CONNECTION_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The number of DATA_FETCH requests a snapshot push keeps outstanding at
+ * once, so that pushing many small objects isn't bound by the round trip
+ * time to the client.
+ */
+#define SCAS_CONNECTION_DEFAULT_FETCH_WINDOW 256
+
+void
+scas_connection_set_fetch_window(uint32_t window);
+
+/*
+ * The largest object a client may send in a DATA packet. A client that
+ * sends a bigger one is dropped.
+ */
+#define SCAS_CONNECTION_DEFAULT_MAX_OBJECT_SIZE ((uint64_t)4 << 30)
+
 void
-scas_connection_initialize(void);
+scas_connection_set_max_object_size(uint64_t size);
+
+struct scas_connection_pool_t;
+
+/*
+ * How the connections in a pool move their bytes. The operations behave
+ * like read(2), write(2) and sendfile(2) on a non-blocking socket, failing
+ * with EAGAIN when nothing can be moved yet, and are handed the context
+ * along with the connection's fd. The end of the stream and any other
+ * failure are reported as EAGAIN as well; dealing with them, by closing
+ * the socket once the connection is done with, is up to the event loop.
+ */
+struct scas_connection_io_t
+{
+    ssize_t (*read)(void *context, int fd, void *buffer, size_t size);
+    ssize_t (*write)(void *context, int fd, const void *buffer, size_t size);
+    ssize_t (*send_file)(void *context, int fd, int file_fd, uint64_t offset, size_t size);
+    void *context;
+};
+
+/*
+ * The plain sendfile(2), for io implementations to build on.
+ */
+ssize_t
+scas_connection_send_file(void *context, int fd, int file_fd, uint64_t offset, size_t size);
+
+/*
+ * Every reactor thread has a pool of its own, which the connections it
+ * accepts are allocated from and handled with.
+ */
+struct scas_connection_pool_t *
+scas_connection_pool_create(const struct scas_connection_io_t *io);
 
 int
-scas_handle_connection(int fd);
+scas_handle_connection(struct scas_connection_pool_t *pool, int fd);
+
+/*
+ * Forgets the connection on the given fd, if there is one, abandoning
+ * whatever command it was in the middle of. The fd is left open.
+ */
+void
+scas_drop_connection(struct scas_connection_pool_t *pool, int fd);
 
 #endif
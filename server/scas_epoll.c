@@ -0,0 +1,283 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "scas_base.h"
+#include "scas_connection.h"
+#include "scas_epoll.h"
+
+#define MAX_NUM_EVENTS 128
+
+#define EPOLL_SOCKET_OPEN 0x01
+#define EPOLL_SOCKET_BLOCKED 0x02
+#define EPOLL_SOCKET_WANTS_OUTPUT 0x04
+#define EPOLL_SOCKET_WATCHING_OUTPUT 0x08
+#define EPOLL_SOCKET_FAILED 0x10
+
+#define EPOLL_INPUT_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+#define EPOLL_OUTPUT_EVENTS (EPOLL_INPUT_EVENTS | EPOLLOUT)
+
+struct scas_epoll_t
+{
+    int epoll_fd;
+    int listen_fd;
+    struct scas_connection_pool_t *pool;
+
+    /*
+     * EPOLL_SOCKET_* flags, indexed by fd.
+     */
+    uint32_t *sockets;
+    size_t num_sockets;
+};
+
+static uint32_t *
+scas_epoll_socket(struct scas_epoll_t *reactor, int fd)
+{
+    assert(fd >= 0);
+
+    if ((size_t)fd >= reactor->num_sockets)
+    {
+        size_t num_sockets;
+
+        num_sockets = reactor->num_sockets > 0 ? reactor->num_sockets : 64;
+
+        while (num_sockets <= (size_t)fd)
+        {
+            num_sockets *= 2;
+        }
+
+        reactor->sockets = realloc(reactor->sockets, num_sockets * sizeof(uint32_t));
+        VERIFY(reactor->sockets != NULL);
+        memset(reactor->sockets + reactor->num_sockets, 0, (num_sockets - reactor->num_sockets) * sizeof(uint32_t));
+        reactor->num_sockets = num_sockets;
+    }
+
+    return &reactor->sockets[fd];
+}
+
+/*
+ * Sorts out the result of a transfer for the connection. Running out of
+ * room or data blocks it until the next event; the end of the stream or an
+ * error fails the socket, which is closed once the connection returns. In
+ * every case the connection sees EAGAIN.
+ */
+static ssize_t
+scas_epoll_transferred(struct scas_epoll_t *reactor, int fd, ssize_t result, size_t size, uint32_t wants)
+{
+    uint32_t *socket;
+
+    if (result > 0 || (result == 0 && size == 0))
+    {
+        return result;
+    }
+
+    socket = scas_epoll_socket(reactor, fd);
+
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        *socket |= EPOLL_SOCKET_BLOCKED | wants;
+    }
+    else
+    {
+        *socket |= EPOLL_SOCKET_BLOCKED | EPOLL_SOCKET_FAILED;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t
+scas_epoll_read(void *context, int fd, void *buffer, size_t size)
+{
+    return scas_epoll_transferred(context, fd, read(fd, buffer, size), size, 0);
+}
+
+static ssize_t
+scas_epoll_write(void *context, int fd, const void *buffer, size_t size)
+{
+    return scas_epoll_transferred(context, fd, send(fd, buffer, size, MSG_NOSIGNAL), size, EPOLL_SOCKET_WANTS_OUTPUT);
+}
+
+static ssize_t
+scas_epoll_send_file(void *context, int fd, int file_fd, uint64_t offset, size_t size)
+{
+    return scas_epoll_transferred(context, fd, scas_connection_send_file(NULL, fd, file_fd, offset, size), size, EPOLL_SOCKET_WANTS_OUTPUT);
+}
+
+static void
+scas_epoll_close(struct scas_epoll_t *reactor, int fd)
+{
+    scas_drop_connection(reactor->pool, fd);
+    VERIFY(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != -1);
+    close(fd);
+
+    *scas_epoll_socket(reactor, fd) = 0;
+}
+
+/*
+ * Runs the connection until it blocks, as an edge-triggered socket isn't
+ * reported again until it has been drained. A command that finishes
+ * returns without blocking, and the next one may have arrived already.
+ * Writability is only watched while the connection is waiting to write.
+ */
+static void
+scas_epoll_service(struct scas_epoll_t *reactor, int fd)
+{
+    uint32_t *socket;
+    int watch_output;
+
+    /*
+     * The socket may have been closed by an earlier event in the same
+     * batch.
+     */
+    if (!(*scas_epoll_socket(reactor, fd) & EPOLL_SOCKET_OPEN))
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        socket = scas_epoll_socket(reactor, fd);
+        *socket &= ~(EPOLL_SOCKET_BLOCKED | EPOLL_SOCKET_WANTS_OUTPUT);
+
+        if (scas_handle_connection(reactor->pool, fd) || (*socket & EPOLL_SOCKET_FAILED))
+        {
+            scas_epoll_close(reactor, fd);
+            return;
+        }
+
+        if (*socket & EPOLL_SOCKET_BLOCKED)
+        {
+            break;
+        }
+    }
+
+    watch_output = (*socket & EPOLL_SOCKET_WANTS_OUTPUT) != 0;
+
+    if (watch_output != ((*socket & EPOLL_SOCKET_WATCHING_OUTPUT) != 0))
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof event);
+        event.events = watch_output ? EPOLL_OUTPUT_EVENTS : EPOLL_INPUT_EVENTS;
+        event.data.fd = fd;
+        VERIFY(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event) != -1);
+
+        *socket ^= EPOLL_SOCKET_WATCHING_OUTPUT;
+    }
+}
+
+/*
+ * Takes every connection waiting on the listening socket.
+ */
+static void
+scas_epoll_accept(struct scas_epoll_t *reactor)
+{
+    for (;;)
+    {
+        struct epoll_event event;
+        int fd;
+
+        fd = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                scas_log_system_error("Could not accept connection");
+            }
+
+            return;
+        }
+
+        *scas_epoll_socket(reactor, fd) = EPOLL_SOCKET_OPEN;
+
+        memset(&event, 0, sizeof event);
+        event.events = EPOLL_INPUT_EVENTS;
+        event.data.fd = fd;
+        VERIFY(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != -1);
+    }
+}
+
+void
+scas_epoll_reactor_run(int socket_fd, const int *done)
+{
+    struct scas_epoll_t reactor;
+    struct scas_connection_io_t io;
+    struct epoll_event event;
+    struct epoll_event events[MAX_NUM_EVENTS];
+    int flags;
+
+    memset(&reactor, 0, sizeof reactor);
+    reactor.listen_fd = socket_fd;
+
+    io.read = scas_epoll_read;
+    io.write = scas_epoll_write;
+    io.send_file = scas_epoll_send_file;
+    io.context = &reactor;
+    reactor.pool = scas_connection_pool_create(&io);
+
+    reactor.epoll_fd = epoll_create1(0);
+    VERIFY(reactor.epoll_fd >= 0);
+
+    flags = fcntl(socket_fd, F_GETFL);
+    VERIFY(flags != -1 && fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) != -1);
+
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = socket_fd;
+    VERIFY(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == 0);
+
+    while (!*done)
+    {
+        int num_ready_fds;
+        int i;
+
+        num_ready_fds = epoll_wait(reactor.epoll_fd, events, MAX_NUM_EVENTS, -1);
+
+        if (num_ready_fds < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        VERIFY(num_ready_fds != -1);
+
+        for (i = 0; i < num_ready_fds; ++i)
+        {
+            int fd;
+
+            fd = events[i].data.fd;
+
+            if (fd == socket_fd)
+            {
+                scas_epoll_accept(&reactor);
+            }
+            else
+            {
+                scas_epoll_service(&reactor, fd);
+            }
+        }
+    }
+
+    close(socket_fd);
+    close(reactor.epoll_fd);
+    free(reactor.sockets);
+}
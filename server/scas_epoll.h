@@ -0,0 +1,25 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_EPOLL_H
+#define SCAS_EPOLL_H
+
+/*
+ * The epoll event loop for a reactor thread, used where io_uring isn't
+ * available. Sockets are non-blocking and registered edge-triggered, so
+ * every connection that is woken is run until it blocks, and they are
+ * only watched for writability while a write is waiting for room. An idle
+ * server, or a client that stops reading, costs no CPU.
+ */
+
+/*
+ * Accepts connections on the listening socket and serves them until *done
+ * is set.
+ */
+void
+scas_epoll_reactor_run(int socket_fd, const int *done);
+
+#endif
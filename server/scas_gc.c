@@ -0,0 +1,631 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "scas_base.h"
+#include "scas_cas.h"
+#include "scas_gc.h"
+#include "scas_hash_index.h"
+#include "scas_meta.h"
+#include "scas_pack.h"
+#include "scas_store_index.h"
+
+#define MAX_PATH_LENGTH 256
+
+/*
+ * Removals are made durable, and their files deleted, this many at a time.
+ */
+#define SWEEP_BATCH_SIZE 1024
+
+/*
+ * Throttling sleeps for a tenth of a second after each tenth of the rate.
+ */
+#define THROTTLE_SLICES 10
+
+enum scas_gc_object_kind_t
+{
+    OBJECT_BLOB,
+    OBJECT_DIRECTORY,
+    OBJECT_CHUNK_LIST
+};
+
+struct scas_gc_object_t
+{
+    struct scas_hash_t hash;
+    enum scas_gc_object_kind_t kind;
+};
+
+/*
+ * A set of hashes, indexed by a hash index over the array.
+ */
+struct scas_gc_hash_set_t
+{
+    struct scas_hash_t *hashes;
+    size_t num_hashes;
+    size_t capacity;
+    struct scas_hash_index_t index;
+};
+
+/*
+ * Objects still to be visited while marking.
+ */
+struct scas_gc_stack_t
+{
+    struct scas_gc_object_t *objects;
+    size_t num_objects;
+    size_t capacity;
+};
+
+static char roots_filename[MAX_PATH_LENGTH];
+static pthread_mutex_t roots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned gc_interval;
+static unsigned gc_rate = SCAS_GC_DEFAULT_RATE;
+
+/*
+ * Everything below, including the set of marked objects, is guarded by
+ * lock. Pushes are counted by the parity of the generation they started
+ * in; a collection starts a new generation and waits for the count of the
+ * previous one to drop to zero.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pushes_finished = PTHREAD_COND_INITIALIZER;
+static unsigned generation;
+static size_t active_pushes[2];
+static int collecting;
+static struct scas_gc_hash_set_t marks;
+
+void
+scas_gc_initialize(const char *roots_path)
+{
+    assert(strlen(roots_path) < MAX_PATH_LENGTH);
+    strcpy(roots_filename, roots_path);
+}
+
+static void
+scas_gc_hash_set_initialize(struct scas_gc_hash_set_t *set)
+{
+    memset(set, 0, sizeof(struct scas_gc_hash_set_t));
+    scas_hash_index_initialize(&set->index, NULL, sizeof(struct scas_hash_t));
+}
+
+static void
+scas_gc_hash_set_destroy(struct scas_gc_hash_set_t *set)
+{
+    scas_hash_index_destroy(&set->index);
+    free(set->hashes);
+    memset(set, 0, sizeof(struct scas_gc_hash_set_t));
+}
+
+static int
+scas_gc_hash_set_contains(const struct scas_gc_hash_set_t *set, struct scas_hash_t hash)
+{
+    return scas_hash_index_find(&set->index, hash) != SCAS_HASH_INDEX_NONE;
+}
+
+/*
+ * Adds a hash to the set, returning non-zero if it wasn't there already.
+ */
+static int
+scas_gc_hash_set_add(struct scas_gc_hash_set_t *set, struct scas_hash_t hash)
+{
+    if (scas_gc_hash_set_contains(set, hash))
+        return 0;
+
+    if (set->num_hashes == set->capacity)
+    {
+        set->capacity = set->capacity == 0 ? 4096 : set->capacity * 2;
+        set->hashes = realloc(set->hashes, set->capacity * sizeof(struct scas_hash_t));
+        VERIFY(set->hashes != NULL);
+        scas_hash_index_set_records(&set->index, set->hashes);
+    }
+
+    set->hashes[set->num_hashes] = hash;
+    scas_hash_index_insert(&set->index, (uint32_t)set->num_hashes);
+    ++set->num_hashes;
+
+    return 1;
+}
+
+static void
+scas_gc_mark(struct scas_hash_t hash)
+{
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    scas_gc_hash_set_add(&marks, hash);
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+}
+
+void
+scas_gc_note_live(struct scas_hash_t hash)
+{
+    if (!__atomic_load_n(&collecting, __ATOMIC_ACQUIRE))
+        return;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+
+    if (collecting)
+    {
+        scas_gc_hash_set_add(&marks, hash);
+    }
+
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+}
+
+int
+scas_gc_is_collecting(void)
+{
+    return __atomic_load_n(&collecting, __ATOMIC_ACQUIRE);
+}
+
+int
+scas_gc_is_live(struct scas_hash_t hash)
+{
+    int result;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    result = !collecting || scas_gc_hash_set_contains(&marks, hash);
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    return result;
+}
+
+unsigned
+scas_gc_push_begin(void)
+{
+    unsigned token;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    token = generation;
+    ++active_pushes[token & 1];
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    return token;
+}
+
+void
+scas_gc_push_end(unsigned token, const struct scas_hash_t *root)
+{
+    if (root != NULL)
+    {
+        scas_cas_add_root(*root);
+    }
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+
+    assert(active_pushes[token & 1] > 0);
+    --active_pushes[token & 1];
+    VERIFY(pthread_cond_broadcast(&pushes_finished) == 0);
+
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+}
+
+/*
+ * Waits, with the lock held, for the pushes of the given generation to
+ * finish. Returns non-zero if they didn't in time.
+ */
+static int
+scas_gc_wait_for_pushes(unsigned push_generation, const struct timespec *deadline)
+{
+    while (active_pushes[push_generation & 1] > 0)
+    {
+        if (pthread_cond_timedwait(&pushes_finished, &lock, deadline) == ETIMEDOUT)
+            return active_pushes[push_generation & 1] > 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Starts marking, once the pushes from before the collection have finished.
+ * The pushes from before the previous collection must have finished first,
+ * as they share their count with the new generation. Returns non-zero if
+ * the collection has to be given up.
+ */
+static int
+scas_gc_begin(void)
+{
+    struct timespec deadline;
+    int result;
+
+    VERIFY(clock_gettime(CLOCK_REALTIME, &deadline) == 0);
+    deadline.tv_sec += SCAS_GC_PUSH_TIMEOUT;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+
+    result = scas_gc_wait_for_pushes(generation - 1, &deadline);
+
+    if (result == 0)
+    {
+        scas_gc_hash_set_initialize(&marks);
+        __atomic_store_n(&collecting, 1, __ATOMIC_RELEASE);
+        ++generation;
+
+        result = scas_gc_wait_for_pushes(generation - 1, &deadline);
+    }
+
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    if (result != 0)
+    {
+        scas_log("Garbage collection given up, pushes still in progress.");
+    }
+
+    return result;
+}
+
+static void
+scas_gc_end(void)
+{
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+
+    if (collecting)
+    {
+        __atomic_store_n(&collecting, 0, __ATOMIC_RELEASE);
+        scas_gc_hash_set_destroy(&marks);
+    }
+
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+}
+
+/*
+ * Sleeps as needed to keep to the rate.
+ */
+static void
+scas_gc_throttle(size_t *visited)
+{
+    struct timespec slice;
+    size_t slice_size;
+
+    slice_size = gc_rate / THROTTLE_SLICES;
+
+    if (slice_size == 0)
+        slice_size = 1;
+
+    if (++*visited % slice_size != 0)
+        return;
+
+    slice.tv_sec = 0;
+    slice.tv_nsec = 1000000000L / THROTTLE_SLICES;
+    nanosleep(&slice, NULL);
+}
+
+static void
+scas_gc_stack_push(struct scas_gc_stack_t *stack, struct scas_hash_t hash, enum scas_gc_object_kind_t kind)
+{
+    if (stack->num_objects == stack->capacity)
+    {
+        stack->capacity = stack->capacity == 0 ? 256 : stack->capacity * 2;
+        stack->objects = realloc(stack->objects, stack->capacity * sizeof(struct scas_gc_object_t));
+        VERIFY(stack->objects != NULL);
+    }
+
+    stack->objects[stack->num_objects].hash = hash;
+    stack->objects[stack->num_objects].kind = kind;
+    ++stack->num_objects;
+}
+
+static int
+scas_gc_parse_root(const char *line, struct scas_hash_t *root)
+{
+    unsigned char *bytes;
+    size_t i;
+
+    memset(root, 0, sizeof(struct scas_hash_t));
+    bytes = (unsigned char *)root;
+
+    for (i = 0; i < scas_hash_digest_size(); ++i)
+    {
+        unsigned value;
+
+        if (sscanf(line + i * 2, "%2x", &value) != 1)
+            return -1;
+
+        bytes[i] = (unsigned char)value;
+    }
+
+    return 0;
+}
+
+void
+scas_gc_record_roots(const struct scas_hash_t *roots, size_t num_roots)
+{
+    struct scas_gc_hash_set_t recorded;
+    char line[sizeof(struct scas_hash_t) * 2 + 2];
+    char *lines;
+    size_t length;
+    size_t i;
+    FILE *fp;
+    int fd;
+
+    lines = malloc(num_roots * sizeof line);
+    VERIFY(lines != NULL);
+    length = 0;
+
+    scas_gc_hash_set_initialize(&recorded);
+
+    VERIFY(pthread_mutex_lock(&roots_lock) == 0);
+
+    fp = fopen(roots_filename, "r");
+
+    while (fp != NULL && fgets(line, sizeof line, fp) != NULL)
+    {
+        struct scas_hash_t root;
+
+        if (scas_gc_parse_root(line, &root) == 0)
+        {
+            scas_gc_hash_set_add(&recorded, root);
+        }
+    }
+
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+
+    for (i = 0; i < num_roots; ++i)
+    {
+        const unsigned char *bytes;
+        size_t j;
+
+        if (!scas_gc_hash_set_add(&recorded, roots[i]))
+            continue;
+
+        bytes = (const unsigned char *)&roots[i];
+
+        for (j = 0; j < scas_hash_digest_size(); ++j)
+        {
+            length += (size_t)sprintf(lines + length, "%02x", bytes[j]);
+        }
+
+        lines[length++] = '\n';
+    }
+
+    if (length > 0)
+    {
+        fd = open(roots_filename, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+        VERIFY(fd >= 0);
+        VERIFY(write(fd, lines, length) == (ssize_t)length);
+        VERIFY(fdatasync(fd) == 0);
+        close(fd);
+    }
+
+    VERIFY(pthread_mutex_unlock(&roots_lock) == 0);
+
+    scas_gc_hash_set_destroy(&recorded);
+    free(lines);
+}
+
+static void
+scas_gc_push_roots(struct scas_gc_stack_t *stack)
+{
+    FILE *fp;
+    char line[sizeof(struct scas_hash_t) * 2 + 2];
+
+    VERIFY(pthread_mutex_lock(&roots_lock) == 0);
+
+    fp = fopen(roots_filename, "r");
+
+    while (fp != NULL && fgets(line, sizeof line, fp) != NULL)
+    {
+        struct scas_hash_t root;
+
+        if (scas_gc_parse_root(line, &root) == 0)
+        {
+            scas_gc_stack_push(stack, root, OBJECT_DIRECTORY);
+        }
+    }
+
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+
+    VERIFY(pthread_mutex_unlock(&roots_lock) == 0);
+}
+
+/*
+ * Pushes the children of a directory record or chunk list. Records that
+ * don't hold together are treated as having none.
+ */
+static void
+scas_gc_push_children(struct scas_gc_stack_t *stack, const struct scas_gc_object_t *object, const struct scas_cas_entry_t *entry)
+{
+    uint32_t i;
+
+    if (object->kind == OBJECT_DIRECTORY)
+    {
+        struct scas_directory_meta_t *directory;
+        struct scas_file_meta_t *files;
+
+        if (scas_directory_is_malformed(entry->mem, entry->size))
+        {
+            return;
+        }
+
+        directory = entry->mem;
+
+        files = scas_get_file_meta_base(directory);
+
+        for (i = 0; i < directory->num_entries; ++i)
+        {
+            enum scas_gc_object_kind_t kind;
+
+            if (scas_is_directory((int)files[i].flags))
+                kind = OBJECT_DIRECTORY;
+            else if (scas_is_chunked((int)files[i].flags))
+                kind = OBJECT_CHUNK_LIST;
+            else
+                kind = OBJECT_BLOB;
+
+            scas_gc_stack_push(stack, files[i].content, kind);
+        }
+    }
+    else
+    {
+        struct scas_chunk_list_t *list;
+        struct scas_chunk_t *chunks;
+
+        if (scas_chunk_list_is_malformed(entry->mem, entry->size))
+        {
+            return;
+        }
+
+        list = entry->mem;
+
+        chunks = scas_get_chunk_base(list);
+
+        for (i = 0; i < list->num_chunks; ++i)
+        {
+            scas_gc_stack_push(stack, chunks[i].content, OBJECT_BLOB);
+        }
+    }
+}
+
+/*
+ * Marks everything reachable from the roots, depth first. Objects missing
+ * from the store, such as those of a snapshot whose push was cut short by a
+ * crash, are skipped. Pushes mark the objects they write as they go, so
+ * being marked doesn't mean an object's children have been; the walk keeps
+ * its own set of the objects it has reached.
+ */
+static void
+scas_gc_mark_from_roots(struct scas_gc_hash_set_t *reached)
+{
+    struct scas_gc_stack_t stack;
+    size_t visited;
+
+    memset(&stack, 0, sizeof stack);
+    visited = 0;
+
+    /*
+     * The roots of pushes that finished before the collection began may
+     * still be waiting for a commit to be written out.
+     */
+    scas_cas_sync();
+    scas_gc_push_roots(&stack);
+
+    while (stack.num_objects > 0)
+    {
+        struct scas_gc_object_t object;
+        const struct scas_cas_entry_t *entry;
+
+        object = stack.objects[--stack.num_objects];
+
+        if (!scas_gc_hash_set_add(reached, object.hash))
+            continue;
+
+        scas_gc_mark(object.hash);
+
+        if (object.kind == OBJECT_BLOB)
+            continue;
+
+        scas_gc_throttle(&visited);
+        entry = scas_cas_read_acquire(object.hash);
+
+        if (entry == NULL)
+            continue;
+
+        scas_gc_push_children(&stack, &object, entry);
+        scas_cas_read_release(entry);
+    }
+
+    free(stack.objects);
+}
+
+/*
+ * Removes every unmarked object in the store index. Objects added during
+ * the sweep are marked as they're added, so they're left alone.
+ */
+static void
+scas_gc_sweep(const struct scas_gc_hash_set_t *reached)
+{
+    struct scas_store_record_t record;
+    size_t record_idx;
+    size_t visited;
+    size_t num_removed;
+
+    visited = 0;
+    num_removed = 0;
+
+    for (record_idx = 0; scas_store_index_get_record(record_idx, &record) == 0; ++record_idx)
+    {
+        if (record.location == SCAS_STORE_LOCATION_DELETED)
+            continue;
+
+        scas_gc_throttle(&visited);
+
+        if (scas_cas_remove(record.hash, scas_gc_hash_set_contains(reached, record.hash)) == 0
+            && ++num_removed % SWEEP_BATCH_SIZE == 0)
+        {
+            scas_cas_sync();
+        }
+    }
+
+    scas_cas_sync();
+    scas_log("Garbage collection removed %lu objects.", (unsigned long)num_removed);
+
+    if (num_removed > 0)
+    {
+        scas_pack_compact();
+    }
+}
+
+void
+scas_gc_collect(void)
+{
+    struct scas_gc_hash_set_t reached;
+
+    if (scas_gc_begin() == 0)
+    {
+        scas_gc_hash_set_initialize(&reached);
+        scas_gc_mark_from_roots(&reached);
+        scas_gc_sweep(&reached);
+        scas_gc_hash_set_destroy(&reached);
+    }
+
+    scas_gc_end();
+}
+
+static void *
+scas_gc_thread(void *context)
+{
+    UNUSED(context);
+
+    for (;;)
+    {
+        sleep(gc_interval);
+        scas_gc_collect();
+    }
+
+    return NULL;
+}
+
+void
+scas_gc_start(unsigned interval, unsigned rate)
+{
+    pthread_t thread;
+
+    gc_rate = rate;
+    gc_interval = interval;
+
+    if (interval == 0)
+        return;
+
+    VERIFY(pthread_create(&thread, NULL, scas_gc_thread, NULL) == 0);
+    VERIFY(pthread_detach(thread) == 0);
+}
@@ -0,0 +1,94 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_GC_H
+#define SCAS_GC_H
+
+#include "scas_base.h"
+
+/*
+ * Garbage collection of objects that no snapshot refers to. The roots are
+ * the snapshots pushed to the server, whose root directory hashes are
+ * recorded in the roots file, one per line in hex; a snapshot is retired by
+ * deleting its line. A collection marks everything reachable from the roots
+ * through directory records and chunk lists, then walks the store index and
+ * removes every object left unmarked.
+ *
+ * Collections run in the background while the server carries on serving.
+ * From the start of a collection every object that a push finds in the
+ * store or writes to it is marked as well, and marking from the roots only
+ * begins once every push started before then has finished, so nothing a
+ * push relies on is removed from under it. A push that starts during a
+ * collection walks the directories and chunk lists it finds in the store
+ * rather than skipping them, so what they refer to is marked too. Objects that are being read or
+ * haven't been committed yet are never removed.
+ *
+ * Marking and sweeping each visit at most the given number of objects per
+ * second, to leave the disk to the pushes and fetches being served.
+ */
+#define SCAS_GC_DEFAULT_INTERVAL (24 * 60 * 60)
+#define SCAS_GC_DEFAULT_RATE 10000
+
+/*
+ * How long, in seconds, a collection waits for earlier pushes to finish
+ * before giving up until the next one.
+ */
+#define SCAS_GC_PUSH_TIMEOUT (10 * 60)
+
+void
+scas_gc_initialize(const char *roots_path);
+
+/*
+ * Starts collecting every interval seconds, or never if interval is 0.
+ */
+void
+scas_gc_start(unsigned interval, unsigned rate);
+
+/*
+ * Runs a collection and returns once it is done.
+ */
+void
+scas_gc_collect(void);
+
+/*
+ * Brackets a snapshot push. scas_gc_push_begin returns a token to hand to
+ * scas_gc_push_end, along with the snapshot's root if the push completed
+ * or NULL if it was abandoned. A completed push's root is recorded by the
+ * next commit (see scas_cas_add_root).
+ */
+unsigned
+scas_gc_push_begin(void);
+
+void
+scas_gc_push_end(unsigned token, const struct scas_hash_t *root);
+
+/*
+ * Appends the given roots to the roots file, leaving out any that are
+ * already in it, and flushes it. Called by the CAS when it commits.
+ */
+void
+scas_gc_record_roots(const struct scas_hash_t *roots, size_t num_roots);
+
+/*
+ * Marks an object as live if a collection is running. Called by the CAS
+ * whenever it reports an object as present or adds one.
+ */
+void
+scas_gc_note_live(struct scas_hash_t hash);
+
+/*
+ * Returns non-zero while a collection is running.
+ */
+int
+scas_gc_is_collecting(void);
+
+/*
+ * Returns non-zero if the object must be kept by the running collection.
+ */
+int
+scas_gc_is_live(struct scas_hash_t hash);
+
+#endif
@@ -0,0 +1,297 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+/*
+ * posix_memalign needs POSIX 2001.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "scas_base.h"
+#include "scas_hash_index.h"
+
+#define GROUP_SIZE SCAS_HASH_INDEX_GROUP_SIZE
+#define INITIAL_GROUPS 64
+#define EMPTY 0x80
+
+static uint64_t
+scas_hash_index_key(struct scas_hash_t hash)
+{
+    uint64_t key;
+
+    memcpy(&key, &hash, sizeof key);
+
+    return key;
+}
+
+static uint8_t
+scas_hash_index_tag(uint64_t key)
+{
+    return (uint8_t)(key & 0x7f);
+}
+
+static const struct scas_hash_t *
+scas_hash_index_record_hash(const struct scas_hash_index_t *index, uint32_t record_idx)
+{
+    return (const struct scas_hash_t *)((const char *)index->records + (size_t)record_idx * index->record_size);
+}
+
+/*
+ * Returns a bit mask with bit i set if control byte i of the group equals
+ * value.
+ */
+static unsigned
+scas_hash_index_group_match(const uint8_t *group, uint8_t value)
+{
+#ifdef __SSE2__
+    __m128i control;
+
+    control = _mm_load_si128((const __m128i *)group);
+
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)value)));
+#else
+    unsigned mask;
+    int i;
+
+    mask = 0;
+
+    for (i = 0; i < GROUP_SIZE; ++i)
+    {
+        if (group[i] == value)
+            mask |= 1u << i;
+    }
+
+    return mask;
+#endif
+}
+
+static unsigned
+scas_hash_index_lowest_bit(unsigned mask)
+{
+    unsigned i;
+
+    for (i = 0; (mask & 1) == 0; ++i)
+        mask >>= 1;
+
+    return i;
+}
+
+/*
+ * Groups are visited in triangular order (g, g + 1, g + 3, g + 6, ...),
+ * which reaches every group when the number of groups is a power of two.
+ */
+static size_t
+scas_hash_index_first_group(uint64_t key, size_t num_groups)
+{
+    return (size_t)(key >> 7) & (num_groups - 1);
+}
+
+static void
+scas_hash_index_release(struct scas_hash_index_t *index)
+{
+    size_t num_slots;
+
+    num_slots = index->num_groups * GROUP_SIZE;
+
+    if (index->mapped)
+    {
+        munmap(index->control, num_slots);
+        munmap(index->slots, num_slots * sizeof(uint32_t));
+    }
+    else
+    {
+        free(index->control);
+        free(index->slots);
+    }
+}
+
+static void
+scas_hash_index_allocate(struct scas_hash_index_t *index, size_t num_groups)
+{
+    size_t num_slots;
+    void *control;
+
+    num_slots = num_groups * GROUP_SIZE;
+
+    VERIFY(posix_memalign(&control, GROUP_SIZE, num_slots) == 0);
+    memset(control, EMPTY, num_slots);
+
+    index->control = control;
+    index->slots = malloc(num_slots * sizeof(uint32_t));
+    VERIFY(index->slots != NULL);
+    index->num_groups = num_groups;
+    index->num_entries = 0;
+    index->mapped = 0;
+}
+
+static void
+scas_hash_index_place(struct scas_hash_index_t *index, uint64_t key, uint32_t record_idx)
+{
+    size_t group;
+    size_t step;
+
+    group = scas_hash_index_first_group(key, index->num_groups);
+
+    for (step = 1; ; ++step)
+    {
+        uint8_t *control;
+        unsigned empty;
+
+        control = index->control + group * GROUP_SIZE;
+        empty = scas_hash_index_group_match(control, EMPTY);
+
+        if (empty != 0)
+        {
+            size_t slot;
+
+            slot = scas_hash_index_lowest_bit(empty);
+            control[slot] = scas_hash_index_tag(key);
+            index->slots[group * GROUP_SIZE + slot] = record_idx;
+            ++index->num_entries;
+            return;
+        }
+
+        group = (group + step) & (index->num_groups - 1);
+    }
+}
+
+/*
+ * Doubles the table and reinserts every entry.
+ */
+static void
+scas_hash_index_grow(struct scas_hash_index_t *index)
+{
+    struct scas_hash_index_t old_index;
+    size_t i;
+
+    old_index = *index;
+    scas_hash_index_allocate(index, old_index.num_groups * 2);
+
+    for (i = 0; i < old_index.num_groups * GROUP_SIZE; ++i)
+    {
+        uint32_t record_idx;
+
+        if (old_index.control[i] == EMPTY)
+            continue;
+
+        record_idx = old_index.slots[i];
+        scas_hash_index_place(index, scas_hash_index_key(*scas_hash_index_record_hash(index, record_idx)), record_idx);
+    }
+
+    scas_hash_index_release(&old_index);
+}
+
+void
+scas_hash_index_initialize(struct scas_hash_index_t *index, const void *records, size_t record_size)
+{
+    scas_hash_index_allocate(index, INITIAL_GROUPS);
+    index->records = records;
+    index->record_size = record_size;
+}
+
+void
+scas_hash_index_attach(struct scas_hash_index_t *index, uint8_t *control, uint32_t *slots, size_t num_groups, size_t num_entries, const void *records, size_t record_size)
+{
+    index->control = control;
+    index->slots = slots;
+    index->num_groups = num_groups;
+    index->num_entries = num_entries;
+    index->records = records;
+    index->record_size = record_size;
+    index->mapped = 1;
+}
+
+void
+scas_hash_index_destroy(struct scas_hash_index_t *index)
+{
+    scas_hash_index_release(index);
+    memset(index, 0, sizeof(struct scas_hash_index_t));
+}
+
+size_t
+scas_hash_index_num_slots(const struct scas_hash_index_t *index)
+{
+    return index->num_groups * GROUP_SIZE;
+}
+
+void
+scas_hash_index_set_records(struct scas_hash_index_t *index, const void *records)
+{
+    index->records = records;
+}
+
+void
+scas_hash_index_insert(struct scas_hash_index_t *index, uint32_t record_idx)
+{
+    /*
+     * Keep the load factor at or below 7/8.
+     */
+    if ((index->num_entries + 1) * 8 > index->num_groups * GROUP_SIZE * 7)
+    {
+        scas_hash_index_grow(index);
+    }
+
+    scas_hash_index_place(index, scas_hash_index_key(*scas_hash_index_record_hash(index, record_idx)), record_idx);
+}
+
+uint32_t
+scas_hash_index_find(const struct scas_hash_index_t *index, struct scas_hash_t hash)
+{
+    uint64_t key;
+    uint8_t tag;
+    size_t group;
+    size_t step;
+
+    if (index->control == NULL)
+    {
+        return SCAS_HASH_INDEX_NONE;
+    }
+
+    key = scas_hash_index_key(hash);
+    tag = scas_hash_index_tag(key);
+    group = scas_hash_index_first_group(key, index->num_groups);
+
+    for (step = 1; ; ++step)
+    {
+        const uint8_t *control;
+        unsigned matches;
+
+        control = index->control + group * GROUP_SIZE;
+        matches = scas_hash_index_group_match(control, tag);
+
+        while (matches != 0)
+        {
+            uint32_t record_idx;
+
+            record_idx = index->slots[group * GROUP_SIZE + scas_hash_index_lowest_bit(matches)];
+
+            if (memcmp(scas_hash_index_record_hash(index, record_idx), &hash, sizeof(struct scas_hash_t)) == 0)
+            {
+                return record_idx;
+            }
+
+            matches &= matches - 1;
+        }
+
+        /*
+         * An empty slot in the group means the probe sequence for this key
+         * ended here.
+         */
+        if (scas_hash_index_group_match(control, EMPTY) != 0)
+        {
+            return SCAS_HASH_INDEX_NONE;
+        }
+
+        group = (group + step) & (index->num_groups - 1);
+    }
+}
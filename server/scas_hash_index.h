@@ -0,0 +1,81 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_HASH_INDEX_H
+#define SCAS_HASH_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scas_base.h"
+
+#define SCAS_HASH_INDEX_NONE UINT32_MAX
+#define SCAS_HASH_INDEX_GROUP_SIZE 16
+
+/*
+ * An open-addressing hash table in the style of Abseil's Swiss tables,
+ * mapping content hashes to indices into an array of records owned by the
+ * caller. Each record must start with its struct scas_hash_t.
+ *
+ * Each slot has a control byte which is either empty or the low 7 bits of
+ * the slot's key, and slots are probed a group of 16 at a time: one SIMD
+ * compare of the group's control bytes yields every slot worth checking, so
+ * a lookup rarely touches more than one group or one record. The key is the
+ * first 8 bytes of the content hash, which are already uniformly
+ * distributed.
+ *
+ * Slots hold 4 byte record indices rather than the records themselves, so
+ * growing the table doesn't touch the records.
+ */
+struct scas_hash_index_t
+{
+    uint8_t *control;
+    uint32_t *slots;
+    size_t num_groups;
+    size_t num_entries;
+    const void *records;
+    size_t record_size;
+    int mapped;
+};
+
+void
+scas_hash_index_initialize(struct scas_hash_index_t *index, const void *records, size_t record_size);
+
+/*
+ * Adopts a table previously written out from another index, typically
+ * mapped from a file. control and slots must each start on a page boundary
+ * and are released with munmap rather than free.
+ */
+void
+scas_hash_index_attach(struct scas_hash_index_t *index, uint8_t *control, uint32_t *slots, size_t num_groups, size_t num_entries, const void *records, size_t record_size);
+
+void
+scas_hash_index_destroy(struct scas_hash_index_t *index);
+
+size_t
+scas_hash_index_num_slots(const struct scas_hash_index_t *index);
+
+/*
+ * Must be called if the record array is moved, for example by realloc.
+ */
+void
+scas_hash_index_set_records(struct scas_hash_index_t *index, const void *records);
+
+/*
+ * Adds the record at record_idx, whose hash must not already be in the
+ * index.
+ */
+void
+scas_hash_index_insert(struct scas_hash_index_t *index, uint32_t record_idx);
+
+/*
+ * Returns the index of the record with the given hash, or
+ * SCAS_HASH_INDEX_NONE.
+ */
+uint32_t
+scas_hash_index_find(const struct scas_hash_index_t *index, struct scas_hash_t hash);
+
+#endif
@@ -15,13 +15,31 @@
 
 static size_t pagesize;
 
-struct scas_linear_allocator_t
+/*
+ * A range of address space reserved up front, whose pages are only enabled
+ * once an allocation reaches them. The header sits at the start of the
+ * range, so allocations always lie above it.
+ */
+struct scas_linear_region_t
 {
-    void *ptr;
+    struct scas_linear_region_t *prev;
     void *enabled_region_end;
     void *heap_limit;
 };
 
+/*
+ * The allocator lives at the start of its first region. When the current
+ * region runs out another is mapped, at least max_size and big enough for
+ * the allocation that didn't fit, and chained to the one before it.
+ */
+struct scas_linear_allocator_t
+{
+    struct scas_linear_region_t first_region;
+    struct scas_linear_region_t *region;
+    void *ptr;
+    size_t max_size;
+};
+
 static void *
 scas_enable_pages(void *memory, size_t size)
 {
@@ -37,6 +55,41 @@ scas_enable_pages(void *memory, size_t size)
     return (char *)memory + rounded_size;
 }
 
+static void
+scas_linear_region_unmap(struct scas_linear_region_t *region)
+{
+    size_t size;
+    int result;
+
+    size = (char *)region->heap_limit - (char *)region;
+    result = munmap(region, size);
+    assert(result == 0);
+}
+
+static void
+scas_linear_allocator_add_region(struct scas_linear_allocator_t *allocator, size_t size)
+{
+    struct scas_linear_region_t *region;
+    size_t region_size;
+
+    region_size = allocator->max_size;
+
+    while (region_size - sizeof(struct scas_linear_region_t) < size)
+    {
+        region_size *= 2;
+    }
+
+    region = mmap(NULL, region_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(region != MAP_FAILED);
+
+    region->enabled_region_end = scas_enable_pages(region, sizeof(struct scas_linear_region_t));
+    region->heap_limit = (char *)region + region_size;
+    region->prev = allocator->region;
+
+    allocator->region = region;
+    allocator->ptr = &region[1];
+}
+
 struct scas_linear_allocator_t *
 scas_linear_allocator_create(size_t max_size)
 {
@@ -57,12 +110,16 @@ scas_linear_allocator_create(size_t max_size)
     }
 
     assert(sizeof(struct scas_linear_allocator_t) < pagesize);
+    assert(max_size >= pagesize);
 
     enabled_region_end = scas_enable_pages(allocator, sizeof(struct scas_linear_allocator_t));
 
+    allocator->first_region.prev = NULL;
+    allocator->first_region.enabled_region_end = enabled_region_end;
+    allocator->first_region.heap_limit = (char *)allocator + max_size;
+    allocator->region = &allocator->first_region;
     allocator->ptr = &allocator[1];
-    allocator->enabled_region_end = enabled_region_end;
-    allocator->heap_limit = (char *)allocator + max_size;
+    allocator->max_size = max_size;
 
     return allocator;
 }
@@ -70,28 +127,30 @@ scas_linear_allocator_create(size_t max_size)
 void *
 scas_linear_allocator_alloc(struct scas_linear_allocator_t *allocator, size_t size)
 {
+    struct scas_linear_region_t *region;
     void *mem;
     void *new_top;
     void *enabled_region_end;
     size_t aligned_size;
 
     aligned_size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (aligned_size > (size_t)((char *)allocator->region->heap_limit - (char *)allocator->ptr))
+    {
+        scas_linear_allocator_add_region(allocator, aligned_size);
+    }
+
+    region = allocator->region;
     mem = allocator->ptr;
     new_top = (char *)mem + aligned_size;
 
-    /*
-     * Ensure the memory doesn't escape the allocator. 
-     * TODO: Grow the pool if it does.
-     */
-    assert(new_top < allocator->heap_limit);
-
-    enabled_region_end = allocator->enabled_region_end;
+    enabled_region_end = region->enabled_region_end;
     if (new_top > enabled_region_end)
     {
         size_t bytes_to_enable;
 
         bytes_to_enable = (char *)new_top - (char *)enabled_region_end;
-        allocator->enabled_region_end = scas_enable_pages(enabled_region_end, bytes_to_enable);
+        region->enabled_region_end = scas_enable_pages(enabled_region_end, bytes_to_enable);
     }
 
     allocator->ptr = new_top;
@@ -99,19 +158,56 @@ scas_linear_allocator_alloc(struct scas_linear_allocator_t *allocator, size_t si
     return mem;
 }
 
+void *
+scas_linear_allocator_mark(struct scas_linear_allocator_t *allocator)
+{
+    return allocator->ptr;
+}
+
 void
-scas_linear_allocator_destroy(struct scas_linear_allocator_t *allocator)
+scas_linear_allocator_rewind(struct scas_linear_allocator_t *allocator, void *mark)
 {
-    size_t size;
-    int result;
+    struct scas_linear_region_t *region;
+
+    region = allocator->region;
+
+    /*
+     * Regions chained after the one the mark was taken in are unmapped. A
+     * mark always lies above its region's header, so one that ends a
+     * region isn't mistaken for one in a region mapped right after it.
+     */
+    while ((char *)mark <= (char *)region || (char *)mark > (char *)region->heap_limit)
+    {
+        struct scas_linear_region_t *prev;
+
+        prev = region->prev;
+        assert(prev != NULL);
+
+        scas_linear_region_unmap(region);
+        region = prev;
+    }
 
+    allocator->region = region;
+    allocator->ptr = mark;
+}
+
+void
+scas_linear_allocator_destroy(struct scas_linear_allocator_t *allocator)
+{
     if (allocator == NULL)
     {
         return;
     }
 
-    size = (char *)allocator->heap_limit - (char *)allocator;
-    result = munmap(allocator, size);
-    assert(result == 0);
+    while (allocator->region != &allocator->first_region)
+    {
+        struct scas_linear_region_t *region;
+
+        region = allocator->region;
+        allocator->region = region->prev;
+        scas_linear_region_unmap(region);
+    }
+
+    scas_linear_region_unmap(&allocator->first_region);
 }
 
@@ -7,8 +7,16 @@
 #ifndef SCAS_LINEAR_ALLOCATOR_H
 #define SCAS_LINEAR_ALLOCATOR_H
 
+#include <stddef.h>
+
 #define DEFAULT_ALLOCATOR_SIZE  65536
 
+/*
+ * Hands out memory by bumping a pointer. The allocator reserves max_size
+ * bytes of address space at a time, a power of two, and chains on more
+ * regions when they are used up. Nothing is freed on its own; rewinding to
+ * a mark releases everything allocated since it was taken.
+ */
 struct scas_linear_allocator_t;
 
 struct scas_linear_allocator_t *
@@ -17,6 +25,19 @@ scas_linear_allocator_create(size_t max_size);
 void *
 scas_linear_allocator_alloc(struct scas_linear_allocator_t *allocator, size_t size);
 
+/*
+ * Returns a mark for the allocator's current position, to rewind to later.
+ */
+void *
+scas_linear_allocator_mark(struct scas_linear_allocator_t *allocator);
+
+/*
+ * Releases everything allocated since the mark was taken, unmapping the
+ * regions chained on since then. The memory before the mark is untouched.
+ */
+void
+scas_linear_allocator_rewind(struct scas_linear_allocator_t *allocator, void *mark);
+
 void
 scas_linear_allocator_destroy(struct scas_linear_allocator_t *allocator);
 
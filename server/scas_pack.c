@@ -0,0 +1,657 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scas_base.h"
+#include "scas_lz4.h"
+#include "scas_pack.h"
+#include "scas_store_index.h"
+
+/*
+ * Pack numbers aren't reused once compaction has removed a pack, so this
+ * bounds the number of packs ever written rather than the number on disk.
+ */
+#define MAX_PACKS 65536
+#define MAX_PATH_LENGTH 256
+
+/*
+ * A removal is journaled as an entry with this codec, holding the location
+ * of the object it removes, so that a rebuild of the store index doesn't
+ * bring the object back.
+ */
+#define PACK_CODEC_TOMBSTONE UINT32_MAX
+
+/*
+ * LZ4 can't expand data by more than this, so a compressed entry claiming
+ * more is corrupt.
+ */
+#define MAX_LZ4_RATIO 255
+
+struct scas_pack_entry_header_t
+{
+    struct scas_hash_t hash;
+    uint64_t size;
+    uint32_t codec;
+    uint32_t reserved;
+};
+
+/*
+ * Packs are mapped at their full size when first read from, even while
+ * they're still being appended to; only the part of the mapping below the
+ * end of the file is ever touched. Mappings outlive the removal of their
+ * pack by compaction, as objects read from it may still be in use.
+ */
+static void *pack_mappings[MAX_PACKS];
+static uint32_t num_packs;
+static int current_pack_fd = -1;
+static uint64_t current_pack_size;
+static char pack_directory[MAX_PATH_LENGTH];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+scas_pack_filename(char *filename, uint32_t pack)
+{
+    sprintf(filename, "%s/%08x.pack", pack_directory, pack);
+}
+
+/*
+ * Objects are kept 8 byte aligned so the headers can be read in place.
+ */
+static uint64_t
+scas_pack_entry_size(uint64_t size)
+{
+    return (sizeof(struct scas_pack_entry_header_t) + size + 7) & ~(uint64_t)7;
+}
+
+static void
+scas_pack_open_current(void)
+{
+    char filename[MAX_PATH_LENGTH + 16];
+    struct stat meta;
+
+    /*
+     * The pack being closed may hold objects that haven't been committed
+     * yet, which scas_pack_sync no longer reaches.
+     */
+    if (current_pack_fd >= 0)
+    {
+        VERIFY(fdatasync(current_pack_fd) == 0);
+        close(current_pack_fd);
+    }
+
+    /*
+     * A new pack's directory entry has to be durable before any record
+     * points into it.
+     */
+    scas_pack_filename(filename, num_packs - 1);
+    current_pack_fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    VERIFY(current_pack_fd >= 0);
+    scas_fsync_directory(pack_directory);
+
+    VERIFY(fstat(current_pack_fd, &meta) == 0);
+    current_pack_size = (uint64_t)meta.st_size;
+}
+
+static const char *
+scas_pack_map(uint32_t pack)
+{
+    char filename[MAX_PATH_LENGTH + 16];
+    int fd;
+
+    assert(pack < num_packs);
+
+    if (pack_mappings[pack] == NULL)
+    {
+        scas_pack_filename(filename, pack);
+        fd = open(filename, O_RDONLY);
+        VERIFY(fd >= 0);
+
+        pack_mappings[pack] = mmap(NULL, SCAS_PACK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        VERIFY(pack_mappings[pack] != MAP_FAILED);
+        close(fd);
+    }
+
+    return pack_mappings[pack];
+}
+
+static void
+scas_pack_write(const void *data, size_t size, uint64_t offset)
+{
+    const char *ptr;
+
+    ptr = data;
+
+    while (size > 0)
+    {
+        ssize_t result;
+
+        result = pwrite(current_pack_fd, ptr, size, (off_t)offset);
+        VERIFY(result > 0);
+
+        ptr += result;
+        size -= (size_t)result;
+        offset += (uint64_t)result;
+    }
+}
+
+/*
+ * Checks an entry's data against the hash in its header, decompressing it
+ * first if need be, and returns its size before compression in size.
+ * Entries may be hashed either way an object can be, so both are tried.
+ */
+static int
+scas_pack_entry_is_intact(const struct scas_pack_entry_header_t *header, const char *data, uint64_t *size)
+{
+    struct scas_hash_t hash;
+    void *buffer;
+    const void *content;
+    int intact;
+
+    buffer = NULL;
+    content = data;
+    *size = header->size;
+
+    if (header->codec == SCAS_CODEC_LZ4)
+    {
+        const struct scas_object_header_t *object_header;
+
+        object_header = (const struct scas_object_header_t *)data;
+
+        if (header->size < sizeof(struct scas_object_header_t)
+            || object_header->codec != SCAS_CODEC_LZ4
+            || object_header->size > header->size * MAX_LZ4_RATIO)
+        {
+            return 0;
+        }
+
+        *size = object_header->size;
+        buffer = malloc((size_t)*size + 1);
+        VERIFY(buffer != NULL);
+
+        if (scas_lz4_decompress(&object_header[1], (size_t)header->size - sizeof(struct scas_object_header_t), buffer, (size_t)*size) != 0)
+        {
+            free(buffer);
+            return 0;
+        }
+
+        content = buffer;
+    }
+    else if (header->codec != SCAS_CODEC_NONE)
+    {
+        return 0;
+    }
+
+    hash = scas_hash_buffer(content, (size_t)*size);
+    intact = memcmp(&hash, &header->hash, sizeof hash) == 0;
+
+    if (!intact)
+    {
+        hash = scas_hash_buffer_tree(content, (size_t)*size);
+        intact = memcmp(&hash, &header->hash, sizeof hash) == 0;
+    }
+
+    free(buffer);
+
+    return intact;
+}
+
+/*
+ * Finds the object a tombstone removes. Returns non-zero if it's no longer
+ * there, because its pack has since been compacted away, in which case the
+ * tombstone has nothing left to do.
+ */
+static int
+scas_pack_tombstone_target(const struct scas_pack_entry_header_t *header, const char *data, uint64_t *target)
+{
+    char filename[MAX_PATH_LENGTH + 16];
+    const struct scas_pack_entry_header_t *target_header;
+    const char *mapping;
+    struct stat meta;
+    uint32_t pack;
+    uint64_t offset;
+
+    memcpy(target, data, sizeof *target);
+    pack = SCAS_PACK_LOCATION_PACK(*target);
+    offset = SCAS_PACK_LOCATION_OFFSET(*target);
+
+    if (*target == SCAS_STORE_LOCATION_LOOSE || pack >= num_packs || offset < sizeof(struct scas_pack_entry_header_t))
+        return -1;
+
+    scas_pack_filename(filename, pack);
+
+    if (stat(filename, &meta) != 0 || offset > (uint64_t)meta.st_size)
+        return -1;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    mapping = scas_pack_map(pack);
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    target_header = (const struct scas_pack_entry_header_t *)(mapping + offset) - 1;
+
+    if (target_header->codec == PACK_CODEC_TOMBSTONE || memcmp(&target_header->hash, &header->hash, sizeof header->hash) != 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Walks the entries of a pack up to the given length, calling add, if
+ * given, with every entry whose data matches its hash and remove with
+ * every removal whose object is still there. Entries that are damaged are
+ * skipped; the walk stops at one that runs past the end, which is what an
+ * interrupted append leaves behind. Returns the offset just past the last
+ * intact entry.
+ */
+static uint64_t
+scas_pack_walk(uint32_t pack, uint64_t length,
+    void (*add)(struct scas_hash_t hash, uint64_t size, uint64_t location, uint32_t codec),
+    void (*remove)(struct scas_hash_t hash, uint64_t location))
+{
+    const char *mapping;
+    uint64_t offset;
+    uint64_t valid_length;
+    uint64_t num_skipped;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    mapping = scas_pack_map(pack);
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    valid_length = 0;
+    num_skipped = 0;
+
+    for (offset = 0; offset + sizeof(struct scas_pack_entry_header_t) <= length; )
+    {
+        const struct scas_pack_entry_header_t *header;
+        uint64_t data_offset;
+        uint64_t size;
+
+        header = (const struct scas_pack_entry_header_t *)(mapping + offset);
+        data_offset = offset + sizeof(struct scas_pack_entry_header_t);
+
+        if (header->size > SCAS_PACK_THRESHOLD || data_offset + header->size > length)
+            break;
+
+        offset += scas_pack_entry_size(header->size);
+
+        if (header->codec == PACK_CODEC_TOMBSTONE)
+        {
+            uint64_t target;
+
+            if (header->size != sizeof target)
+            {
+                ++num_skipped;
+                continue;
+            }
+
+            if (remove != NULL && scas_pack_tombstone_target(header, mapping + data_offset, &target) == 0)
+            {
+                remove(header->hash, target);
+            }
+        }
+        else if (!scas_pack_entry_is_intact(header, mapping + data_offset, &size))
+        {
+            ++num_skipped;
+            continue;
+        }
+        else if (add != NULL)
+        {
+            add(header->hash, size, SCAS_PACK_LOCATION(pack, data_offset), header->codec);
+        }
+
+        valid_length = offset;
+    }
+
+    if (num_skipped > 0)
+    {
+        scas_log("Skipped %lu damaged objects in pack %08x.", (unsigned long)num_skipped, pack);
+    }
+
+    return valid_length;
+}
+
+/*
+ * Cuts the current pack back to its last intact entry, so that appends after
+ * a crash don't follow a torn one, which would stop a rebuild of the store
+ * index from reaching them.
+ */
+static void
+scas_pack_truncate_current(void)
+{
+    uint64_t valid_length;
+
+    valid_length = scas_pack_walk(num_packs - 1, current_pack_size, NULL, NULL);
+
+    if (valid_length == current_pack_size)
+        return;
+
+    /*
+     * The padding after the last entry isn't written until the next append,
+     * which has to start past it to keep the headers aligned.
+     */
+    if (valid_length > current_pack_size)
+    {
+        current_pack_size = valid_length;
+        return;
+    }
+
+    scas_log("Discarding %lu bytes at the end of pack %08x.",
+        (unsigned long)(current_pack_size - valid_length), num_packs - 1);
+
+    VERIFY(ftruncate(current_pack_fd, (off_t)valid_length) == 0);
+    VERIFY(fdatasync(current_pack_fd) == 0);
+    current_pack_size = valid_length;
+}
+
+void
+scas_pack_initialize(const char *directory)
+{
+    DIR *dir;
+    struct dirent *dirent;
+
+    assert(strlen(directory) < MAX_PATH_LENGTH);
+    strcpy(pack_directory, directory);
+    scas_mkdir(pack_directory);
+
+    /*
+     * Packs are numbered from zero in the order they're started, with gaps
+     * where packs have been compacted away. The last one is the current one.
+     */
+    num_packs = 1;
+    dir = opendir(pack_directory);
+    VERIFY(dir != NULL);
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        unsigned long pack;
+        char *end;
+
+        pack = strtoul(dirent->d_name, &end, 16);
+
+        if (end != dirent->d_name + 8 || strcmp(end, ".pack") != 0 || pack >= MAX_PACKS)
+            continue;
+
+        if (pack >= num_packs)
+        {
+            num_packs = (uint32_t)pack + 1;
+        }
+    }
+
+    closedir(dir);
+
+    scas_pack_open_current();
+    scas_pack_truncate_current();
+}
+
+uint64_t
+scas_pack_append(struct scas_hash_t hash, const void *data, size_t size, uint32_t codec)
+{
+    struct scas_pack_entry_header_t header;
+    uint64_t offset;
+    uint64_t padded_size;
+    uint64_t location;
+
+    assert(size <= SCAS_PACK_THRESHOLD);
+
+    memset(&header, 0, sizeof header);
+    header.hash = hash;
+    header.size = size;
+    header.codec = codec;
+    padded_size = scas_pack_entry_size(size);
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+
+    if (current_pack_size + padded_size > SCAS_PACK_SIZE)
+    {
+        VERIFY(num_packs < MAX_PACKS);
+        ++num_packs;
+        scas_pack_open_current();
+    }
+
+    offset = current_pack_size;
+    scas_pack_write(&header, sizeof header, offset);
+    scas_pack_write(data, size, offset + sizeof header);
+    current_pack_size = offset + padded_size;
+    location = SCAS_PACK_LOCATION(num_packs - 1, offset + sizeof header);
+
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    return location;
+}
+
+void
+scas_pack_remove(struct scas_hash_t hash, uint64_t location)
+{
+    scas_pack_append(hash, &location, sizeof location, PACK_CODEC_TOMBSTONE);
+}
+
+void
+scas_pack_sync(void)
+{
+    int fd;
+
+    /*
+     * The flush happens on a descriptor of its own so that appends can
+     * carry on meanwhile.
+     */
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    fd = dup(current_pack_fd);
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    VERIFY(fd >= 0);
+    VERIFY(fdatasync(fd) == 0);
+    close(fd);
+}
+
+const void *
+scas_pack_resolve(uint64_t location)
+{
+    const char *mapping;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    mapping = scas_pack_map(SCAS_PACK_LOCATION_PACK(location));
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    return mapping + SCAS_PACK_LOCATION_OFFSET(location);
+}
+
+size_t
+scas_pack_stored_size(uint64_t location)
+{
+    const struct scas_pack_entry_header_t *header;
+
+    header = (const struct scas_pack_entry_header_t *)scas_pack_resolve(location) - 1;
+
+    return (size_t)header->size;
+}
+
+void
+scas_pack_scan(void (*add)(struct scas_hash_t hash, uint64_t size, uint64_t location, uint32_t codec),
+    void (*remove)(struct scas_hash_t hash, uint64_t location))
+{
+    uint32_t pack;
+
+    for (pack = 0; pack < num_packs; ++pack)
+    {
+        char filename[MAX_PATH_LENGTH + 16];
+        struct stat meta;
+
+        scas_pack_filename(filename, pack);
+
+        if (stat(filename, &meta) != 0)
+            continue;
+
+        scas_pack_walk(pack, (uint64_t)meta.st_size, add, remove);
+    }
+}
+
+/*
+ * Copies the objects of a pack that the store index still points to, and
+ * the removals of objects in other packs, to the current pack, points the
+ * index at the copies and deletes the pack.
+ */
+static void
+scas_pack_compact_one(uint32_t pack, uint64_t length)
+{
+    struct scas_pack_move_t
+    {
+        struct scas_hash_t hash;
+        uint64_t from;
+        uint64_t to;
+    } *moves;
+    char filename[MAX_PATH_LENGTH + 16];
+    const char *mapping;
+    uint64_t offset;
+    uint64_t next_offset;
+    size_t num_moves;
+    size_t max_moves;
+    size_t i;
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    mapping = scas_pack_map(pack);
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    moves = NULL;
+    num_moves = 0;
+    max_moves = 0;
+
+    for (offset = 0; offset < length; offset = next_offset)
+    {
+        const struct scas_pack_entry_header_t *header;
+        const char *data;
+        struct scas_store_record_t record;
+        uint64_t location;
+        uint64_t target;
+
+        header = (const struct scas_pack_entry_header_t *)(mapping + offset);
+        data = (const char *)&header[1];
+        location = SCAS_PACK_LOCATION(pack, offset + sizeof *header);
+
+        /*
+         * A pack that isn't the current one was complete when it was left,
+         * so if it doesn't hold together it has been damaged since. It is
+         * kept, as records past the damage can't be found to be moved.
+         */
+        if (offset + sizeof *header > length || header->size > SCAS_PACK_THRESHOLD
+            || offset + sizeof *header + header->size > length)
+        {
+            scas_log("Pack %08x is damaged at offset %lu and can't be compacted.", pack, (unsigned long)offset);
+            free(moves);
+            return;
+        }
+
+        next_offset = offset + scas_pack_entry_size(header->size);
+
+        if (header->codec == PACK_CODEC_TOMBSTONE)
+        {
+            if (header->size == sizeof target
+                && scas_pack_tombstone_target(header, data, &target) == 0
+                && SCAS_PACK_LOCATION_PACK(target) != pack)
+            {
+                scas_pack_append(header->hash, data, (size_t)header->size, header->codec);
+            }
+
+            continue;
+        }
+
+        if (scas_store_index_find(header->hash, &record) != 0 || record.location != location)
+            continue;
+
+        if (num_moves == max_moves)
+        {
+            max_moves = max_moves == 0 ? 256 : max_moves * 2;
+            moves = realloc(moves, max_moves * sizeof(struct scas_pack_move_t));
+            VERIFY(moves != NULL);
+        }
+
+        moves[num_moves].hash = header->hash;
+        moves[num_moves].from = location;
+        moves[num_moves].to = scas_pack_append(header->hash, data, (size_t)header->size, header->codec);
+        ++num_moves;
+    }
+
+    /*
+     * The copies have to be durable before the index points at them, and
+     * the index has to be durable before the originals go.
+     */
+    scas_pack_sync();
+
+    for (i = 0; i < num_moves; ++i)
+    {
+        scas_store_index_relocate(moves[i].hash, moves[i].from, moves[i].to);
+    }
+
+    scas_store_index_sync();
+
+    scas_pack_filename(filename, pack);
+    VERIFY(unlink(filename) == 0);
+    scas_fsync_directory(pack_directory);
+
+    scas_log("Compacted pack %08x, moving %lu objects.", pack, (unsigned long)num_moves);
+    free(moves);
+}
+
+void
+scas_pack_compact(void)
+{
+    struct scas_store_record_t record;
+    uint64_t *live_sizes;
+    size_t record_idx;
+    uint32_t current_pack;
+    uint32_t pack;
+
+    /*
+     * Removals are journaled in the current pack, which isn't otherwise
+     * flushed until something is written to it.
+     */
+    scas_pack_sync();
+
+    VERIFY(pthread_mutex_lock(&lock) == 0);
+    current_pack = num_packs - 1;
+    VERIFY(pthread_mutex_unlock(&lock) == 0);
+
+    live_sizes = calloc((size_t)current_pack + 1, sizeof(uint64_t));
+    VERIFY(live_sizes != NULL);
+
+    for (record_idx = 0; scas_store_index_get_record(record_idx, &record) == 0; ++record_idx)
+    {
+        if (record.location == SCAS_STORE_LOCATION_LOOSE || record.location == SCAS_STORE_LOCATION_DELETED)
+            continue;
+
+        pack = SCAS_PACK_LOCATION_PACK(record.location);
+
+        if (pack < current_pack)
+        {
+            live_sizes[pack] += scas_pack_entry_size(scas_pack_stored_size(record.location));
+        }
+    }
+
+    for (pack = 0; pack < current_pack; ++pack)
+    {
+        char filename[MAX_PATH_LENGTH + 16];
+        struct stat meta;
+
+        scas_pack_filename(filename, pack);
+
+        if (stat(filename, &meta) != 0 || live_sizes[pack] * 2 > (uint64_t)meta.st_size)
+            continue;
+
+        scas_pack_compact_one(pack, (uint64_t)meta.st_size);
+    }
+
+    free(live_sizes);
+}
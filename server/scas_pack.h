@@ -0,0 +1,100 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_PACK_H
+#define SCAS_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scas_base.h"
+
+/*
+ * Small objects are appended to pack files rather than getting a file each,
+ * which would cost an inode, at least one disk block and an open and mmap
+ * per read. Each pack is mapped once, whole, and objects are read as slices
+ * of that mapping.
+ *
+ * Every object in a pack is preceded by its hash, stored size and codec, so
+ * the packs can be walked to rebuild the store index. Removals are appended
+ * to the packs too, so the rebuild leaves removed objects out, and packs
+ * that are mostly removed objects are compacted after a garbage collection.
+ */
+#define SCAS_PACK_THRESHOLD (16 * 1024)
+#define SCAS_PACK_SIZE ((size_t)1 << 28)
+
+/*
+ * A pack location, as kept in the store index, holds the pack number plus
+ * one in its top 24 bits so that it is never SCAS_STORE_LOCATION_LOOSE, and
+ * the offset of the object's data in the bottom 40.
+ */
+#define SCAS_PACK_LOCATION(pack, offset) ((((uint64_t)(pack) + 1) << 40) | (uint64_t)(offset))
+#define SCAS_PACK_LOCATION_PACK(location) ((uint32_t)((location) >> 40) - 1)
+#define SCAS_PACK_LOCATION_OFFSET(location) ((location) & (((uint64_t)1 << 40) - 1))
+
+/*
+ * Opens the packs in the given directory, creating it if needed. New
+ * objects are appended to the last pack, which is first cut back to its
+ * last intact object in case a crash left a partial append at its end.
+ */
+void
+scas_pack_initialize(const char *directory);
+
+/*
+ * Appends an object to the current pack, starting a new pack when it's
+ * full, and returns the object's location.
+ */
+uint64_t
+scas_pack_append(struct scas_hash_t hash, const void *data, size_t size, uint32_t codec);
+
+/*
+ * Journals the removal of the object at the given location. Like an
+ * append, it is durable after the next scas_pack_sync.
+ */
+void
+scas_pack_remove(struct scas_hash_t hash, uint64_t location);
+
+/*
+ * Flushes everything appended so far to disk.
+ */
+void
+scas_pack_sync(void);
+
+/*
+ * Returns the object at the given location, as stored. The memory is part of
+ * the pack's mapping and stays valid for the life of the process.
+ */
+const void *
+scas_pack_resolve(uint64_t location);
+
+/*
+ * Returns the size of the object at the given location as stored, which for
+ * a compressed object is its compressed size.
+ */
+size_t
+scas_pack_stored_size(uint64_t location);
+
+/*
+ * Calls add with every object in every pack whose data matches its hash,
+ * giving the size of compressed objects before compression, and remove with
+ * every removal whose object is still in its pack. The object should only
+ * be dropped if it is still at that location, as it may have been added
+ * again since. Damaged objects are skipped and logged.
+ */
+void
+scas_pack_scan(void (*add)(struct scas_hash_t hash, uint64_t size, uint64_t location, uint32_t codec),
+    void (*remove)(struct scas_hash_t hash, uint64_t location));
+
+/*
+ * Rewrites every pack but the current one in which at least half the space
+ * is taken by objects no longer in the store index: the objects still in it
+ * are appended to the current pack, the index is pointed at them and the
+ * old pack is deleted. Only one compaction may run at a time.
+ */
+void
+scas_pack_compact(void);
+
+#endif
@@ -0,0 +1,900 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+/*
+ * The _GNU_SOURCE define must be set in order to be able to use the
+ * MAP_ANONYMOUS and MAP_NORESERVE flags to mmap.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "scas_base.h"
+#include "scas_hash_index.h"
+#include "scas_store_index.h"
+
+/*
+ * Each Bloom filter block is one 64 byte cache line, and a hash sets
+ * BLOOM_BITS_PER_HASH bits within a single block. At BLOOM_BITS_PER_ENTRY
+ * bits of filter per hash about 0.1% of absent hashes fall through to the
+ * exact index.
+ */
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+#define BLOOM_BITS_PER_HASH 8
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_INITIAL_BLOCKS 1024
+
+/*
+ * Records live in one reserved region, committed RECORDS_COMMIT_SIZE bytes at
+ * a time as it fills. The records section of a checkpoint is mapped over the
+ * start of the region, so loaded and newly added records form one array.
+ */
+#define RECORDS_RESERVE_SIZE ((size_t)1 << 36)
+#define RECORDS_COMMIT_SIZE ((size_t)1 << 20)
+
+#define CHECKPOINT_MAGIC "SCASIDX1"
+#define CHECKPOINT_VERSION 2
+#define MAX_PATH_LENGTH 256
+
+/*
+ * The checkpoint file is this header followed by the records, the hash index
+ * control bytes and slots, and the Bloom filter blocks, each starting on a
+ * page boundary so it can be mapped directly.
+ */
+struct scas_checkpoint_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_algorithm;
+    uint64_t record_size;
+    uint64_t num_records;
+    uint64_t num_groups;
+    uint64_t num_bloom_blocks;
+    uint64_t records_offset;
+    uint64_t control_offset;
+    uint64_t slots_offset;
+    uint64_t bloom_offset;
+};
+
+struct scas_journal_entry_t
+{
+    struct scas_store_record_t record;
+    uint64_t checksum;
+};
+
+struct scas_bloom_block_t
+{
+    uint64_t words[BLOOM_BLOCK_WORDS];
+};
+
+static struct scas_bloom_block_t *bloom_blocks;
+static size_t bloom_num_blocks;
+static int bloom_mapped;
+
+static struct scas_store_record_t *records;
+static size_t num_records;
+static size_t records_committed;
+static struct scas_hash_index_t hash_index;
+
+/*
+ * A checkpoint is written from a copy of the tables while the journal goes
+ * on in a new file; the journal it covers is kept as previous_journal_filename
+ * until the checkpoint is durable, and is replayed before the current one
+ * if it is still there after a crash.
+ */
+struct scas_store_index_snapshot_t
+{
+    struct scas_store_record_t *records;
+    uint8_t *control;
+    uint32_t *slots;
+    struct scas_bloom_block_t *bloom_blocks;
+    size_t num_records;
+    size_t num_groups;
+    size_t num_slots;
+    size_t bloom_num_blocks;
+};
+
+static char checkpoint_filename[MAX_PATH_LENGTH];
+static char journal_filename[MAX_PATH_LENGTH];
+static char previous_journal_filename[MAX_PATH_LENGTH];
+static char checkpoint_directory[MAX_PATH_LENGTH];
+static int journal_fd = -1;
+static size_t journal_records;
+static int checkpoint_due;
+static int journal_rotated;
+
+/*
+ * Lookups share the lock; adding or removing records and taking the snapshot
+ * for a checkpoint take it exclusively. Records are modified in place, so
+ * they are only ever copied out while it is held.
+ */
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static size_t
+scas_page_round(size_t size)
+{
+    size_t pagesize;
+
+    pagesize = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+/*
+ * The filter is driven by bytes 8-15 of the hash, which the hash index
+ * doesn't use for its key.
+ */
+static uint64_t
+scas_bloom_bits(struct scas_hash_t hash)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &hash.hash[2], sizeof bits);
+
+    return bits;
+}
+
+static void
+scas_bloom_release(void)
+{
+    if (bloom_mapped)
+    {
+        munmap(bloom_blocks, bloom_num_blocks * sizeof(struct scas_bloom_block_t));
+    }
+    else
+    {
+        free(bloom_blocks);
+    }
+
+    bloom_blocks = NULL;
+    bloom_mapped = 0;
+}
+
+static void
+scas_bloom_allocate(size_t num_blocks)
+{
+    void *blocks;
+
+    VERIFY(posix_memalign(&blocks, sizeof(struct scas_bloom_block_t), num_blocks * sizeof(struct scas_bloom_block_t)) == 0);
+    memset(blocks, 0, num_blocks * sizeof(struct scas_bloom_block_t));
+
+    scas_bloom_release();
+    bloom_blocks = blocks;
+    bloom_num_blocks = num_blocks;
+}
+
+/*
+ * Bit positions within the block come from repeatedly multiplying by an odd
+ * constant and taking the top bits, which mixes every input bit into each
+ * position.
+ */
+static void
+scas_bloom_add(struct scas_hash_t hash)
+{
+    struct scas_bloom_block_t *block;
+    uint64_t x;
+    int i;
+
+    x = scas_bloom_bits(hash);
+    block = &bloom_blocks[x & (bloom_num_blocks - 1)];
+
+    for (i = 0; i < BLOOM_BITS_PER_HASH; ++i)
+    {
+        unsigned bit;
+
+        x *= 0x9e3779b97f4a7c15ULL;
+        bit = (unsigned)(x >> 55);
+        block->words[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+static int
+scas_bloom_contains(struct scas_hash_t hash)
+{
+    const struct scas_bloom_block_t *block;
+    uint64_t x;
+    int i;
+
+    x = scas_bloom_bits(hash);
+    block = &bloom_blocks[x & (bloom_num_blocks - 1)];
+
+    for (i = 0; i < BLOOM_BITS_PER_HASH; ++i)
+    {
+        unsigned bit;
+
+        x *= 0x9e3779b97f4a7c15ULL;
+        bit = (unsigned)(x >> 55);
+
+        if ((block->words[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * A Bloom filter can't be resized in place, but every hash is also in the
+ * record array, so a bigger filter is rebuilt from there.
+ */
+static void
+scas_bloom_grow(void)
+{
+    size_t i;
+
+    scas_bloom_allocate(bloom_num_blocks * 2);
+
+    for (i = 0; i < num_records; ++i)
+    {
+        scas_bloom_add(records[i].hash);
+    }
+}
+
+static void
+scas_store_index_reserve_records(void)
+{
+    if (records != NULL)
+        return;
+
+    records = mmap(NULL, RECORDS_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    VERIFY(records != MAP_FAILED);
+    records_committed = 0;
+}
+
+static void
+scas_store_index_commit_records(size_t size)
+{
+    while (records_committed < size)
+    {
+        int result;
+
+        VERIFY(records_committed + RECORDS_COMMIT_SIZE <= RECORDS_RESERVE_SIZE);
+        result = mprotect((char *)records + records_committed, RECORDS_COMMIT_SIZE, PROT_READ | PROT_WRITE);
+        VERIFY(result == 0);
+
+        records_committed += RECORDS_COMMIT_SIZE;
+    }
+}
+
+static void
+scas_store_index_insert(const struct scas_store_record_t *record)
+{
+    scas_store_index_commit_records((num_records + 1) * sizeof(struct scas_store_record_t));
+
+    records[num_records] = *record;
+    scas_hash_index_insert(&hash_index, (uint32_t)num_records);
+    ++num_records;
+
+    if (num_records * BLOOM_BITS_PER_ENTRY > bloom_num_blocks * BLOOM_BLOCK_BITS)
+    {
+        scas_bloom_grow();
+    }
+    else
+    {
+        scas_bloom_add(record->hash);
+    }
+}
+
+/*
+ * 64 bit FNV-1a, enough to tell a torn journal entry from a complete one.
+ */
+static uint64_t
+scas_journal_checksum(const struct scas_store_record_t *record)
+{
+    const unsigned char *bytes;
+    uint64_t checksum;
+    size_t i;
+
+    bytes = (const unsigned char *)record;
+    checksum = 0xcbf29ce484222325ULL;
+
+    for (i = 0; i < sizeof(struct scas_store_record_t); ++i)
+    {
+        checksum ^= bytes[i];
+        checksum *= 0x100000001b3ULL;
+    }
+
+    return checksum;
+}
+
+static void
+scas_store_index_write(int fd, const void *data, size_t size)
+{
+    const char *ptr;
+
+    ptr = data;
+
+    while (size > 0)
+    {
+        ssize_t result;
+
+        result = write(fd, ptr, size);
+
+        if (result < 0)
+        {
+            scas_log_system_error("Unable to write store index");
+            BREAK();
+            return;
+        }
+
+        ptr += result;
+        size -= (size_t)result;
+    }
+}
+
+/*
+ * Writes a checkpoint section and pads it out to a page boundary, returning
+ * the offset of the next section.
+ */
+static uint64_t
+scas_store_index_write_section(int fd, uint64_t offset, const void *data, size_t size)
+{
+    static const char zeros[4096];
+    size_t padded_size;
+    size_t padding;
+
+    scas_store_index_write(fd, data, size);
+
+    padded_size = scas_page_round(size);
+
+    for (padding = padded_size - size; padding > 0; )
+    {
+        size_t chunk;
+
+        chunk = padding < sizeof zeros ? padding : sizeof zeros;
+        scas_store_index_write(fd, zeros, chunk);
+        padding -= chunk;
+    }
+
+    return offset + padded_size;
+}
+
+static void
+scas_store_index_open_journal(void)
+{
+    if (journal_fd >= 0)
+        return;
+
+    journal_fd = open(journal_filename, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    VERIFY(journal_fd >= 0);
+}
+
+/*
+ * Replays a journal on top of the checkpoint, stopping at the first entry
+ * that is incomplete or fails its checksum. Anything after that point is the
+ * remains of a write interrupted by a crash. Returns the length of the valid
+ * part.
+ */
+static off_t
+scas_store_index_replay_file(int fd)
+{
+    struct scas_journal_entry_t entry;
+    off_t valid_length;
+    uint32_t record_idx;
+
+    valid_length = 0;
+
+    while (read(fd, &entry, sizeof entry) == (ssize_t)sizeof entry)
+    {
+        if (entry.checksum != scas_journal_checksum(&entry.record))
+            break;
+
+        record_idx = scas_hash_index_find(&hash_index, entry.record.hash);
+
+        /*
+         * A later entry for the same hash removes or restores the object.
+         */
+        if (record_idx == SCAS_HASH_INDEX_NONE)
+        {
+            scas_store_index_insert(&entry.record);
+        }
+        else
+        {
+            records[record_idx] = entry.record;
+        }
+
+        valid_length += (off_t)sizeof entry;
+    }
+
+    return valid_length;
+}
+
+/*
+ * Replays the journal left by a checkpoint that didn't finish, if there is
+ * one, and then the current journal, whose torn end is cut off. Returns
+ * non-zero if there was a previous journal.
+ */
+static int
+scas_store_index_replay_journal(void)
+{
+    off_t valid_length;
+    int fd;
+
+    fd = open(previous_journal_filename, O_RDONLY);
+
+    if (fd >= 0)
+    {
+        scas_store_index_replay_file(fd);
+        close(fd);
+    }
+
+    scas_store_index_open_journal();
+
+    valid_length = scas_store_index_replay_file(journal_fd);
+    VERIFY(ftruncate(journal_fd, valid_length) == 0);
+    journal_records = (size_t)valid_length / sizeof(struct scas_journal_entry_t);
+
+    return fd >= 0;
+}
+
+static int
+scas_store_index_map_checkpoint(void)
+{
+    struct scas_checkpoint_header_t header;
+    size_t num_slots;
+    void *control;
+    void *slots;
+    void *bloom;
+    int fd;
+
+    fd = open(checkpoint_filename, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (read(fd, &header, sizeof header) != (ssize_t)sizeof header
+        || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof header.magic) != 0
+        || header.version != CHECKPOINT_VERSION
+        || header.hash_algorithm != (uint32_t)scas_hash_get_algorithm()
+        || header.record_size != sizeof(struct scas_store_record_t))
+    {
+        scas_log("Ignoring unusable store index checkpoint %s.", checkpoint_filename);
+        close(fd);
+        return -1;
+    }
+
+    if (header.num_records > 0)
+    {
+        size_t size;
+        void *mapped;
+
+        size = scas_page_round(header.num_records * sizeof(struct scas_store_record_t));
+        mapped = mmap(records, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)header.records_offset);
+        VERIFY(mapped == records);
+        records_committed = size;
+    }
+
+    num_slots = header.num_groups * SCAS_HASH_INDEX_GROUP_SIZE;
+    control = mmap(NULL, num_slots, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)header.control_offset);
+    slots = mmap(NULL, num_slots * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)header.slots_offset);
+    bloom = mmap(NULL, header.num_bloom_blocks * sizeof(struct scas_bloom_block_t), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)header.bloom_offset);
+    VERIFY(control != MAP_FAILED && slots != MAP_FAILED && bloom != MAP_FAILED);
+
+    close(fd);
+
+    num_records = header.num_records;
+    scas_hash_index_attach(&hash_index, control, slots, header.num_groups, header.num_records, records, sizeof(struct scas_store_record_t));
+
+    bloom_blocks = bloom;
+    bloom_num_blocks = header.num_bloom_blocks;
+    bloom_mapped = 1;
+
+    return 0;
+}
+
+static const struct scas_store_record_t *
+scas_store_index_find_locked(struct scas_hash_t hash)
+{
+    uint32_t record_idx;
+
+    if (!scas_bloom_contains(hash))
+        return NULL;
+
+    record_idx = scas_hash_index_find(&hash_index, hash);
+
+    if (record_idx == SCAS_HASH_INDEX_NONE || records[record_idx].location == SCAS_STORE_LOCATION_DELETED)
+        return NULL;
+
+    return &records[record_idx];
+}
+
+/*
+ * Describes the tables as they are, without copying them.
+ */
+static void
+scas_store_index_describe_tables(struct scas_store_index_snapshot_t *tables)
+{
+    tables->records = records;
+    tables->control = hash_index.control;
+    tables->slots = hash_index.slots;
+    tables->bloom_blocks = bloom_blocks;
+    tables->num_records = num_records;
+    tables->num_groups = hash_index.num_groups;
+    tables->num_slots = scas_hash_index_num_slots(&hash_index);
+    tables->bloom_num_blocks = bloom_num_blocks;
+}
+
+/*
+ * Copies the tables into a snapshot and starts a new journal, so the
+ * checkpoint can be written from the snapshot without holding the lock.
+ * Called with the lock held exclusively.
+ */
+static void
+scas_store_index_take_snapshot(struct scas_store_index_snapshot_t *snapshot)
+{
+    struct scas_store_index_snapshot_t tables;
+    size_t records_size;
+    size_t slots_size;
+    size_t bloom_size;
+
+    scas_store_index_describe_tables(&tables);
+    *snapshot = tables;
+
+    records_size = tables.num_records * sizeof(struct scas_store_record_t);
+    slots_size = tables.num_slots * sizeof(uint32_t);
+    bloom_size = tables.bloom_num_blocks * sizeof(struct scas_bloom_block_t);
+
+    snapshot->records = malloc(records_size + 1);
+    snapshot->control = malloc(tables.num_slots + 1);
+    snapshot->slots = malloc(slots_size + 1);
+    snapshot->bloom_blocks = malloc(bloom_size + 1);
+    VERIFY(snapshot->records != NULL && snapshot->control != NULL && snapshot->slots != NULL && snapshot->bloom_blocks != NULL);
+
+    memcpy(snapshot->records, tables.records, records_size);
+    memcpy(snapshot->control, tables.control, tables.num_slots);
+    memcpy(snapshot->slots, tables.slots, slots_size);
+    memcpy(snapshot->bloom_blocks, tables.bloom_blocks, bloom_size);
+
+    /*
+     * A journal left by an earlier store without a checkpoint holds nothing
+     * the snapshot doesn't, so it is simply dropped.
+     */
+    if (journal_fd >= 0)
+    {
+        close(journal_fd);
+        journal_fd = -1;
+        VERIFY(rename(journal_filename, previous_journal_filename) == 0);
+    }
+    else
+    {
+        unlink(journal_filename);
+    }
+
+    scas_store_index_open_journal();
+    journal_records = 0;
+    checkpoint_due = 0;
+    __atomic_store_n(&journal_rotated, 1, __ATOMIC_RELEASE);
+}
+
+static void
+scas_store_index_release_snapshot(struct scas_store_index_snapshot_t *snapshot)
+{
+    free(snapshot->records);
+    free(snapshot->control);
+    free(snapshot->slots);
+    free(snapshot->bloom_blocks);
+}
+
+static void
+scas_store_index_write_checkpoint(const struct scas_store_index_snapshot_t *snapshot)
+{
+    struct scas_checkpoint_header_t header;
+    char temp_filename[MAX_PATH_LENGTH];
+    uint64_t offset;
+    int fd;
+
+    /*
+     * The checkpoint is written in full to a temporary file and renamed over
+     * the old one, so there is always one complete checkpoint on disk. The
+     * journal it covers is only deleted once the rename itself is durable,
+     * or a crash could bring back the old checkpoint without it; if deleting
+     * it doesn't happen, replaying it again is harmless.
+     */
+    strcpy(temp_filename, checkpoint_filename);
+    strcat(temp_filename, ".tmp");
+
+    fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    VERIFY(fd >= 0);
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+    header.version = CHECKPOINT_VERSION;
+    header.hash_algorithm = scas_hash_get_algorithm();
+    header.record_size = sizeof(struct scas_store_record_t);
+    header.num_records = snapshot->num_records;
+    header.num_groups = snapshot->num_groups;
+    header.num_bloom_blocks = snapshot->bloom_num_blocks;
+    header.records_offset = scas_page_round(sizeof header);
+    header.control_offset = header.records_offset + scas_page_round(snapshot->num_records * sizeof(struct scas_store_record_t));
+    header.slots_offset = header.control_offset + scas_page_round(snapshot->num_slots);
+    header.bloom_offset = header.slots_offset + scas_page_round(snapshot->num_slots * sizeof(uint32_t));
+
+    offset = scas_store_index_write_section(fd, 0, &header, sizeof header);
+    offset = scas_store_index_write_section(fd, offset, snapshot->records, snapshot->num_records * sizeof(struct scas_store_record_t));
+    offset = scas_store_index_write_section(fd, offset, snapshot->control, snapshot->num_slots);
+    offset = scas_store_index_write_section(fd, offset, snapshot->slots, snapshot->num_slots * sizeof(uint32_t));
+    offset = scas_store_index_write_section(fd, offset, snapshot->bloom_blocks, snapshot->bloom_num_blocks * sizeof(struct scas_bloom_block_t));
+    assert(offset == header.bloom_offset + scas_page_round(snapshot->bloom_num_blocks * sizeof(struct scas_bloom_block_t)));
+
+    VERIFY(fsync(fd) == 0);
+    close(fd);
+
+    VERIFY(rename(temp_filename, checkpoint_filename) == 0);
+    scas_fsync_directory(checkpoint_directory);
+
+    unlink(previous_journal_filename);
+}
+
+int
+scas_store_index_load(const char *checkpoint_path, const char *journal_path)
+{
+    char *separator;
+
+    assert(strlen(checkpoint_path) + sizeof(".tmp") <= MAX_PATH_LENGTH);
+    assert(strlen(journal_path) + sizeof(".old") <= MAX_PATH_LENGTH);
+
+    strcpy(checkpoint_filename, checkpoint_path);
+    strcpy(journal_filename, journal_path);
+    strcpy(previous_journal_filename, journal_path);
+    strcat(previous_journal_filename, ".old");
+
+    strcpy(checkpoint_directory, checkpoint_path);
+    separator = strrchr(checkpoint_directory, '/');
+
+    if (separator != NULL)
+        separator[1] = 0;
+    else
+        strcpy(checkpoint_directory, ".");
+
+    scas_store_index_reserve_records();
+
+    if (scas_store_index_map_checkpoint() == 0)
+    {
+        /*
+         * The next checkpoint would put the current journal where the
+         * previous one is, so the records only it holds are checkpointed
+         * now, straight from the tables while nothing else is running.
+         */
+        if (scas_store_index_replay_journal())
+        {
+            struct scas_store_index_snapshot_t tables;
+
+            scas_store_index_describe_tables(&tables);
+            scas_store_index_write_checkpoint(&tables);
+        }
+
+        return 0;
+    }
+
+    num_records = 0;
+    scas_hash_index_initialize(&hash_index, records, sizeof(struct scas_store_record_t));
+    scas_bloom_allocate(BLOOM_INITIAL_BLOCKS);
+
+    return -1;
+}
+
+/*
+ * Appends a record to the journal, noting once it is long enough that a
+ * checkpoint is due.
+ */
+static void
+scas_store_index_journal(const struct scas_store_record_t *record)
+{
+    struct scas_journal_entry_t entry;
+
+    /*
+     * Until the first checkpoint exists there is nothing for a journal to
+     * apply to, so the initial scan of the store isn't journaled.
+     */
+    if (journal_fd < 0)
+        return;
+
+    memset(&entry, 0, sizeof entry);
+    entry.record = *record;
+    entry.checksum = scas_journal_checksum(&entry.record);
+
+    scas_store_index_write(journal_fd, &entry, sizeof entry);
+
+    if (++journal_records >= SCAS_STORE_INDEX_JOURNAL_LIMIT)
+    {
+        checkpoint_due = 1;
+    }
+}
+
+void
+scas_store_index_add(struct scas_hash_t hash, uint64_t size, uint64_t location, uint32_t codec)
+{
+    struct scas_store_record_t record;
+    uint32_t record_idx;
+
+    memset(&record, 0, sizeof record);
+    record.hash = hash;
+    record.size = size;
+    record.location = location;
+    record.codec = codec;
+
+    VERIFY(pthread_rwlock_wrlock(&lock) == 0);
+
+    record_idx = scas_hash_index_find(&hash_index, hash);
+
+    if (record_idx == SCAS_HASH_INDEX_NONE)
+    {
+        scas_store_index_insert(&record);
+    }
+    else if (records[record_idx].location == SCAS_STORE_LOCATION_DELETED)
+    {
+        records[record_idx] = record;
+    }
+    else
+    {
+        VERIFY(pthread_rwlock_unlock(&lock) == 0);
+        return;
+    }
+
+    scas_store_index_journal(&record);
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+}
+
+void
+scas_store_index_remove(struct scas_hash_t hash)
+{
+    struct scas_store_record_t *record;
+
+    VERIFY(pthread_rwlock_wrlock(&lock) == 0);
+
+    record = (struct scas_store_record_t *)scas_store_index_find_locked(hash);
+
+    if (record != NULL)
+    {
+        record->location = SCAS_STORE_LOCATION_DELETED;
+        scas_store_index_journal(record);
+    }
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+}
+
+void
+scas_store_index_set_flags(struct scas_hash_t hash, uint32_t flags)
+{
+    struct scas_store_record_t *record;
+
+    VERIFY(pthread_rwlock_wrlock(&lock) == 0);
+
+    record = (struct scas_store_record_t *)scas_store_index_find_locked(hash);
+
+    if (record != NULL && record->flags != flags)
+    {
+        record->flags = flags;
+        scas_store_index_journal(record);
+    }
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+}
+
+void
+scas_store_index_relocate(struct scas_hash_t hash, uint64_t from, uint64_t to)
+{
+    struct scas_store_record_t *record;
+
+    VERIFY(pthread_rwlock_wrlock(&lock) == 0);
+
+    record = (struct scas_store_record_t *)scas_store_index_find_locked(hash);
+
+    if (record != NULL && record->location == from)
+    {
+        record->location = to;
+        scas_store_index_journal(record);
+    }
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+}
+
+int
+scas_store_index_get_record(size_t record_idx, struct scas_store_record_t *record)
+{
+    int result;
+
+    VERIFY(pthread_rwlock_rdlock(&lock) == 0);
+
+    result = record_idx < num_records ? 0 : -1;
+
+    if (result == 0)
+    {
+        *record = records[record_idx];
+    }
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+
+    return result;
+}
+
+void
+scas_store_index_sync(void)
+{
+    VERIFY(pthread_rwlock_rdlock(&lock) == 0);
+
+    if (journal_fd >= 0)
+    {
+        VERIFY(fdatasync(journal_fd) == 0);
+    }
+
+    /*
+     * Records in a journal started by a checkpoint aren't durable until the
+     * journal's directory entry is.
+     */
+    if (__atomic_exchange_n(&journal_rotated, 0, __ATOMIC_ACQ_REL))
+    {
+        scas_fsync_directory(checkpoint_directory);
+    }
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+}
+
+int
+scas_store_index_find(struct scas_hash_t hash, struct scas_store_record_t *record)
+{
+    const struct scas_store_record_t *found;
+
+    VERIFY(pthread_rwlock_rdlock(&lock) == 0);
+    found = scas_store_index_find_locked(hash);
+
+    if (found != NULL)
+    {
+        *record = *found;
+    }
+
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+
+    return found == NULL;
+}
+
+int
+scas_store_index_contains(struct scas_hash_t hash)
+{
+    int found;
+
+    VERIFY(pthread_rwlock_rdlock(&lock) == 0);
+    found = scas_store_index_find_locked(hash) != NULL;
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+
+    return found;
+}
+
+int
+scas_store_index_checkpoint_due(void)
+{
+    int due;
+
+    VERIFY(pthread_rwlock_rdlock(&lock) == 0);
+    due = checkpoint_due;
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+
+    return due;
+}
+
+void
+scas_store_index_checkpoint(void)
+{
+    struct scas_store_index_snapshot_t snapshot;
+
+    VERIFY(pthread_rwlock_wrlock(&lock) == 0);
+    scas_store_index_take_snapshot(&snapshot);
+    VERIFY(pthread_rwlock_unlock(&lock) == 0);
+
+    scas_store_index_write_checkpoint(&snapshot);
+    scas_store_index_release_snapshot(&snapshot);
+}
@@ -0,0 +1,159 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_STORE_INDEX_H
+#define SCAS_STORE_INDEX_H
+
+#include <stdint.h>
+
+#include "scas_base.h"
+
+/*
+ * The index of every object in the store, kept in memory so existence checks
+ * don't have to touch the filesystem. A blocked Bloom filter answers most
+ * negative queries from a single cache line; hashes that pass it are
+ * confirmed against an exact hash index, so there are no false positives.
+ *
+ * The index persists as a checkpoint file plus an append-only journal of the
+ * records added since. The checkpoint holds the in-memory tables as they
+ * are, each section page aligned, so loading it is a handful of mmap calls
+ * regardless of how many objects there are; only the journal is replayed.
+ * A torn record at the end of the journal, left by a crash, is discarded.
+ * Checkpoints are written from a copy of the tables, so lookups and
+ * additions carry on while one is being written.
+ */
+
+/*
+ * Loose objects are stored in a file of their own, named after their hash.
+ * Any other location is a position in a pack file; see scas_pack.h.
+ */
+#define SCAS_STORE_LOCATION_LOOSE 0
+
+/*
+ * Removed objects keep their record, marked with this location, which hides
+ * them from lookups and is reused if the object is added again.
+ */
+#define SCAS_STORE_LOCATION_DELETED UINT64_MAX
+
+/*
+ * Objects that compress well are stored compressed, as a struct
+ * scas_object_header_t naming the codec followed by the compressed data.
+ * Everything else is stored as it is, with no header. Loose compressed
+ * objects have the codec's extension appended to their file name.
+ */
+enum scas_codec_t
+{
+    SCAS_CODEC_NONE,
+    SCAS_CODEC_LZ4
+};
+
+struct scas_object_header_t
+{
+    uint32_t codec;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+/*
+ * Set on a directory record once every object below it is known to be in
+ * the store, so a push can skip the whole subtree.
+ */
+#define SCAS_STORE_FLAG_SUBTREE_COMPLETE (1 << 0)
+
+/*
+ * size is the object's size before compression.
+ */
+struct scas_store_record_t
+{
+    struct scas_hash_t hash;
+    uint64_t size;
+    uint64_t location;
+    uint32_t codec;
+    uint32_t flags;
+};
+
+/*
+ * Loads the index from the checkpoint and journal at the given paths.
+ * Returns 0 on success. If there is no usable checkpoint the index is left
+ * empty and non-zero is returned; the caller is then expected to add every
+ * object and write a checkpoint with scas_store_index_checkpoint.
+ */
+int
+scas_store_index_load(const char *checkpoint_path, const char *journal_path);
+
+/*
+ * Adds a record to the index and appends it to the journal. Adding a hash
+ * that is already present does nothing. The object must already be durable,
+ * as the record may be written out by a checkpoint at any time.
+ */
+void
+scas_store_index_add(struct scas_hash_t hash, uint64_t size, uint64_t location, uint32_t codec);
+
+/*
+ * Removes the object with the given hash from the index and journals the
+ * removal. Its data must not be deleted before the journal is flushed with
+ * scas_store_index_sync.
+ */
+void
+scas_store_index_remove(struct scas_hash_t hash);
+
+/*
+ * Replaces the flags of an object in the index and journals the change.
+ * Does nothing if the object isn't in the index.
+ */
+void
+scas_store_index_set_flags(struct scas_hash_t hash, uint32_t flags);
+
+/*
+ * Moves an object to a new location and journals the move, provided it is
+ * still at the location given as from. Moving it to
+ * SCAS_STORE_LOCATION_DELETED removes it.
+ */
+void
+scas_store_index_relocate(struct scas_hash_t hash, uint64_t from, uint64_t to);
+
+/*
+ * Copies out the record at the given position in the record array, deleted
+ * or not, for walking every record in the store. Returns non-zero once
+ * record_idx is past the end.
+ */
+int
+scas_store_index_get_record(size_t record_idx, struct scas_store_record_t *record);
+
+/*
+ * Flushes the journal to disk, making every record added so far durable.
+ */
+void
+scas_store_index_sync(void);
+
+/*
+ * Copies out the record for a hash. Returns non-zero if the object isn't in
+ * the store.
+ */
+int
+scas_store_index_find(struct scas_hash_t hash, struct scas_store_record_t *record);
+
+int
+scas_store_index_contains(struct scas_hash_t hash);
+
+/*
+ * Returns non-zero once the journal has reached SCAS_STORE_INDEX_JOURNAL_LIMIT
+ * records and should be folded into a checkpoint.
+ */
+int
+scas_store_index_checkpoint_due(void);
+
+/*
+ * Writes the whole index to a new checkpoint and starts a new journal. The
+ * lock is only held while the tables are copied; the checkpoint is written
+ * outside it. Only one checkpoint may be written at a time.
+ */
+void
+scas_store_index_checkpoint(void);
+
+#define SCAS_STORE_INDEX_JOURNAL_LIMIT (1 << 20)
+
+#endif
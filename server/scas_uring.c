@@ -0,0 +1,930 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "scas_base.h"
+#include "scas_connection.h"
+#include "scas_uring.h"
+
+#define URING_NUM_ENTRIES 1024
+#define URING_NUM_COMPLETIONS (4 * URING_NUM_ENTRIES)
+#define URING_NUM_BUFFERS 256
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP 0
+
+/*
+ * The most received buffers a socket can hold before its receive is
+ * stopped, so that a client that sends without reading can't take all of
+ * them from the other connections.
+ */
+#define URING_MAX_SOCKET_BUFFERS (URING_NUM_BUFFERS / 16)
+
+#define URING_SETUP_FLAGS (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE)
+
+/*
+ * Every request carries the operation, the fd and the generation of the
+ * socket it was made for, so that completions arriving after the fd has
+ * been closed, and possibly reused, are recognized as stale.
+ */
+enum scas_uring_op_t
+{
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL,
+    URING_OP_CANCEL
+};
+
+#define URING_GENERATION_MASK 0xffffff
+#define URING_USER_DATA(op, fd, generation) \
+    (((uint64_t)(op) << 56) | ((uint64_t)((generation) & URING_GENERATION_MASK) << 32) | (uint32_t)(fd))
+#define URING_USER_DATA_OP(user_data) ((enum scas_uring_op_t)((user_data) >> 56))
+#define URING_USER_DATA_GENERATION(user_data) ((uint32_t)((user_data) >> 32) & URING_GENERATION_MASK)
+#define URING_USER_DATA_FD(user_data) ((int)(uint32_t)(user_data))
+
+#define URING_SOCKET_OPEN 0x01
+#define URING_SOCKET_RECEIVING 0x02
+#define URING_SOCKET_STARVED 0x04
+#define URING_SOCKET_SENDING 0x08
+#define URING_SOCKET_SENT 0x10
+#define URING_SOCKET_BLOCKED 0x20
+#define URING_SOCKET_CLOSING 0x40
+#define URING_SOCKET_POLLING 0x80
+#define URING_SOCKET_THROTTLED 0x100
+
+/*
+ * A received buffer, queued on its socket until the connection has read
+ * all of it.
+ */
+struct scas_uring_buffer_t
+{
+    uint32_t size;
+    uint32_t offset;
+    int32_t next;
+};
+
+struct scas_uring_socket_t
+{
+    uint32_t generation;
+    uint32_t flags;
+    int32_t first_buffer;
+    int32_t last_buffer;
+    uint32_t num_buffers;
+    ssize_t send_result;
+};
+
+struct scas_uring_t
+{
+    int ring_fd;
+    int listen_fd;
+    struct scas_connection_pool_t *pool;
+
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    unsigned cq_mask;
+
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffer_memory;
+    uint16_t buffer_ring_tail;
+    int have_recycled_buffers;
+    struct scas_uring_buffer_t buffers[URING_NUM_BUFFERS];
+
+    struct scas_uring_socket_t *sockets;
+    size_t num_sockets;
+
+    /*
+     * Sockets whose receive ran out of buffers, to be restarted once some
+     * are given back.
+     */
+    int *starved;
+    size_t num_starved;
+    size_t starved_capacity;
+};
+
+static void
+scas_uring_destroy(struct scas_uring_t *uring)
+{
+    if (uring->buffer_ring != NULL)
+    {
+        munmap(uring->buffer_ring, uring->buffer_ring_size);
+    }
+
+    if (uring->sqes != NULL)
+    {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+
+    if (uring->rings != NULL)
+    {
+        munmap(uring->rings, uring->rings_size);
+    }
+
+    close(uring->ring_fd);
+    free(uring->buffer_memory);
+    free(uring->sockets);
+    free(uring->starved);
+}
+
+static void
+scas_uring_recycle_buffer(struct scas_uring_t *uring, int32_t id)
+{
+    struct io_uring_buf *buffer;
+
+    buffer = &uring->buffer_ring->bufs[uring->buffer_ring_tail & (URING_NUM_BUFFERS - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(uring->buffer_memory + (size_t)id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = (uint16_t)id;
+
+    ++uring->buffer_ring_tail;
+    __atomic_store_n(&uring->buffer_ring->tail, uring->buffer_ring_tail, __ATOMIC_RELEASE);
+    uring->have_recycled_buffers = 1;
+}
+
+/*
+ * Sets up the rings and registers the receive buffers, returning non-zero
+ * if the kernel doesn't support any of it.
+ */
+static int
+scas_uring_create(struct scas_uring_t *uring)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg buffer_reg;
+    size_t sq_size;
+    size_t cq_size;
+    char *rings;
+    int32_t i;
+
+    memset(uring, 0, sizeof *uring);
+    memset(&params, 0, sizeof params);
+    params.flags = URING_SETUP_FLAGS;
+    params.cq_entries = URING_NUM_COMPLETIONS;
+
+    uring->ring_fd = (int)syscall(__NR_io_uring_setup, URING_NUM_ENTRIES, &params);
+
+    if (uring->ring_fd < 0)
+    {
+        return 1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        scas_uring_destroy(uring);
+        return 1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED, uring->ring_fd, IORING_OFF_SQ_RING);
+    VERIFY(uring->rings != MAP_FAILED);
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, uring->ring_fd, IORING_OFF_SQES);
+    VERIFY(uring->sqes != MAP_FAILED);
+
+    rings = uring->rings;
+    uring->sq_head = (unsigned *)(rings + params.sq_off.head);
+    uring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    uring->sq_array = (unsigned *)(rings + params.sq_off.array);
+    uring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->sq_local_tail = *uring->sq_tail;
+
+    uring->cq_head = (unsigned *)(rings + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    uring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+
+    /*
+     * The buffer ring has to be page aligned, which an anonymous mapping
+     * always is.
+     */
+    uring->buffer_ring_size = URING_NUM_BUFFERS * sizeof(struct io_uring_buf);
+    uring->buffer_ring = mmap(NULL, uring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    VERIFY(uring->buffer_ring != MAP_FAILED);
+
+    memset(&buffer_reg, 0, sizeof buffer_reg);
+    buffer_reg.ring_addr = (uint64_t)(uintptr_t)uring->buffer_ring;
+    buffer_reg.ring_entries = URING_NUM_BUFFERS;
+    buffer_reg.bgid = URING_BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &buffer_reg, 1) != 0)
+    {
+        scas_uring_destroy(uring);
+        return 1;
+    }
+
+    uring->buffer_memory = malloc((size_t)URING_NUM_BUFFERS * URING_BUFFER_SIZE);
+    VERIFY(uring->buffer_memory != NULL);
+
+    for (i = 0; i < URING_NUM_BUFFERS; ++i)
+    {
+        scas_uring_recycle_buffer(uring, i);
+    }
+
+    uring->have_recycled_buffers = 0;
+
+    return 0;
+}
+
+/*
+ * Submits everything queued so far and, if wait is set, waits for at least
+ * one completion.
+ */
+static void
+scas_uring_enter(struct scas_uring_t *uring, int wait)
+{
+    unsigned to_submit;
+    long result;
+
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+    do
+    {
+        result = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, wait ? 1 : 0,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+    while (result < 0 && errno == EINTR);
+
+    VERIFY(result >= 0);
+}
+
+static struct io_uring_sqe *
+scas_uring_get_sqe(struct scas_uring_t *uring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries)
+    {
+        scas_uring_enter(uring, 0);
+    }
+
+    idx = uring->sq_local_tail & uring->sq_mask;
+    sqe = &uring->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    uring->sq_array[idx] = idx;
+    ++uring->sq_local_tail;
+
+    return sqe;
+}
+
+static struct scas_uring_socket_t *
+scas_uring_socket(struct scas_uring_t *uring, int fd)
+{
+    assert(fd >= 0);
+
+    if ((size_t)fd >= uring->num_sockets)
+    {
+        size_t num_sockets;
+
+        num_sockets = uring->num_sockets > 0 ? uring->num_sockets : 64;
+
+        while (num_sockets <= (size_t)fd)
+        {
+            num_sockets *= 2;
+        }
+
+        uring->sockets = realloc(uring->sockets, num_sockets * sizeof(struct scas_uring_socket_t));
+        VERIFY(uring->sockets != NULL);
+        memset(uring->sockets + uring->num_sockets, 0, (num_sockets - uring->num_sockets) * sizeof(struct scas_uring_socket_t));
+        uring->num_sockets = num_sockets;
+    }
+
+    return &uring->sockets[fd];
+}
+
+static void
+scas_uring_accept(struct scas_uring_t *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = scas_uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = uring->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = URING_USER_DATA(URING_OP_ACCEPT, uring->listen_fd, 0);
+}
+
+static void
+scas_uring_receive(struct scas_uring_t *uring, int fd)
+{
+    struct scas_uring_socket_t *socket;
+    struct io_uring_sqe *sqe;
+
+    socket = scas_uring_socket(uring, fd);
+    socket->flags |= URING_SOCKET_RECEIVING;
+
+    sqe = scas_uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_USER_DATA(URING_OP_RECV, fd, socket->generation);
+}
+
+/*
+ * Stops the receive of a socket holding too many buffers. Buffers the
+ * receive fills before the cancel takes effect are still queued.
+ */
+static void
+scas_uring_throttle(struct scas_uring_t *uring, int fd)
+{
+    struct scas_uring_socket_t *socket;
+    struct io_uring_sqe *sqe;
+
+    socket = scas_uring_socket(uring, fd);
+    socket->flags |= URING_SOCKET_THROTTLED;
+
+    if (!(socket->flags & URING_SOCKET_RECEIVING))
+    {
+        return;
+    }
+
+    sqe = scas_uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_USER_DATA(URING_OP_RECV, fd, socket->generation);
+    sqe->user_data = URING_USER_DATA(URING_OP_CANCEL, fd, socket->generation);
+}
+
+/*
+ * Restarts the receive of a throttled socket once the connection has read
+ * enough of what it holds and the cancelled receive has ended.
+ */
+static void
+scas_uring_unthrottle(struct scas_uring_t *uring, int fd)
+{
+    struct scas_uring_socket_t *socket;
+
+    socket = scas_uring_socket(uring, fd);
+
+    if ((socket->flags & (URING_SOCKET_THROTTLED | URING_SOCKET_RECEIVING)) != URING_SOCKET_THROTTLED
+        || socket->num_buffers >= URING_MAX_SOCKET_BUFFERS)
+    {
+        return;
+    }
+
+    socket->flags &= ~URING_SOCKET_THROTTLED;
+    scas_uring_receive(uring, fd);
+}
+
+static void
+scas_uring_send(struct scas_uring_t *uring, int fd, const void *buffer, size_t size)
+{
+    struct scas_uring_socket_t *socket;
+    struct io_uring_sqe *sqe;
+
+    socket = scas_uring_socket(uring, fd);
+    socket->flags |= URING_SOCKET_SENDING;
+
+    sqe = scas_uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_USER_DATA(URING_OP_SEND, fd, socket->generation);
+}
+
+/*
+ * Waits for room in the socket's send buffer, for writes made directly
+ * rather than through the ring.
+ */
+static void
+scas_uring_poll_writable(struct scas_uring_t *uring, int fd)
+{
+    struct scas_uring_socket_t *socket;
+    struct io_uring_sqe *sqe;
+
+    socket = scas_uring_socket(uring, fd);
+    socket->flags |= URING_SOCKET_POLLING;
+
+    sqe = scas_uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = URING_USER_DATA(URING_OP_POLL, fd, socket->generation);
+}
+
+/*
+ * Copies out as much of what the socket has received as fits.
+ */
+static ssize_t
+scas_uring_read(void *context, int fd, void *buffer, size_t size)
+{
+    struct scas_uring_t *uring;
+    struct scas_uring_socket_t *socket;
+    size_t num_copied;
+
+    uring = context;
+    socket = scas_uring_socket(uring, fd);
+    num_copied = 0;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    while (num_copied < size && socket->first_buffer >= 0)
+    {
+        struct scas_uring_buffer_t *received;
+        int32_t id;
+        size_t num_bytes;
+
+        id = socket->first_buffer;
+        received = &uring->buffers[id];
+        num_bytes = received->size - received->offset;
+
+        if (num_bytes > size - num_copied)
+        {
+            num_bytes = size - num_copied;
+        }
+
+        memcpy((char *)buffer + num_copied, uring->buffer_memory + (size_t)id * URING_BUFFER_SIZE + received->offset, num_bytes);
+        received->offset += (uint32_t)num_bytes;
+        num_copied += num_bytes;
+
+        if (received->offset == received->size)
+        {
+            socket->first_buffer = received->next;
+
+            if (socket->first_buffer < 0)
+            {
+                socket->last_buffer = -1;
+            }
+
+            --socket->num_buffers;
+            scas_uring_recycle_buffer(uring, id);
+        }
+    }
+
+    scas_uring_unthrottle(uring, fd);
+
+    if (num_copied == 0)
+    {
+        socket->flags |= URING_SOCKET_BLOCKED;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return (ssize_t)num_copied;
+}
+
+/*
+ * Sends the buffer, the first time it's asked to, and reports how much was
+ * sent once the send completes. The connection keeps asking to write the
+ * same buffer until then.
+ */
+static ssize_t
+scas_uring_write(void *context, int fd, const void *buffer, size_t size)
+{
+    struct scas_uring_t *uring;
+    struct scas_uring_socket_t *socket;
+
+    uring = context;
+    socket = scas_uring_socket(uring, fd);
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    if (socket->flags & URING_SOCKET_SENT)
+    {
+        socket->flags &= ~URING_SOCKET_SENT;
+        return socket->send_result;
+    }
+
+    if (!(socket->flags & URING_SOCKET_SENDING))
+    {
+        scas_uring_send(uring, fd, buffer, size);
+    }
+
+    socket->flags |= URING_SOCKET_BLOCKED;
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Files are sent with a plain sendfile, which io_uring has no equivalent
+ * of, waiting on the ring for the socket to drain when it's full. A socket
+ * that fails is shut down, which ends its receive and has it closed.
+ */
+static ssize_t
+scas_uring_send_file(void *context, int fd, int file_fd, uint64_t offset, size_t size)
+{
+    struct scas_uring_t *uring;
+    struct scas_uring_socket_t *socket;
+    ssize_t result;
+
+    uring = context;
+    socket = scas_uring_socket(uring, fd);
+    result = scas_connection_send_file(NULL, fd, file_fd, offset, size);
+
+    if (result >= 0)
+    {
+        return result;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        if (!(socket->flags & URING_SOCKET_POLLING))
+        {
+            scas_uring_poll_writable(uring, fd);
+        }
+    }
+    else
+    {
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    socket->flags |= URING_SOCKET_BLOCKED;
+    errno = EAGAIN;
+    return -1;
+}
+
+static void
+scas_uring_open(struct scas_uring_t *uring, int fd)
+{
+    struct scas_uring_socket_t *socket;
+
+    socket = scas_uring_socket(uring, fd);
+    socket->flags = URING_SOCKET_OPEN;
+    socket->first_buffer = -1;
+    socket->last_buffer = -1;
+    socket->num_buffers = 0;
+
+    scas_uring_receive(uring, fd);
+}
+
+/*
+ * A socket with a send outstanding is only shut down, and closed once the
+ * send completes, since the connection owns the buffer being sent.
+ */
+static void
+scas_uring_close(struct scas_uring_t *uring, int fd)
+{
+    struct scas_uring_socket_t *socket;
+
+    socket = scas_uring_socket(uring, fd);
+
+    while (socket->first_buffer >= 0)
+    {
+        int32_t id;
+
+        id = socket->first_buffer;
+        socket->first_buffer = uring->buffers[id].next;
+        scas_uring_recycle_buffer(uring, id);
+    }
+
+    socket->last_buffer = -1;
+    socket->num_buffers = 0;
+
+    /*
+     * Shutting the socket down ends the receive, which otherwise holds the
+     * socket open after the fd is closed.
+     */
+    shutdown(fd, SHUT_RDWR);
+
+    if (socket->flags & URING_SOCKET_SENDING)
+    {
+        socket->flags |= URING_SOCKET_CLOSING;
+        return;
+    }
+
+    scas_drop_connection(uring->pool, fd);
+    close(fd);
+
+    ++socket->generation;
+    socket->flags = 0;
+}
+
+/*
+ * Runs the connection until it blocks. A command that finishes returns
+ * without blocking, and the next one may have been received already.
+ */
+static void
+scas_uring_service(struct scas_uring_t *uring, int fd)
+{
+    for (;;)
+    {
+        uring->sockets[fd].flags &= ~URING_SOCKET_BLOCKED;
+
+        if (scas_handle_connection(uring->pool, fd))
+        {
+            scas_uring_close(uring, fd);
+            return;
+        }
+
+        if (uring->sockets[fd].flags & URING_SOCKET_BLOCKED)
+        {
+            return;
+        }
+    }
+}
+
+static void
+scas_uring_starve(struct scas_uring_t *uring, int fd)
+{
+    if (uring->num_starved == uring->starved_capacity)
+    {
+        uring->starved_capacity = uring->starved_capacity > 0 ? 2 * uring->starved_capacity : 16;
+        uring->starved = realloc(uring->starved, uring->starved_capacity * sizeof(int));
+        VERIFY(uring->starved != NULL);
+    }
+
+    uring->sockets[fd].flags |= URING_SOCKET_STARVED;
+    uring->starved[uring->num_starved++] = fd;
+}
+
+/*
+ * Restarts the receives that ran out of buffers, once some have been given
+ * back. A socket closed in the meantime has lost its flag; one that is
+ * listed twice is only restarted once.
+ */
+static void
+scas_uring_feed_starved(struct scas_uring_t *uring)
+{
+    size_t i;
+
+    if (!uring->have_recycled_buffers)
+    {
+        return;
+    }
+
+    uring->have_recycled_buffers = 0;
+
+    for (i = 0; i < uring->num_starved; ++i)
+    {
+        int fd;
+
+        fd = uring->starved[i];
+
+        if (uring->sockets[fd].flags & URING_SOCKET_STARVED)
+        {
+            uring->sockets[fd].flags &= ~URING_SOCKET_STARVED;
+            scas_uring_receive(uring, fd);
+        }
+    }
+
+    uring->num_starved = 0;
+}
+
+static void
+scas_uring_complete_receive(struct scas_uring_t *uring, const struct io_uring_cqe *cqe)
+{
+    struct scas_uring_socket_t *socket;
+    int fd;
+    int stale;
+
+    fd = URING_USER_DATA_FD(cqe->user_data);
+    socket = scas_uring_socket(uring, fd);
+    stale = socket->generation != URING_USER_DATA_GENERATION(cqe->user_data)
+        || (socket->flags & URING_SOCKET_CLOSING);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        int32_t id;
+
+        id = (int32_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if (stale || cqe->res <= 0)
+        {
+            scas_uring_recycle_buffer(uring, id);
+        }
+        else
+        {
+            uring->buffers[id].size = (uint32_t)cqe->res;
+            uring->buffers[id].offset = 0;
+            uring->buffers[id].next = -1;
+
+            if (socket->last_buffer >= 0)
+            {
+                uring->buffers[socket->last_buffer].next = id;
+            }
+            else
+            {
+                socket->first_buffer = id;
+            }
+
+            socket->last_buffer = id;
+            ++socket->num_buffers;
+        }
+    }
+
+    if (stale)
+    {
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        socket->flags &= ~URING_SOCKET_RECEIVING;
+    }
+
+    /*
+     * A throttled socket's receive is restarted once the connection has
+     * read from it, rather than when buffers are given back.
+     */
+    if (cqe->res == -ECANCELED || (cqe->res == -ENOBUFS && (socket->flags & URING_SOCKET_THROTTLED)))
+    {
+        scas_uring_unthrottle(uring, fd);
+        return;
+    }
+
+    if (cqe->res == -ENOBUFS)
+    {
+        scas_uring_starve(uring, fd);
+        return;
+    }
+
+    /*
+     * The client closed the connection or it failed.
+     */
+    if (cqe->res <= 0)
+    {
+        scas_uring_close(uring, fd);
+        return;
+    }
+
+    if (socket->num_buffers >= URING_MAX_SOCKET_BUFFERS && !(socket->flags & URING_SOCKET_THROTTLED))
+    {
+        scas_uring_throttle(uring, fd);
+    }
+    else if (!(socket->flags & (URING_SOCKET_RECEIVING | URING_SOCKET_THROTTLED)))
+    {
+        scas_uring_receive(uring, fd);
+    }
+
+    scas_uring_service(uring, fd);
+}
+
+static void
+scas_uring_complete_send(struct scas_uring_t *uring, const struct io_uring_cqe *cqe)
+{
+    struct scas_uring_socket_t *socket;
+    int fd;
+
+    fd = URING_USER_DATA_FD(cqe->user_data);
+    socket = scas_uring_socket(uring, fd);
+    assert(socket->generation == URING_USER_DATA_GENERATION(cqe->user_data));
+
+    socket->flags &= ~URING_SOCKET_SENDING;
+
+    if ((socket->flags & URING_SOCKET_CLOSING) || cqe->res <= 0)
+    {
+        scas_uring_close(uring, fd);
+        return;
+    }
+
+    socket->send_result = cqe->res;
+    socket->flags |= URING_SOCKET_SENT;
+
+    scas_uring_service(uring, fd);
+}
+
+static void
+scas_uring_complete_poll(struct scas_uring_t *uring, const struct io_uring_cqe *cqe)
+{
+    struct scas_uring_socket_t *socket;
+    int fd;
+
+    fd = URING_USER_DATA_FD(cqe->user_data);
+    socket = scas_uring_socket(uring, fd);
+
+    if (socket->generation != URING_USER_DATA_GENERATION(cqe->user_data)
+        || (socket->flags & URING_SOCKET_CLOSING))
+    {
+        return;
+    }
+
+    socket->flags &= ~URING_SOCKET_POLLING;
+    scas_uring_service(uring, fd);
+}
+
+static void
+scas_uring_complete(struct scas_uring_t *uring, const struct io_uring_cqe *cqe)
+{
+    switch (URING_USER_DATA_OP(cqe->user_data))
+    {
+        case URING_OP_ACCEPT:
+            if (cqe->res >= 0)
+            {
+                scas_uring_open(uring, cqe->res);
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                scas_uring_accept(uring);
+            }
+            break;
+        case URING_OP_RECV:
+            scas_uring_complete_receive(uring, cqe);
+            break;
+        case URING_OP_SEND:
+            scas_uring_complete_send(uring, cqe);
+            break;
+        case URING_OP_POLL:
+            scas_uring_complete_poll(uring, cqe);
+            break;
+        case URING_OP_CANCEL:
+            break;
+        default:
+            assert(0 && "Garbled completion.");
+    }
+}
+
+int
+scas_uring_is_supported(void)
+{
+    struct scas_uring_t uring;
+
+    if (scas_uring_create(&uring) != 0)
+    {
+        return 0;
+    }
+
+    scas_uring_destroy(&uring);
+
+    return 1;
+}
+
+void
+scas_uring_reactor_run(int socket_fd, const int *done)
+{
+    struct scas_uring_t uring;
+    struct scas_connection_io_t io;
+
+    /*
+     * The ring can only be submitted to by the thread that created it.
+     */
+    VERIFY(scas_uring_create(&uring) == 0);
+
+    io.read = scas_uring_read;
+    io.write = scas_uring_write;
+    io.send_file = scas_uring_send_file;
+    io.context = &uring;
+
+    uring.listen_fd = socket_fd;
+    uring.pool = scas_connection_pool_create(&io);
+
+    scas_uring_accept(&uring);
+
+    while (!*done)
+    {
+        unsigned head;
+        unsigned tail;
+
+        scas_uring_enter(&uring, 1);
+
+        head = *uring.cq_head;
+        tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe cqe;
+
+            cqe = uring.cqes[head & uring.cq_mask];
+            __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+            scas_uring_complete(&uring, &cqe);
+        }
+
+        scas_uring_feed_starved(&uring);
+    }
+
+    close(socket_fd);
+    scas_uring_destroy(&uring);
+}
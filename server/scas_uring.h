@@ -0,0 +1,37 @@
+/***********************************************************************
+ * scas, Copyright (c) 2012-2013, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE for details.
+ ***********************************************************************/
+
+#ifndef SCAS_URING_H
+#define SCAS_URING_H
+
+/*
+ * An io_uring event loop for a reactor thread, used in place of epoll on
+ * kernels that support it (Linux 6.1 and later). Connections are taken
+ * from a multishot accept and read by a multishot receive into a ring of
+ * buffers registered with the kernel, and writes are submitted as sends,
+ * so every batch of transfers costs a single system call rather than a
+ * wakeup and a read or write each.
+ *
+ * The connections are driven by the same state machines as under epoll.
+ * Their reads are served out of the buffers received so far, and a write
+ * completes once its send does.
+ */
+
+/*
+ * Returns non-zero if the kernel supports everything the io_uring event
+ * loop relies on.
+ */
+int
+scas_uring_is_supported(void);
+
+/*
+ * Accepts connections on the listening socket and serves them until *done
+ * is set.
+ */
+void
+scas_uring_reactor_run(int socket_fd, const int *done);
+
+#endif